@@ -2,7 +2,7 @@
 /*----------------------------------------------------------------------------
 File: event.c
 Description: Rudp event handling: registering file descriptors and timeouts
-and eventloop using the select() system call.
+and eventloop using the epoll(), kqueue() or select() system calls.
 Author: Olof Hagsand and Peter Sjdin
 CVS Version: $Id: event.c,v 1.3 2007/05/03 10:46:06 psj Exp $
 This is free software; you can redistribute it and/or modify
@@ -26,6 +26,31 @@ GNU General Public License for more details.
 * arg is an argument given when the callback was registered.
 * If the return value of the callback is < 0, it is treated as an unrecoverable
 * error, and the program is terminated.
+*
+* The I/O backend is chosen at build time: epoll on Linux, kqueue on the BSDs
+* and Mac OS X, and select() everywhere else. Define EVENT_EPOLL, EVENT_KQUEUE
+* or EVENT_SELECT to override the choice. The epoll and kqueue backends
+* register a file descriptor once, in event_fd(), and only dispatch the
+* descriptors that are ready.
+* Regular files can not be polled; like select() does, we consider them to be
+* always readable.
+*
+* Timers are kept in a hierarchical timing wheel with a resolution of one
+* millisecond, as in the BSD and Linux kernels. Level 0 has one slot per
+* millisecond for the next 256 ms, and each further level covers 64 times
+* the range of the previous one. Registering and cancelling a timer are O(1).
+* Whenever a level wraps around, the current slot of the next level is
+* cascaded down into the lower levels.
+* event_timeout() returns a handle which can be given to
+* event_timeout_cancel(). The handle is valid until the timer has fired or
+* has been cancelled.
+* The event_data of fired and cancelled events are kept on a free list and
+* reused, so that (re)arming a timer does not go to malloc().
+* Functions registered with event_flush() are called once per iteration of
+* the event loop, before it waits for events. Callbacks may batch their
+* output, and have it sent with one system call there.
+* When the thread traces (see rudp_trace.h), the loop records each wait and
+* each callback it dispatches, with how late a timer fires.
 */
 
 #ifdef HAVE_CONFIG_H
@@ -35,66 +60,446 @@ GNU General Public License for more details.
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <errno.h>
 #include <sys/types.h>
 #include <sys/time.h>
-#include <sys/errno.h>
+#include <sys/stat.h>
+#include <sys/select.h>
 #include <netinet/in.h>
 #include <poll.h>
 #include <assert.h>
 
+#if !defined(EVENT_EPOLL) && !defined(EVENT_KQUEUE) && !defined(EVENT_SELECT)
+#if defined(__linux__)
+#define EVENT_EPOLL
+#elif defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__NetBSD__) || \
+  defined(__DragonFly__) || defined(__APPLE__)
+#define EVENT_KQUEUE
+#else
+#define EVENT_SELECT
+#endif
+#endif
+
+#if defined(EVENT_EPOLL)
+#include <sys/epoll.h>
+#elif defined(EVENT_KQUEUE)
+#include <sys/event.h>
+#endif
+
 #include "event.h"
+#include "rudp_trace.h"
+
+#define EVENT_MAXREADY 64 /* Max. number of descriptors dispatched per wakeup */
+#define EVENT_SLAB 64 /* Number of event_data allocated at once */
+
+#define TW_BITS0 8 /* Level 0 of the timing wheel: 256 slots of 1 ms */
+#define TW_BITS 6 /* Higher levels: 64 slots each */
+#define TW_LEVELS 4
+#define TW_SIZE0 (1 << TW_BITS0)
+#define TW_SIZE (1 << TW_BITS)
+#define TW_MAXDELAY ((1ULL << (TW_BITS0 + (TW_LEVELS-1)*TW_BITS)) - 1)
 
 /*
 * Internal types to handle eventloop
 */
+struct tw_slot {
+    struct event_data *ts_head; /* Timers in order of registration */
+    struct event_data **ts_tail; /* Next pointer of the last timer */
+};
+
 struct event_data {
     struct event_data *e_next; /* next in list */
+    struct event_data **e_pprev; /* timers: pointer to us in the wheel slot */
+    struct tw_slot *e_slot; /* timers: wheel slot we are in */
     int (*e_fn)(int, void*); /* callback function */
-    enum {EVENT_FD, EVENT_TIME} e_type; /* type of event */
+    enum {EVENT_FD, EVENT_TIME, EVENT_FLUSH} e_type; /* type of event */
     int e_fd; /* File descriptor */
-    struct timeval e_time; /* Timeout */
+    int e_always; /* Regular file: always ready, not known by the backend */
+    u_int64_t e_expires; /* Timeout in ms */
     void *e_arg; /* function argument */
     char e_string[32]; /* string for identification/debugging */
 };
 
 /*
-* Internal variables
+* Internal variables. They are thread local: each thread which registers
+* events and runs eventloop() has an event loop of its own, and no locks
+* are taken.
+*/
+#define EVENT_LOCAL static __thread
+EVENT_LOCAL struct event_data *ee = NULL;
+EVENT_LOCAL struct tw_slot tw0[TW_SIZE0]; /* Timing wheel, level 0 */
+EVENT_LOCAL struct tw_slot tw[TW_LEVELS-1][TW_SIZE]; /* Timing wheel, level 1- */
+EVENT_LOCAL u_int64_t tw_now; /* Next tick (ms) of the timing wheel to process */
+EVENT_LOCAL int tw_count = 0; /* Number of pending timers */
+EVENT_LOCAL struct event_data *ee_dead = NULL; /* fd events deleted during dispatch */
+EVENT_LOCAL int ee_always = 0; /* Number of always ready fd events */
+EVENT_LOCAL int ee_dispatching = 0; /* Are we dispatching fd events? */
+EVENT_LOCAL struct event_data *ee_free = NULL; /* Unused event_data, linked by e_next */
+EVENT_LOCAL struct event_data *ee_flush = NULL; /* Functions to call before waiting */
+EVENT_LOCAL int ee_flushing = 0; /* Are we calling the flush functions? */
+#if defined(EVENT_EPOLL) || defined(EVENT_KQUEUE)
+EVENT_LOCAL int ee_pollfd = -1; /* epoll or kqueue descriptor */
+#endif
+
+/*
+* Get an event_data from the free list, refilling it EVENT_SLAB at a time.
+*/
+static struct event_data *
+event_alloc() {
+  struct event_data *e;
+  int i;
+
+  if (ee_free == NULL) {
+    e = (struct event_data *)malloc(EVENT_SLAB * sizeof(struct event_data));
+    if (e == NULL)
+      return NULL;
+    for (i = 0; i < EVENT_SLAB; i++) {
+      e[i].e_next = ee_free;
+      ee_free = &e[i];
+    }
+  }
+  e = ee_free;
+  ee_free = e->e_next;
+  memset(e, 0, sizeof(struct event_data));
+  return e;
+}
+
+/*
+* Put an event_data back on the free list.
 */
-static struct event_data *ee = NULL;
-static struct event_data *ee_timers = NULL;
+static void
+event_release(struct event_data *e) {
+  e->e_slot = NULL;
+  e->e_fn = NULL;
+  e->e_next = ee_free;
+  ee_free = e;
+}
 
 /*
-* Sort into internal event list
+* Backend: register, deregister and wait for file descriptors.
+*/
+#if defined(EVENT_EPOLL)
+
+static int
+backend_init() {
+  if (ee_pollfd < 0 && (ee_pollfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+    perror("event: epoll_create1");
+    return -1;
+  }
+  return 0;
+}
+
+static int
+backend_add(struct event_data *e) {
+  struct epoll_event ev;
+
+  if (backend_init() < 0)
+    return -1;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.ptr = e;
+  if (epoll_ctl(ee_pollfd, EPOLL_CTL_ADD, e->e_fd, &ev) < 0) {
+    perror("event_fd: epoll_ctl");
+    return -1;
+  }
+  return 0;
+}
+
+static void
+backend_delete(struct event_data *e) {
+  struct epoll_event ev; /* Needed by kernels before 2.6.9 */
+
+  /* Fails harmlessly if the descriptor has already been closed */
+  epoll_ctl(ee_pollfd, EPOLL_CTL_DEL, e->e_fd, &ev);
+}
+
+static int
+backend_wait(struct timeval *t, struct event_data **ready, int max) {
+  struct epoll_event evs[EVENT_MAXREADY];
+  int timeout = -1;
+  int n, i;
+
+  if (backend_init() < 0)
+    return -1;
+  if (t) /* Round up, so that we never wake up before the timer expires */
+    timeout = t->tv_sec * 1000 + (t->tv_usec + 999) / 1000;
+  if (max > EVENT_MAXREADY)
+    max = EVENT_MAXREADY;
+  n = epoll_wait(ee_pollfd, evs, max, timeout);
+  for (i = 0; i < n; i++)
+    ready[i] = (struct event_data *)evs[i].data.ptr;
+  return n;
+}
+
+#elif defined(EVENT_KQUEUE)
+
+static int
+backend_init() {
+  if (ee_pollfd < 0 && (ee_pollfd = kqueue()) < 0) {
+    perror("event: kqueue");
+    return -1;
+  }
+  return 0;
+}
+
+static int
+backend_add(struct event_data *e) {
+  struct kevent kev;
+
+  if (backend_init() < 0)
+    return -1;
+  EV_SET(&kev, e->e_fd, EVFILT_READ, EV_ADD, 0, 0, e);
+  if (kevent(ee_pollfd, &kev, 1, NULL, 0, NULL) < 0) {
+    perror("event_fd: kevent");
+    return -1;
+  }
+  return 0;
+}
+
+static void
+backend_delete(struct event_data *e) {
+  struct kevent kev;
+
+  /* Fails harmlessly if the descriptor has already been closed */
+  EV_SET(&kev, e->e_fd, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+  kevent(ee_pollfd, &kev, 1, NULL, 0, NULL);
+}
+
+static int
+backend_wait(struct timeval *t, struct event_data **ready, int max) {
+  struct kevent kevs[EVENT_MAXREADY];
+  struct timespec ts;
+  int n, i;
+
+  if (backend_init() < 0)
+    return -1;
+  if (t)
+    TIMEVAL_TO_TIMESPEC(t, &ts);
+  if (max > EVENT_MAXREADY)
+    max = EVENT_MAXREADY;
+  n = kevent(ee_pollfd, NULL, 0, kevs, max, t ? &ts : NULL);
+  for (i = 0; i < n; i++)
+    ready[i] = (struct event_data *)kevs[i].udata;
+  return n;
+}
+
+#else /* EVENT_SELECT */
+
+static int
+backend_add(struct event_data *e) {
+  if (e->e_fd >= FD_SETSIZE) {
+    fprintf(stderr, "event_fd: fd %d exceeds FD_SETSIZE\n", e->e_fd);
+    return -1;
+  }
+  return 0;
+}
+
+static void
+backend_delete(struct event_data *e) {
+}
+
+static int
+backend_wait(struct timeval *t, struct event_data **ready, int max) {
+  struct event_data *e;
+  fd_set fdset;
+  int maxfd = -1;
+  int n;
+
+  FD_ZERO(&fdset);
+  for (e = ee; e; e = e->e_next)
+    if (!e->e_always) {
+      FD_SET(e->e_fd, &fdset);
+      if (e->e_fd > maxfd)
+        maxfd = e->e_fd;
+    }
+  if ((n = select(maxfd + 1, &fdset, NULL, NULL, t)) <= 0)
+    return n;
+  n = 0;
+  for (e = ee; e && n < max; e = e->e_next)
+    if (!e->e_always && FD_ISSET(e->e_fd, &fdset))
+      ready[n++] = e;
+  return n;
+}
+
+#endif /* EVENT_SELECT */
+
+/*
+* Timing wheel
+*/
+static u_int64_t
+tw_time(struct timeval *t, int roundup) {
+  return (u_int64_t)t->tv_sec * 1000 + (t->tv_usec + (roundup ? 999 : 0)) / 1000;
+}
+
+static u_int64_t
+tw_clock() {
+  struct timeval t;
+
+  gettimeofday(&t, NULL);
+  return tw_time(&t, 0);
+}
+
+/* Append to a slot, so that timers with the same expiry fire in FIFO order */
+static void
+tw_link(struct tw_slot *slot, struct event_data *e) {
+  if (slot->ts_head == NULL)
+    slot->ts_tail = &slot->ts_head;
+  e->e_next = NULL;
+  e->e_pprev = slot->ts_tail;
+  *slot->ts_tail = e;
+  slot->ts_tail = &e->e_next;
+  e->e_slot = slot;
+}
+
+static void
+tw_unlink(struct event_data *e) {
+  *e->e_pprev = e->e_next;
+  if (e->e_next)
+    e->e_next->e_pprev = e->e_pprev;
+  else
+    e->e_slot->ts_tail = e->e_pprev;
+  e->e_next = NULL;
+  e->e_pprev = NULL;
+  e->e_slot = NULL;
+}
+
+/* Put a timer in the slot matching its distance from now */
+static void
+tw_insert(struct event_data *e) {
+  u_int64_t expires = e->e_expires;
+  u_int64_t delta;
+  int l;
+
+  if (expires < tw_now)
+    expires = tw_now;
+  delta = expires - tw_now;
+  if (delta > TW_MAXDELAY) { /* Will be put back when cascaded */
+    delta = TW_MAXDELAY;
+    expires = tw_now + delta;
+  }
+  if (delta < TW_SIZE0) {
+    tw_link(&tw0[expires & (TW_SIZE0-1)], e);
+    return;
+  }
+  for (l = 0; l < TW_LEVELS-2; l++)
+    if (delta < 1ULL << (TW_BITS0 + (l+1)*TW_BITS))
+      break;
+  tw_link(&tw[l][(expires >> (TW_BITS0 + l*TW_BITS)) & (TW_SIZE-1)], e);
+}
+
+/* Move the timers of one slot down to the lower levels */
+static int
+tw_cascade(int l) {
+  int index = (tw_now >> (TW_BITS0 + l*TW_BITS)) & (TW_SIZE-1);
+  struct event_data *e;
+
+  while ((e = tw[l][index].ts_head)) {
+    tw_unlink(e);
+    tw_insert(e);
+  }
+  return index;
+}
+
+/* Run all timers which have expired at time <now> */
+static int
+tw_run(u_int64_t now) {
+  struct event_data *e;
+  int index, l;
+
+  while (tw_count && tw_now <= now) {
+    index = tw_now & (TW_SIZE0-1);
+    for (l = 0; index == 0 && l < TW_LEVELS-1; l++)
+      index = tw_cascade(l);
+    index = tw_now & (TW_SIZE0-1);
+    /* Callbacks may add timers which expire right away, to the same slot */
+    while ((e = tw0[index].ts_head)) {
+      tw_unlink(e);
+      tw_count--;
+      #ifdef DEBUG
+      fprintf(stderr, "eventloop: timeout : %s[arg: %p]\n",
+      e->e_string, e->e_arg);
+      #endif /* DEBUG */
+      RUDP_TRACE_EVENT(RUDP_TRACE_TIMER, -1, (int)(now - e->e_expires), e->e_string);
+      if ((*e->e_fn)(0, e->e_arg) < 0) {
+        event_release(e);
+        return -1;
+      }
+      switch(e->e_type) {
+        case EVENT_TIME:
+        event_release(e);
+        break;
+        default:
+        fprintf(stderr, "eventloop: illegal e_type:%d\n", e->e_type);
+      }
+    }
+    tw_now++;
+  }
+  return 0;
+}
+
+/*
+* Tick of the next timer to fire, or of the next wrap around of level 0 if
+* that comes first, since timers on the higher levels must then be cascaded.
+*/
+static u_int64_t
+tw_next() {
+  u_int64_t t;
+
+  if ((tw_now & (TW_SIZE0-1)) == 0)
+    return tw_now;
+  for (t = tw_now; tw0[t & (TW_SIZE0-1)].ts_head == NULL; t++)
+    if (((t+1) & (TW_SIZE0-1)) == 0)
+      return t+1;
+  return t;
+}
+
+/*
+* Register a timer in the timing wheel.
 * Given an absolute timestamp, register function to call.
+* Returns a handle for event_timeout_cancel(), or NULL on error.
 */
-int
+event_timer_t
 event_timeout(struct timeval t, int (*fn)(int, void*), void *arg, char *str) {
-  struct event_data *e, *e1, **e_prev;
+  struct event_data *e;
 
-  e = (struct event_data *)malloc(sizeof(struct event_data));
+  e = event_alloc();
   if (e == NULL) {
     perror("event_timeout: malloc");
-    return -1;
+    return NULL;
   }
-  memset(e, 0, sizeof(struct event_data));
   strcpy(e->e_string, str);
   e->e_fn = fn;
   e->e_arg = arg;
   e->e_type = EVENT_TIME;
-  e->e_time = t;
+  e->e_expires = tw_time(&t, 1); /* Never fire early */
 
-  /* Sort into right place */
-  e_prev = &ee_timers;
-  for (e1 = ee_timers; e1; e1 =e1->e_next) {
-    if (timercmp(&e->e_time, &e1->e_time, <))
-      break;
-    e_prev = &e1->e_next;
-  }
-  e->e_next = e1;
-  *e_prev = e;
+  if (tw_count++ == 0)
+    tw_now = tw_clock(); /* The wheel is empty, no need to catch up */
+  tw_insert(e);
+  return e;
+}
+
+/*
+* Cancel a timer, given the handle returned by event_timeout().
+*/
+int event_timeout_cancel(event_timer_t timer) {
+  struct event_data *e = (struct event_data *)timer;
+
+  if (e == NULL || e->e_slot == NULL)
+    return -1;
+  tw_unlink(e);
+  tw_count--;
+  event_release(e);
   return 0;
 }
 
+/*
+* Returns the callback argument of a pending timer.
+*/
+void *event_timeout_arg(event_timer_t timer) {
+  return ((struct event_data *)timer)->e_arg;
+}
+
 /*
 * Deregister a rudp event.
 */
@@ -105,8 +510,26 @@ event_delete(struct event_data **firstp, int (*fn)(int, void*), void *arg) {
   e_prev = firstp;
   for (e = *firstp; e; e = e->e_next) {
     if (fn == e->e_fn && arg == e->e_arg) {
+      if (e->e_type == EVENT_FLUSH && ee_flushing) {
+        /* The flush pass may go on to e->e_next, unlink it after the pass */
+        e->e_fn = NULL;
+        return 0;
+      }
       *e_prev = e->e_next;
-      free(e);
+      if (e->e_type == EVENT_FD) {
+        if (e->e_always)
+          ee_always--;
+        else
+          backend_delete(e);
+        if (ee_dispatching) {
+          /* It may still be in the ready list, free it after dispatch */
+          e->e_fn = NULL;
+          e->e_next = ee_dead;
+          ee_dead = e;
+          return 0;
+        }
+      }
+      event_release(e);
       return 0;
     }
     e_prev = &e->e_next;
@@ -116,10 +539,24 @@ event_delete(struct event_data **firstp, int (*fn)(int, void*), void *arg) {
 }
 
 /*
-* Deregister a rudp event.
+* Deregister a rudp timer event, given its callback and argument.
+* This searches all pending timers; use event_timeout_cancel() when possible.
 */
 int event_timeout_delete(int (*fn)(int, void*), void *arg) {
-  return event_delete(&ee_timers, fn, arg);
+  struct event_data *e;
+  int i, l;
+
+  for (i = 0; i < TW_SIZE0; i++)
+    for (e = tw0[i].ts_head; e; e = e->e_next)
+      if (fn == e->e_fn && arg == e->e_arg)
+        return event_timeout_cancel(e);
+  for (l = 0; l < TW_LEVELS-1; l++)
+    for (i = 0; i < TW_SIZE; i++)
+      for (e = tw[l][i].ts_head; e; e = e->e_next)
+        if (fn == e->e_fn && arg == e->e_arg)
+          return event_timeout_cancel(e);
+  /* Not found */
+  return -1;
 }
 
 /*
@@ -138,23 +575,62 @@ int event_fd_delete(int (*fn)(int, void*), void *arg)
 */
 int event_fd(int fd, int (*fn)(int, void*), void *arg, char *str) {
   struct event_data *e;
+  struct stat st;
 
-  e = (struct event_data *)malloc(sizeof(struct event_data));
+  e = event_alloc();
   if (e==NULL) {
     perror("event_fd: malloc");
     return -1;
   }
-  memset(e, 0, sizeof(struct event_data));
   strcpy(e->e_string, str);
   e->e_fd = fd;
   e->e_fn = fn;
   e->e_arg = arg;
   e->e_type = EVENT_FD;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+    e->e_always = 1;
+  else if (backend_add(e) < 0) {
+    event_release(e);
+    return -1;
+  }
+  if (e->e_always)
+    ee_always++;
   e->e_next = ee;
   ee = e;
   return 0;
 }
 
+/*
+* Register a function to be called once per iteration of the event loop,
+* before it waits for events, with argument <arg>. The fd argument is -1.
+* Flush functions do not keep the event loop running.
+*/
+int event_flush(int (*fn)(int, void*), void *arg, char *str) {
+  struct event_data *e;
+
+  e = event_alloc();
+  if (e==NULL) {
+    perror("event_flush: malloc");
+    return -1;
+  }
+  strcpy(e->e_string, str);
+  e->e_fd = -1;
+  e->e_fn = fn;
+  e->e_arg = arg;
+  e->e_type = EVENT_FLUSH;
+  e->e_next = ee_flush;
+  ee_flush = e;
+  return 0;
+}
+
+/*
+* Deregister a flush function.
+*/
+int event_flush_delete(int (*fn)(int, void*), void *arg)
+{
+  return event_delete(&ee_flush, fn, arg);
+}
+
 
 /*
 * Rudp event loop.
@@ -162,64 +638,81 @@ int event_fd(int fd, int (*fn)(int, void*), void *arg, char *str) {
 */
 int
 eventloop() {
-  struct event_data *e, *e1;
-  fd_set fdset;
-  int n;
-  struct timeval t, t0;
-
-  while (ee || ee_timers) {
-    FD_ZERO(&fdset);
-    for (e=ee; e; e=e->e_next)
-      if (e->e_type == EVENT_FD)
-        FD_SET(e->e_fd, &fdset);
-
-    if (ee_timers) {
-      gettimeofday(&t0, NULL);
-      timersub(&ee_timers->e_time, &t0, &t);
-      if (t.tv_sec < 0)
-        n = 0;
+  struct event_data *ready[EVENT_MAXREADY];
+  struct event_data *e, **ep;
+  int n, i;
+  struct timeval t, *tp;
+  u_int64_t now, next;
+
+  while (ee || tw_count) {
+    /* Send what the callbacks of the last iteration have batched */
+    ee_flushing = 1;
+    for (e = ee_flush; e; e = e->e_next)
+      if (e->e_fn != NULL && (*e->e_fn)(-1, e->e_arg) < 0) {
+        ee_flushing = 0;
+        return -1;
+      }
+    ee_flushing = 0;
+    for (ep = &ee_flush; (e = *ep); ) {
+      if (e->e_fn == NULL) { /* Deleted by a flush function */
+        *ep = e->e_next;
+        event_release(e);
+      }
       else
-        n = select(FD_SETSIZE, &fdset, NULL, NULL, &t);
+        ep = &e->e_next;
     }
-    else
-      n = select(FD_SETSIZE, &fdset, NULL, NULL, NULL);
+    if (!ee && !tw_count)
+      break;
 
-    if (n == -1)
-      if (errno != EINTR)
-      perror("eventloop: select");
-    if (n == 0) { /* Timeout */
-      e = ee_timers;
-    ee_timers = ee_timers->e_next;
-    #ifdef DEBUG
-    fprintf(stderr, "eventloop: timeout : %s[arg: %x]\n",
-    e->e_string, (int)e->e_arg);
-    #endif /* DEBUG */
-    if ((*e->e_fn)(0, e->e_arg) < 0) {
-      return -1;
+    tp = NULL;
+    if (ee_always) {
+      /* Poll only, there is always something to do */
+      timerclear(&t);
+      tp = &t;
     }
-    switch(e->e_type) {
-      case EVENT_TIME:
-      free(e);
-      break;
-      default:
-      fprintf(stderr, "eventloop: illegal e_type:%d\n", e->e_type);
+    else if (tw_count) {
+      now = tw_clock();
+      next = tw_next();
+      next = next > now ? next - now : 0;
+      t.tv_sec = next / 1000;
+      t.tv_usec = (next % 1000) * 1000;
+      tp = &t;
     }
-    continue;
-  }
-  e = ee;
-    while (e) {
-      e1 = e->e_next;
-      if (e->e_type == EVENT_FD && FD_ISSET(e->e_fd, &fdset)) {
-        #ifdef DEBUG
-          fprintf(stderr, "eventloop: socket rcv: %s[fd: %d arg: %x]\n",
-          e->e_string, e->e_fd, (int)e->e_arg);
-        #endif /* DEBUG */
-        if ((*e->e_fn)(e->e_fd, e->e_arg) < 0) {
-          return -1;
-        }
+
+    RUDP_TRACE_EVENT(RUDP_TRACE_WAIT, -1, tp ? (int)(tp->tv_sec * 1000 + tp->tv_usec / 1000) : -1, NULL);
+    n = backend_wait(tp, ready, EVENT_MAXREADY);
+    if (n == -1) {
+      if (errno != EINTR)
+        perror("eventloop: wait");
+      n = 0;
+    }
+    for (e = ee; e && ee_always && n < EVENT_MAXREADY; e = e->e_next)
+      if (e->e_always)
+        ready[n++] = e;
+
+    ee_dispatching = 1;
+    for (i = 0; i < n; i++) {
+      e = ready[i];
+      if (e->e_fn == NULL) /* Deleted by an earlier callback */
+        continue;
+      #ifdef DEBUG
+        fprintf(stderr, "eventloop: socket rcv: %s[fd: %d arg: %p]\n",
+        e->e_string, e->e_fd, e->e_arg);
+      #endif /* DEBUG */
+      RUDP_TRACE_EVENT(RUDP_TRACE_FD, e->e_fd, 0, e->e_string);
+      if ((*e->e_fn)(e->e_fd, e->e_arg) < 0) {
+        return -1;
       }
-      e = e1;
     }
+    ee_dispatching = 0;
+    while ((e = ee_dead)) {
+      ee_dead = e->e_next;
+      event_release(e);
+    }
+
+    /* Timeouts */
+    if (tw_run(tw_clock()) < 0)
+      return -1;
   }
   #ifdef DEBUG
     fprintf(stderr, "eventloop: returning 0\n");
@@ -31,11 +31,19 @@ GNU General Public License for more details.
 */
 
 
+/*
+* Handle of a registered timer, returned by event_timeout().
+* Valid until the timer has fired or has been cancelled.
+*/
+typedef void *event_timer_t;
+
 /*
 * Prototypes
 */
-int event_timeout(struct timeval timer,
+event_timer_t event_timeout(struct timeval timer,
 int (*callback)(int, void*), void *callback_arg, char *idstr);
+int event_timeout_cancel(event_timer_t timer);
+void *event_timeout_arg(event_timer_t timer);
 
 int
 event_periodic(int secs,
@@ -47,6 +55,8 @@ int event_timeout_delete(int (*callback)(int, void*), void *callback_arg);
 int event_fd_delete(int (*callback)(int, void*), void *callback_arg);
 int event_fd(int fd, int (*callback)(int, void*), void *callback_arg, 
              char *idstr);
+int event_flush(int (*callback)(int, void*), void *callback_arg, char *idstr);
+int event_flush_delete(int (*callback)(int, void*), void *callback_arg);
 int eventloop();
 
 #endif /* EVENT_H */
@@ -1,6 +1,11 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* recvmmsg() and sendmmsg() */
+#endif
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <string.h>
 #include <ctype.h>
 #include <netdb.h>
@@ -9,13 +14,18 @@
 #include <sys/time.h>
 #include <sys/file.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <time.h>
+#include <errno.h>
+#include <stdarg.h>
 
 #include "event.h"
 #include "rudp.h"
 #include "rudp_api.h"
+#include "rudp_cc.h"
+#include "rudp_trace.h"
 
 /** rudp.c
  *
@@ -26,79 +36,451 @@
 
 #define DROP 0 /* Probability of packet loss */
 
+#ifndef RUDP_LOG_LEVEL
+#define RUDP_LOG_LEVEL RUDP_LOG_WARN /* Highest log level compiled in, -DRUDP_LOG_LEVEL=RUDP_LOG_DEBUG for the packet trace */
+#endif
+
+/* Logs a message if its level is compiled in and enabled. The arguments are
+ * not evaluated otherwise */
+#define RUDP_LOG(level, ...) do { \
+    if((level) <= rudp_log_level) { \
+      rudp_log(level, __VA_ARGS__); \
+    } \
+  } while(0)
+#if RUDP_LOG_LEVEL >= RUDP_LOG_WARN
+#define RUDP_WARN(...) RUDP_LOG(RUDP_LOG_WARN, __VA_ARGS__)
+#else
+#define RUDP_WARN(...) do { } while(0)
+#endif
+#if RUDP_LOG_LEVEL >= RUDP_LOG_DEBUG
+#define RUDP_DEBUG(...) RUDP_LOG(RUDP_LOG_DEBUG, __VA_ARGS__)
+#else
+#define RUDP_DEBUG(...) do { } while(0)
+#endif
+
+#if defined(__linux__) && !defined(RUDP_NO_MMSG)
+#define RUDP_MMSG /* Batches go through recvmmsg() and sendmmsg(), else one recvfrom() or sendto() per packet */
+#endif
+
+#ifdef RUDP_MMSG
+#include <netinet/udp.h>
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103 /* Linux 4.18 and later */
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104 /* Linux 5.0 and later */
+#endif
+#endif /* RUDP_MMSG */
+
+#define RUDP_GSOSEGS 64 /* Max. number of packets sent as one GSO datagram */
+#define RUDP_GSOBYTES 65507 /* Max. size of a GSO datagram, that of any UDP datagram */
+#define RUDP_GROBATCH 8 /* Max. number of GRO datagrams received at once */
+#define RUDP_GROBUFSIZE 65536 /* Receive buffer for a GRO datagram */
+
+#ifdef __linux__
+#include <sys/eventfd.h>
+#define RUDP_EVENTFD /* rudp_post() wakes up the event loop through an eventfd, else a pipe */
+#endif
+
+#define RUDP_POSTRING 1024 /* Number of slots in a submission queue, a power of two */
+
 typedef enum {SYN_SENT = 0, OPENING, OPEN, FIN_SENT} rudp_state_t; /* RUDP States */
 
 typedef enum { false = 0, true } bool_t;
 
+/* A packet is sent and received exactly as laid out here, but only the
+ * header and the header.length bytes of payload are put on the wire. One on
+ * the stack has room for any payload; the window, the batches and the receive
+ * buffers only allocate room for the payload the socket's MTU allows */
 struct rudp_packet {
   struct rudp_hdr header;
-  int payload_length;
-  char payload[RUDP_MAXPKTSIZE];
+  char payload[RUDP_MAXPAYLOAD];
+}__attribute__ ((packed));
+
+#define RUDP_PKTLEN(p) (sizeof(struct rudp_hdr) + (p)->header.length) /* Bytes on the wire */
+
+/* The data of rudp_sendto_many(), which the queues of all its peers share */
+struct payload {
+  int refs; /* Number of queue items which refer to it */
+  char data[];
 };
 
-/* Outgoing data queue */
+/* Outgoing data queue. An item holds a copy of the data of one packet, or a
+ * message, which is sent in as many packets as it takes. The data of a message
+ * is either copied, or still in the buffers passed to rudp_sendv() */
 struct data {
-  void *item;
-  int len;
   struct data *next;
+  int len; /* Bytes of data, of a message those not sent yet */
+  bool_t message; /* Is this a message, rather than one packet in item? */
+  char *copy; /* The data of a message which RUDP copied, else it is in iov */
+  struct payload *shared; /* The payload copy is in, if other queues share it */
+  int iovcnt; /* Number of buffers of a message from rudp_sendv(), 0 for rudp_sendto() */
+  int iov_index; /* The unsent data starts at iov_offset in buffer iov_index, or in copy */
+  int iov_offset;
+  union {
+    char item[RUDP_MAXPKTSIZE];
+    struct {
+      struct iovec iov[RUDP_MAXIOV];
+      struct sockaddr_in peer; /* Who the message goes to */
+    } msg;
+  };
+};
+
+/* A free list of equally sized objects, which are allocated a slab at a time */
+struct pool {
+  int size; /* Object size */
+  int per_slab; /* Number of objects allocated at once */
+  void *free_list; /* Unused objects, each starting with the pointer to the next */
+  struct pool_slab *slabs;
+};
+
+struct pool_slab {
+  struct pool_slab *next;
+  /* per_slab objects follow */
+};
+
+#define RUDP_POOLSLAB 16 /* Min. number of objects per pool slab */
+
+/* A received packet. The kernel receives into it, the protocol parses it in
+ * place, and the application reads the payload from it. The reorder buffer
+ * and an application which holds on to the packet keep references */
+struct rudp_buf {
+  int refs; /* Changed atomically, as other threads may hold and release it */
+  struct buf_pool *pool; /* The pool for buffers of its size, which it goes back to, NULL for a reassembled message */
+  struct rudp_packet packet __attribute__ ((aligned (8))); /* The application may read the payload as a struct */
+};
+
+/* Receive buffers with room for payloads of one size. Sockets of a thread
+ * with the same MTU share a pool. Only that thread takes buffers from it,
+ * but any thread may release them, so they come back on a list which is
+ * pushed to without locks and which the pool takes over once it runs dry */
+struct buf_pool {
+  struct pool pool;
+  void *released; /* Buffers no longer referenced, each starting with the pointer to the next */
+  int payload; /* Bytes of payload a buffer has room for */
+  struct buf_pool *next;
+};
+
+/* Packets to be sent with one system call */
+struct rudp_batch {
+  int count; /* Number of packets in the batch */
+  struct sockaddr_in addr[RUDP_MAXBATCH]; /* Peer the packet goes to */
+  int stride; /* Bytes allocated per packet, enough for the socket's MTU */
+  char *packets; /* RUDP_MAXBATCH packets, see batch_packet() */
+};
+
+/* Datagrams received with one system call */
+struct rudp_rxbatch {
+  int count; /* Number of datagrams in the batch */
+  int len[RUDP_MAXBATCH]; /* Bytes received */
+  int segment[RUDP_MAXBATCH]; /* Size of the packets a datagram consists of */
+  char *buf[RUDP_MAXBATCH]; /* Where a datagram was received, rbuf[] or the GRO buffer */
+  struct sockaddr_in addr[RUDP_MAXBATCH]; /* Peer the datagram came from */
+  struct rudp_buf *rbuf[RUDP_MAXBATCH]; /* Buffers to receive into, refilled from the socket's pool when taken */
+  bool_t gro; /* Were the datagrams received into the GRO buffers? */
+};
+
+/* A slot in the sliding window, holding a transmitted but unacknowledged packet */
+struct window_slot {
+  int retransmission_attempts;
+  bool_t sacked; /* Has the receiver selectively acknowledged the packet? */
+  event_timer_t timer; /* Handle used to cancel the DATA timeout event */
+  struct timeval sent_time; /* When the packet was last transmitted */
+  struct rudp_packet packet; /* Last, so that unused payload bytes need not be copied or allocated */
 };
 
 struct sender_session {
   rudp_state_t status; /* Protocol state */
   u_int32_t seqno;
-  struct rudp_packet *sliding_window[RUDP_WINDOW];
-  int retransmission_attempts[RUDP_WINDOW];
+  u_int32_t syn_seqno; /* Sequence number of the SYN */
+  char *sliding_window; /* Circular buffer, packet seqno is in slot seqno % window_capacity, see window_slot() */
+  int slot_size; /* Bytes allocated per window slot, enough for payload_max */
+  int window_capacity; /* Number of allocated slots, a power of two which grows with the window size */
+  u_int32_t window_base; /* Sequence number of the oldest unacknowledged packet */
+  int window_count; /* Number of unacknowledged packets, seqnos window_base to window_base+window_count-1 */
   struct data *data_queue; /* Queue of unsent data */
+  struct data *data_queue_tail; /* Last item of data_queue */
+  int queued; /* Bytes of data in data_queue */
+  bool_t blocked; /* Was the application told that the queue is full? */
+  bool_t writable; /* Is RUDP_EVENT_WRITABLE due when the event loop iteration ends? */
   bool_t session_finished; /* Has the FIN we sent been ACKed? */
-  void *syn_timeout_arg; /* Argument pointer used to delete SYN timeout event */
-  void *fin_timeout_arg; /* Argument pointer used to delete FIN timeout event */
-  void *data_timeout_arg[RUDP_WINDOW]; /* Argument pointers used to delete DATA timeout events */
+  event_timer_t syn_timer; /* Handle used to cancel the SYN timeout event */
+  event_timer_t fin_timer; /* Handle used to cancel the FIN timeout event */
   int syn_retransmit_attempts;
   int fin_retransmit_attempts;
+  struct timeval syn_sent_time; /* When the SYN was last transmitted */
+  struct timeval syn_first_sent; /* When the SYN was first transmitted */
+  int handshake; /* Microseconds from the first SYN to its ACK, 0 until then */
+  bool_t rtt_measured; /* Has an RTT sample been taken yet? */
+  int srtt; /* Smoothed RTT in microseconds */
+  int rttvar; /* RTT variation in microseconds */
+  int rto; /* Retransmission timeout in microseconds, before backoff */
+  int dup_acks; /* Number of ACKs in a row which did not advance window_base, kept during fast recovery */
+  bool_t in_recovery; /* Is a fast retransmit being followed up on? */
+  u_int32_t recover; /* End of the window when fast recovery began, it ends once that is ACKed */
+  u_int32_t high_rxt; /* Packets before this seqno have been retransmitted during fast recovery */
+  struct rudp_cc cc; /* Congestion control state */
+  event_timer_t pace_timer; /* Handle of the event which resumes sending when pacing allows */
+  int payload; /* Bytes of data per DATA packet, grows as path MTU discovery goes on */
+  int payload_max; /* Bytes of data which fit in a packet of the socket's MTU */
+  int probe_low; /* Largest payload known to get through to the peer */
+  int probe_high; /* Largest payload not known to be too large */
+  int probe_size; /* Payload of the probe in flight, 0 if there is none */
+  int probe_attempts; /* Number of times the probe in flight has been lost */
+  event_timer_t probe_timer; /* Handle used to cancel the PROBE timeout event */
+};
+
+/* A slot in the receiver's reorder buffer */
+struct reorder_slot {
+  bool_t used;
+  struct rudp_buf *buf; /* The packet, kept without copying it */
 };
 
 struct receiver_session {
   rudp_state_t status; /* Protocol state */
   u_int32_t expected_seqno;
+  u_int32_t initial_seqno; /* Sequence number of the first DATA packet, one after the SYN */
+  int window; /* Max. number of packets the sender has unacknowledged, as its SYN tells */
   bool_t session_finished; /* Have we received a FIN from the sender? */
+  struct reorder_slot *reorder_buffer; /* Packets received out of order, packet seqno is in slot seqno % reorder_capacity */
+  int reorder_capacity; /* Number of allocated slots, a power of two */
+  int reorder_count; /* Number of packets in the reorder buffer */
+  int unacked; /* In-order DATA packets received since the last ACK */
+  event_timer_t ack_timer; /* Handle of the event which sends a delayed ACK */
+  struct rudp_buf *message; /* The fragments of a message received so far, in its payload */
+  int message_len;
+  int message_capacity; /* Number of payload bytes allocated for message */
+  bool_t message_discard; /* Is the rest of a message too long for the socket dropped? */
+};
+
+/* The SYNs a socket has accepted lately, with RUDP_OPT_NOREPLAY */
+struct syn_history {
+  int next; /* Slot to record the next SYN in, the oldest once all are used */
+  int count; /* Number of slots used */
+  struct {
+    struct sockaddr_in addr;
+    u_int32_t seqno;
+  } syn[RUDP_SYNHISTORY];
 };
 
 struct session {
   struct sender_session *sender;
   struct receiver_session *receiver;
   struct sockaddr_in address;
+  struct timeval last_active; /* When the session was created or last heard from its peer */
+  struct rudp_stats stats; /* Counters, the state is filled in by rudp_get_stats() */
   struct session *next;
+  struct session *prev;
 };
 
 /* Keeps state for potentially multiple active sockets */
 struct rudp_socket_list {
   rudp_socket_t rsock;
   bool_t close_requested;
+  int window; /* Max. number of unacknowledged packets per sender session */
+  int delack; /* Number of in-order DATA packets per ACK */
+  const struct rudp_cc_ops *cc_ops; /* Congestion control algorithm for new sender sessions */
   int (*recv_handler)(rudp_socket_t, struct sockaddr_in *, char *, int);
+  int (*recvbuf_handler)(rudp_socket_t, struct sockaddr_in *, rudp_buf_t, char *, int);
   int (*handler)(rudp_socket_t, rudp_event_t, struct sockaddr_in *);
-  struct session *sessions_list_head;
+  int maxmsg; /* Max. size of a message sent or received */
+  int sndbuf; /* Bytes queued per sender session before it counts as full */
+  int writable_pending; /* Number of sender sessions which are due RUDP_EVENT_WRITABLE */
+  int earlydata; /* Number of DATA packets a new sender session sends along with its SYN */
+  struct syn_history *syn_history; /* SYNs accepted lately, NULL unless RUDP_OPT_NOREPLAY is set */
+  int (*sendv_handler)(rudp_socket_t, struct sockaddr_in *, const struct iovec *, int);
+  struct data *sent_messages; /* Messages from rudp_sendv() to report to sendv_handler */
+  struct data *sent_messages_tail;
+  struct reaped_peer *reaped; /* Peers due RUDP_EVENT_TIMEOUT for a freed session */
+  struct reaped_peer *reaped_tail;
+  struct session *sessions_list_head; /* Sessions, the least recently active first */
+  struct session *sessions_list_tail;
+  int session_count; /* Number of sessions in the list */
+  int idle_timeout; /* Milliseconds after which a silent session is freed, 0 for never */
+  int max_sessions; /* Max. number of sessions, 0 for no limit */
+  event_timer_t idle_timer; /* Handle of the event which frees the idle sessions */
+  struct rudp_stats stats; /* Counters of all sessions, including freed ones */
+  struct emulation *emulation; /* Emulated network conditions, NULL for none */
+  struct session **session_table; /* Open addressing hash table of the sessions, by peer address */
+  int table_capacity; /* Number of slots in session_table, a power of two */
+  int table_used; /* Number of slots holding a session or deleted_session */
+  struct pool data_pool; /* struct data for the queues of the sender sessions */
+  struct pool timer_pool; /* struct timeoutargs for the retransmission timers */
+  int batch; /* Max. number of packets per batch */
+  struct rudp_rxbatch *rx; /* Datagrams received by the last receive_callback() */
+  struct rudp_batch *tx; /* Packets to send when the event loop iteration ends */
+  bool_t gso_supported; /* Can the kernel segment UDP datagrams (UDP_SEGMENT)? */
+  bool_t gro_supported; /* Can the kernel coalesce UDP datagrams (UDP_GRO)? */
+  bool_t gso; /* Are runs of DATA packets sent as one datagram? */
+  bool_t gro; /* Are coalesced datagrams received? */
+  char *gro_buf; /* RUDP_GROBATCH buffers for coalesced datagrams */
+  int mtu; /* Bytes of the largest IP packet sent or received */
+  int payload_max; /* Bytes of data which fit in a packet of that size */
+  bool_t pmtud; /* Do new sender sessions probe for the largest packets the path takes? */
+  struct buf_pool *buf_pool; /* Receive buffers with room for payload_max bytes */
+  struct rudp_postq *postq; /* Data from other threads, NULL until rudp_postq() */
+  bool_t recv_paused; /* Has rudp_recv_pause() stopped reading the socket? */
   struct rudp_socket_list *next;
 };
 
-/* Arguments for timeout callback function */
+/* A peer whose session was freed while data to or from it was cut off. The
+ * event is raised when the event loop iteration ends, not while the session
+ * table is being changed */
+struct reaped_peer {
+  struct sockaddr_in peer;
+  struct reaped_peer *next;
+};
+
+/* A slot in a submission queue. seq tells whose turn the slot is: it is
+ * free for the producer of position n when seq == n, and holds data for the
+ * event loop to take when seq == n + 1 */
+struct rudp_post {
+  unsigned int seq;
+  int len;
+  struct sockaddr_in to;
+  char *copy; /* The data, if it is longer than a packet */
+  char item[RUDP_MAXPKTSIZE];
+};
+
+/* Submission queue of a socket: a bounded ring which any number of threads
+ * put data into without locks, and which the socket's event loop drains */
+struct rudp_postq {
+  rudp_socket_t rsock;
+  unsigned int head; /* Next position the event loop takes, only it touches head */
+  unsigned int tail; /* Next position a producer claims */
+  int pending; /* Has a producer woken up the event loop, which has not drained yet? */
+  bool_t blocked; /* Is draining held off until the queue for blocked_to has room? */
+  struct sockaddr_in blocked_to;
+  int wakeup[2]; /* The event loop reads from wakeup[0], producers write to wakeup[1] */
+  struct rudp_post ring[RUDP_POSTRING];
+};
+
+/* Network conditions emulated for the packets a socket sends, set with
+ * RUDP_OPT_LOSS, RUDP_OPT_DELAY and RUDP_OPT_REORDER */
+struct emulation {
+  int loss; /* Per mille of the packets which are dropped */
+  int delay; /* Milliseconds each packet is held back */
+  int reorder; /* Per mille of the packets which are held back longer */
+  unsigned int seed; /* rand_r() state */
+  struct delayed *held; /* Packets held back, in no particular order */
+};
+
+/* A packet held back by the emulation until its timer fires */
+struct delayed {
+  struct rudp_socket_list *socket;
+  struct sockaddr_in to;
+  event_timer_t timer;
+  struct delayed *next;
+  struct delayed *prev;
+  struct rudp_packet packet; /* Last, so that only the bytes on the wire are allocated */
+};
+
+/* Arguments for timeout callback function. A DATA packet to be retransmitted
+ * is found in the sliding window by its sequence number, and SYN and FIN
+ * packets consist of the header only */
 struct timeoutargs {
-  rudp_socket_t fd;
-  struct rudp_packet *packet;
-  struct sockaddr_in *recipient;
+  struct rudp_socket_list *socket;
+  struct sockaddr_in recipient;
+  u_int16_t type;
+  u_int32_t seqno;
 };
 
 /* Prototypes */
 void create_sender_session(struct rudp_socket_list *socket, u_int32_t seqno, struct sockaddr_in *to, struct data **data_queue);
-void create_receiver_session(struct rudp_socket_list *socket, u_int32_t seqno, struct sockaddr_in *addr);
-struct rudp_packet *create_rudp_packet(u_int16_t type, u_int32_t seqno, int len, char *payload);
+struct sender_session *alloc_sender_session(struct rudp_socket_list *socket, u_int32_t seqno, struct data **data_queue);
+void create_receiver_session(struct rudp_socket_list *socket, u_int32_t seqno, int window, struct sockaddr_in *addr);
+void init_rudp_packet(struct rudp_packet *packet, u_int16_t type, u_int32_t seqno, int len, char *payload);
+void init_syn_packet(struct rudp_packet *packet, struct rudp_socket_list *socket, u_int32_t seqno);
+int syn_window(struct rudp_socket_list *socket, struct rudp_packet *p);
+struct rudp_socket_list *find_socket(rudp_socket_t rsocket);
+int rsock_fd(rudp_socket_t rsocket);
+struct window_slot *window_slot(struct sender_session *sender, int i);
+struct window_slot *window_find(struct sender_session *sender, u_int32_t seqno);
+struct window_slot *window_add(struct rudp_socket_list *socket, struct sender_session *sender, u_int32_t seqno, int len, char *payload);
+void window_remove_head(struct sender_session *sender);
+struct window_slot *send_new_data(struct rudp_socket_list *socket, struct session *session, char *payload, int len, struct data *message);
+int iov_gather(const struct iovec *iov, int iovcnt, int *index, int *offset, char *dst, int len);
+void message_sent(struct rudp_socket_list *socket, struct data *message);
+void message_free(struct rudp_socket_list *socket, struct data *message);
+void report_sent_messages(struct rudp_socket_list *socket);
+void report_writable(struct rudp_socket_list *socket);
+void report_reaped(struct rudp_socket_list *socket);
+int queue_full(struct rudp_socket_list *socket, struct sockaddr_in *to);
+int queue_data(struct rudp_socket_list *socket, struct data *data_item, struct sockaddr_in *to);
+void send_queued_data(struct rudp_socket_list *socket, struct session *session);
+void free_sender_session(struct rudp_socket_list *socket, struct sender_session *sender);
+void pool_init(struct pool *pool, int size, int per_slab);
+void *pool_get(struct pool *pool);
+void pool_put(struct pool *pool, void *object);
+void pool_destroy(struct pool *pool);
+struct receiver_session *alloc_receiver_session(u_int32_t seqno, int window);
+void free_receiver_session(struct receiver_session *receiver);
+int reorder_store(struct rudp_socket_list *socket, struct receiver_session *receiver, struct rudp_packet *p, struct rudp_buf **bufp);
+struct buf_pool *buf_pool_find(int payload);
+struct rudp_buf *buf_get(struct buf_pool *pool);
+struct rudp_buf *buf_take(struct buf_pool *pool, struct rudp_buf **bufp, struct rudp_packet *p);
+void deliver_data(struct rudp_socket_list *socket, struct receiver_session *receiver, struct sockaddr_in *from, struct rudp_packet *p, struct rudp_buf **bufp);
+int reassemble(struct rudp_socket_list *socket, struct receiver_session *receiver, struct rudp_packet *p);
+void send_data_ack(struct rudp_socket_list *socket, struct session *session);
+bool_t syn_replayed(struct rudp_socket_list *socket, u_int32_t seqno, struct sockaddr_in *from);
+void delay_data_ack(struct rudp_socket_list *socket, struct session *session);
+int delack_callback(int fd, void *arg);
+bool_t window_ack(struct sender_session *sender, u_int32_t ackno, struct rudp_sack *blocks, int nblocks);
+int rtt_update(struct sender_session *sender, struct timeval *sent_time);
+int retransmit_delay(struct sender_session *sender, int attempts);
+void fast_retransmit(struct rudp_socket_list *socket, struct session *session);
+void recovery_retransmit(struct rudp_socket_list *socket, struct session *session);
+void retransmit_slot(struct rudp_socket_list *socket, struct session *session, struct window_slot *slot);
+int pace_callback(int fd, void *args);
+void probe_next(struct rudp_socket_list *socket, struct session *session);
+void probe_send(struct rudp_socket_list *socket, struct session *session);
+void probe_received(struct rudp_socket_list *socket, struct session *session, struct rudp_packet *p);
+struct session *find_session(struct rudp_socket_list *socket, struct sockaddr_in *addr);
+u_int32_t session_hash(struct sockaddr_in *addr);
+int session_table_resize(struct rudp_socket_list *socket, int capacity);
+int session_insert(struct rudp_socket_list *socket, struct session *session);
+void session_remove(struct rudp_socket_list *socket, struct session *session);
+void session_touch(struct rudp_socket_list *socket, struct session *session);
+void session_reap(struct rudp_socket_list *socket, struct session *session);
+void idle_schedule(struct rudp_socket_list *socket);
+int idle_callback(int fd, void *arg);
+bool_t close_socket_if_done(struct rudp_socket_list *socket, struct sockaddr_in *peer);
 int compare_sockaddr(struct sockaddr_in *s1, struct sockaddr_in *s2);
+void offload_probe(struct rudp_socket_list *socket);
+int offload_enable(struct rudp_socket_list *socket, bool_t on);
+int packet_buffers(struct rudp_socket_list *socket, int mtu);
+struct rudp_packet *batch_packet(struct rudp_batch *tx, int i);
+int batch_receive(struct rudp_socket_list *socket);
+int batch_send(struct rudp_socket_list *socket, struct rudp_packet *p, struct sockaddr_in *to);
+int gso_run(struct rudp_batch *tx, int first);
+int batch_flush(struct rudp_socket_list *socket);
+int flush_callback(int fd, void *arg);
 int receive_callback(int file, void *arg);
+int receive_packet(struct rudp_socket_list *curr_socket, struct rudp_packet *received_packet, int bytes, struct sockaddr_in *from, struct rudp_buf **bufp);
 int timeout_callback(int retry_attempts, void *args);
 int send_packet(bool_t is_ack, rudp_socket_t rsocket, struct rudp_packet *p, struct sockaddr_in *recipient);
-
-/* Global variables */
-bool_t rng_seeded = false;
-struct rudp_socket_list *socket_list_head = NULL;
+int emulate_setsockopt(struct rudp_socket_list *socket, rudp_sockopt_t option, int v);
+bool_t emulate_send(struct rudp_socket_list *socket, struct rudp_packet *p, struct sockaddr_in *to);
+int delayed_callback(int fd, void *arg);
+void emulate_free(struct rudp_socket_list *socket);
+void cancel_timeout(event_timer_t *timer);
+void rudp_log(int level, const char *format, ...);
+rudp_socket_t open_socket(int port, bool_t shared);
+int post_callback(int fd, void *arg);
+void post_drain(struct rudp_postq *q);
+bool_t postq_empty(struct rudp_postq *q);
+void send_fins(struct rudp_socket_list *socket);
+void postq_free(struct rudp_postq *q);
+const char *packet_type_name(u_int16_t type);
+
+/* Global variables. Sockets belong to the thread which created them, like the
+ * event loop they are registered with, so the state of the sockets is thread local */
+__thread bool_t rng_seeded = false;
+__thread unsigned int rng_seed; /* rand_r() state for initial sequence numbers */
+int rudp_log_level = RUDP_LOG_WARN;
+__thread struct rudp_socket_list *socket_list_head = NULL;
+struct session deleted_session; /* Marks session_table slots which once held a session */
+__thread struct buf_pool *buf_pools = NULL; /* struct rudp_buf for the sockets of this thread, kept as the application may hold buffers beyond rudp_close() */
 
 /* Creates a new sender session and appends it to the socket's session list */
 void create_sender_session(struct rudp_socket_list *socket, u_int32_t seqno, struct sockaddr_in *to, struct data **data_queue) {
@@ -108,914 +490,3277 @@ void create_sender_session(struct rudp_socket_list *socket, u_int32_t seqno, str
     return;
   }
   new_session->address = *to;
-  new_session->next = NULL;
   new_session->receiver = NULL;
+  new_session->sender = alloc_sender_session(socket, seqno, data_queue);
+  if(new_session->sender == NULL) {
+    free(new_session);
+    return;
+  }
+  if(session_insert(socket, new_session) < 0) {
+    free_sender_session(socket, new_session->sender);
+    free(new_session);
+  }
+}
 
+/* Allocates the sender half of a session, which takes over the data queue */
+struct sender_session *alloc_sender_session(struct rudp_socket_list *socket, u_int32_t seqno, struct data **data_queue) {
   struct sender_session *new_sender_session = malloc(sizeof(struct sender_session));
   if(new_sender_session == NULL) {
     fprintf(stderr, "create_sender_session: Error allocating memory\n");
-    return;
+    return NULL;
   }
   new_sender_session->status = SYN_SENT;
   new_sender_session->seqno = seqno;
+  new_sender_session->syn_seqno = seqno;
   new_sender_session->session_finished = false;
   /* Add data to the new session's queue */
   new_sender_session->data_queue = *data_queue;
-  new_session->sender = new_sender_session;
-
-  int i;
-  for(i = 0; i < RUDP_WINDOW; i++) {
-    new_sender_session->retransmission_attempts[i] = 0;
-    new_sender_session->data_timeout_arg[i] = 0;
-    new_sender_session->sliding_window[i] = NULL;
-  }    
+  new_sender_session->data_queue_tail = *data_queue;
+  new_sender_session->queued = *data_queue != NULL ? (*data_queue)->len : 0;
+  new_sender_session->blocked = false;
+  new_sender_session->writable = false;
+
+  new_sender_session->sliding_window = NULL;
+  new_sender_session->window_capacity = 0;
+  new_sender_session->window_base = 0;
+  new_sender_session->window_count = 0;
+  new_sender_session->syn_timer = NULL;
+  new_sender_session->fin_timer = NULL;
   new_sender_session->syn_retransmit_attempts = 0;
+  gettimeofday(&new_sender_session->syn_first_sent, NULL);
+  new_sender_session->handshake = 0;
   new_sender_session->fin_retransmit_attempts = 0;
-  
-  if(socket->sessions_list_head == NULL) {
-    socket->sessions_list_head = new_session;
-  }
-  else {
-    struct session *curr_session = socket->sessions_list_head;
-    while(curr_session->next != NULL) {
-      curr_session = curr_session->next;
-    }
-    curr_session->next = new_session;
-  }
+  new_sender_session->rtt_measured = false;
+  new_sender_session->srtt = 0;
+  new_sender_session->rttvar = 0;
+  new_sender_session->rto = RUDP_TIMEOUT * 1000;
+  new_sender_session->dup_acks = 0;
+  new_sender_session->in_recovery = false;
+  new_sender_session->recover = 0;
+  new_sender_session->high_rxt = 0;
+  new_sender_session->cc.ops = socket->cc_ops;
+  new_sender_session->cc.ops->init(&new_sender_session->cc);
+  new_sender_session->pace_timer = NULL;
+  /* Without path MTU discovery, packets are as large as the MTU allows right away */
+  new_sender_session->payload_max = socket->payload_max;
+  new_sender_session->payload = socket->pmtud ? RUDP_MAXPKTSIZE : socket->payload_max;
+  new_sender_session->slot_size = (offsetof(struct window_slot, packet) + sizeof(struct rudp_hdr) + socket->payload_max +
+                                   sizeof(void *) - 1) / sizeof(void *) * sizeof(void *);
+  new_sender_session->probe_low = new_sender_session->payload;
+  new_sender_session->probe_high = new_sender_session->payload_max;
+  new_sender_session->probe_size = 0;
+  new_sender_session->probe_attempts = 0;
+  new_sender_session->probe_timer = NULL;
+  return new_sender_session;
 }
 
 /* Creates a new receiver session and appends it to the socket's session list */
-void create_receiver_session(struct rudp_socket_list *socket, u_int32_t seqno, struct sockaddr_in *addr) {
+void create_receiver_session(struct rudp_socket_list *socket, u_int32_t seqno, int window, struct sockaddr_in *addr) {
   struct session *new_session = malloc(sizeof(struct session));
   if(new_session == NULL) {
     fprintf(stderr, "create_receiver_session: Error allocating memory\n");
     return;
   }
   new_session->address = *addr;
-  new_session->next = NULL;
   new_session->sender = NULL;
   
-  struct receiver_session *new_receiver_session = malloc(sizeof(struct receiver_session));
+  struct receiver_session *new_receiver_session = alloc_receiver_session(seqno, window);
   if(new_receiver_session == NULL) {
     fprintf(stderr, "create_receiver_session: Error allocating memory\n");
+    free(new_session);
     return;
   }
-  new_receiver_session->status = OPENING;
-  new_receiver_session->session_finished = false;
-  new_receiver_session->expected_seqno = seqno;
   new_session->receiver = new_receiver_session;
   
-  if(socket->sessions_list_head == NULL) {
-    socket->sessions_list_head = new_session;
-  }
-  else {
-    struct session *curr_session = socket->sessions_list_head;
-    while(curr_session->next != NULL) {
-      curr_session = curr_session->next;
-    }
-    curr_session->next = new_session;
+  if(session_insert(socket, new_session) < 0) {
+    free_receiver_session(new_receiver_session);
+    free(new_session);
   }
 }
 
-/* Allocates a RUDP packet and returns a pointer to it */
-struct rudp_packet *create_rudp_packet(u_int16_t type, u_int32_t seqno, int len, char *payload) {
-  struct rudp_hdr header;
-  header.version = RUDP_VERSION;
-  header.type = type;
-  header.seqno = seqno;
-  
-  struct rudp_packet *packet = malloc(sizeof(struct rudp_packet));
-  if(packet == NULL) {
-    fprintf(stderr, "create_rudp_packet: Error allocating memory for packet\n");
-    return NULL;
-  }
-  packet->header = header;
-  packet->payload_length = len;
-  memset(&packet->payload, 0, RUDP_MAXPKTSIZE);
+/* Fills in the header and payload of a RUDP packet */
+void init_rudp_packet(struct rudp_packet *packet, u_int16_t type, u_int32_t seqno, int len, char *payload) {
+  packet->header.version = RUDP_VERSION;
+  packet->header.type = type;
+  packet->header.seqno = seqno;
+  packet->header.length = len;
+  packet->header.flags = 0;
   if(payload != NULL)
     memcpy(&packet->payload, payload, len);
-  
-  return packet;
 }
 
-/* Returns 1 if the two sockaddr_in structs are equal and 0 if not */
-int compare_sockaddr(struct sockaddr_in *s1, struct sockaddr_in *s2) {
-  char sender[16];
-  char recipient[16];
-  strcpy(sender, inet_ntoa(s1->sin_addr));
-  strcpy(recipient, inet_ntoa(s2->sin_addr));
-  
-  return ((s1->sin_family == s2->sin_family) && (strcmp(sender, recipient) == 0) && (s1->sin_port == s2->sin_port));
+/* Fills in a SYN, which tells the receiver the window of the socket */
+void init_syn_packet(struct rudp_packet *packet, struct rudp_socket_list *socket, u_int32_t seqno) {
+  struct rudp_syn syn;
+  syn.window = htonl(socket->window);
+  init_rudp_packet(packet, RUDP_SYN, seqno, sizeof(syn), (char *)&syn);
 }
 
-/* Creates and returns a RUDP socket */
-rudp_socket_t rudp_socket(int port) {
-  if(rng_seeded == false) {
-    srand(time(NULL));
-    rng_seeded = true;
+/* Returns the window a SYN tells, or that of the socket if the SYN has none */
+int syn_window(struct rudp_socket_list *socket, struct rudp_packet *p) {
+  struct rudp_syn syn;
+  if(p->header.length < sizeof(syn)) {
+    return socket->window;
   }
-  int sockfd;
-  struct sockaddr_in address;
+  memcpy(&syn, p->payload, sizeof(syn));
+  int window = ntohl(syn.window);
+  return window < 1 ? 1 : window > RUDP_MAXWINDOW ? RUDP_MAXWINDOW : window;
+}
 
-  sockfd = socket(AF_INET, SOCK_DGRAM, 0);
-  if(sockfd < 0) {
-    perror("socket");
-    return (rudp_socket_t)NULL;
+/* Returns the socket list entry of a RUDP socket, or NULL if there is none */
+struct rudp_socket_list *find_socket(rudp_socket_t rsocket) {
+  struct rudp_socket_list *curr_socket = socket_list_head;
+  while(curr_socket != NULL && curr_socket->rsock != rsocket) {
+    curr_socket = curr_socket->next;
   }
+  return curr_socket;
+}
 
-  memset(&address, 0, sizeof(address));
-  address.sin_family = AF_INET;
-  address.sin_addr.s_addr = htonl(INADDR_ANY);
-  address.sin_port = htons(port);
+/* Returns the file descriptor of a RUDP socket */
+int rsock_fd(rudp_socket_t rsocket) {
+  return (int)(intptr_t)rsocket;
+}
 
-  if( bind(sockfd, (struct sockaddr *) &address, sizeof(address)) < 0) {
-    perror("bind");
+/* Returns the i:th oldest packet in the sliding window */
+struct window_slot *window_slot(struct sender_session *sender, int i) {
+  int index = (sender->window_base + i) & (sender->window_capacity - 1);
+  return (struct window_slot *)(sender->sliding_window + index * sender->slot_size);
+}
+
+/* Returns the window slot holding the packet with sequence number seqno, or NULL */
+struct window_slot *window_find(struct sender_session *sender, u_int32_t seqno) {
+  u_int32_t offset = seqno - sender->window_base;
+  if(offset >= (u_int32_t)sender->window_count) {
     return NULL;
   }
+  return window_slot(sender, offset);
+}
 
-  rudp_socket_t socket = (rudp_socket_t)sockfd;
-
-  /* Create new socket and add to list of sockets */
-  struct rudp_socket_list *new_socket = malloc(sizeof(struct rudp_socket_list));
-  if(new_socket == NULL) {
-    fprintf(stderr, "rudp_socket: Error allocating memory for socket list\n");
-    return (rudp_socket_t) -1;
+/* 
+ * Adds a DATA packet to the end of the sliding window, growing the window buffer 
+ * if needed. Returns NULL if the window is full or memory could not be allocated
+ */
+struct window_slot *window_add(struct rudp_socket_list *socket, struct sender_session *sender, u_int32_t seqno, int len, char *payload) {
+  if(sender->window_count >= socket->window) {
+    return NULL;
   }
-  new_socket->rsock = socket;
-  new_socket->close_requested = false;
-  new_socket->sessions_list_head = NULL;
-  new_socket->next = NULL;
-  new_socket->handler = NULL;
-  new_socket->recv_handler = NULL;
-
-  if(socket_list_head == NULL) {
-    socket_list_head = new_socket;
+  if(sender->window_count == 0) {
+    sender->window_base = seqno;
   }
-  else {
-    struct rudp_socket_list *curr = socket_list_head;
-    while(curr->next != NULL) {
-      curr = curr->next;
+  if(sender->window_count == sender->window_capacity) {
+    /* Double the buffer. Slots are indexed by sequence number, so the packets must be moved */
+    int capacity = sender->window_capacity ? sender->window_capacity * 2 : 4;
+    char *window = malloc(capacity * sender->slot_size);
+    if(window == NULL) {
+      fprintf(stderr, "window_add: Error allocating sliding window\n");
+      return NULL;
     }
-    curr->next = new_socket;
+    int i;
+    for(i = 0; i < sender->window_count; i++) {
+      struct window_slot *slot = window_slot(sender, i);
+      memcpy(window + ((sender->window_base + i) & (capacity - 1)) * sender->slot_size, slot,
+             offsetof(struct window_slot, packet) + RUDP_PKTLEN(&slot->packet));
+    }
+    free(sender->sliding_window);
+    sender->sliding_window = window;
+    sender->window_capacity = capacity;
   }
 
-  /* Register callback event for this socket descriptor */
-  if(event_fd(sockfd, receive_callback, (void*) sockfd, "receive_callback") < 0) {
-    fprintf(stderr, "Error registering receive callback function");
-  }
+  struct window_slot *slot = window_slot(sender, sender->window_count);
+  init_rudp_packet(&slot->packet, RUDP_DATA, seqno, len, payload);
+  slot->retransmission_attempts = 0;
+  slot->sacked = false;
+  slot->timer = NULL;
+  sender->window_count++;
+  return slot;
+}
 
-  return socket;
+/* Removes the oldest packet from the sliding window */
+void window_remove_head(struct sender_session *sender) {
+  struct window_slot *slot = window_slot(sender, 0);
+  cancel_timeout(&slot->timer);
+  sender->window_base++;
+  sender->window_count--;
 }
 
-/* Callback function executed when something is received on fd */
-int receive_callback(int file, void *arg) {
-  char buf[sizeof(struct rudp_packet)];
-  struct sockaddr_in sender;
-  size_t sender_length = sizeof(struct sockaddr_in);
-  recvfrom(file, &buf, sizeof(struct rudp_packet), 0, (struct sockaddr *)&sender, &sender_length);
+/* 
+ * Adds a new DATA packet to the sliding window of an open session and sends it, if 
+ * the window and congestion control allow. Before the SYN is ACKed, only the
+ * first RUDP_OPT_EARLYDATA packets are sent. The payload is copied from payload, or 
+ * gathered from the next len bytes of message if that is not NULL. Returns the window 
+ * slot, or NULL if not
+ */
+struct window_slot *send_new_data(struct rudp_socket_list *socket, struct session *session, char *payload, int len, struct data *message) {
+  struct sender_session *sender = session->sender;
 
-  struct rudp_packet *received_packet = malloc(sizeof(struct rudp_packet));
-  if(received_packet == NULL) {
-    fprintf(stderr, "receive_callback: Error allocating packet\n");
-    return -1;
+  if(sender->status == SYN_SENT && sender->window_count >= socket->earlydata) {
+    /* The rest waits for the SYN to be ACKed */
+    return NULL;
   }
-  memcpy(received_packet, &buf, sizeof(struct rudp_packet));
-  
-  struct rudp_hdr rudpheader = received_packet->header;
-  char type[5];
-  short t = rudpheader.type;
-  if(t == 1)
-    strcpy(type, "DATA");
-  else if(t == 2)
-    strcpy(type, "ACK");
-  else if(t == 4)
-    strcpy(type, "SYN");
-  else if(t==5)
-    strcpy(type, "FIN");
-  else
-    strcpy(type, "BAD");
-
-  printf("Received %s packet from %s:%d seq number=%u on socket=%d\n",type, 
-       inet_ntoa(sender.sin_addr), ntohs(sender.sin_port),rudpheader.seqno,file);
-
-  /* Locate the correct socket in the socket list */
-  if(socket_list_head == NULL) {
-    fprintf(stderr, "Error: attempt to receive on invalid socket. No sockets in the list\n");
-    return -1;
+
+  /* Ask congestion control whether a packet may be sent now */
+  struct timeval now, when;
+  gettimeofday(&now, NULL);
+  if(!sender->cc.ops->can_send(&sender->cc, sender->window_count, &now, &when)) {
+    if(timerisset(&when) && sender->pace_timer == NULL) {
+      struct timeoutargs *timeargs = pool_get(&socket->timer_pool);
+      if(timeargs == NULL) {
+        fprintf(stderr, "send_new_data: Error allocating timeout args\n");
+        return NULL;
+      }
+      timeargs->socket = socket;
+      timeargs->recipient = session->address;
+      timeargs->type = RUDP_DATA;
+      timeargs->seqno = sender->seqno + 1;
+      sender->pace_timer = event_timeout(when, pace_callback, timeargs, "pace_callback");
+      if(sender->pace_timer == NULL) {
+        pool_put(&socket->timer_pool, timeargs);
+      }
+    }
+    return NULL;
   }
-  else {
-    /* We have sockets to check */
-    struct rudp_socket_list *curr_socket = socket_list_head;
-    while(curr_socket != NULL) {
-      if((int)curr_socket->rsock == file) {
+
+  struct window_slot *slot = window_add(socket, sender, sender->seqno + 1, len, payload);
+  if(slot == NULL) {
+    /* The window is full */
+    return NULL;
+  }
+  if(message != NULL) {
+    if(message->copy != NULL) {
+      memcpy(slot->packet.payload, message->copy + message->iov_offset, len);
+      message->iov_offset += len;
+    }
+    else {
+      iov_gather(message->msg.iov, message->iovcnt, &message->iov_index, &message->iov_offset,
+                 slot->packet.payload, len);
+    }
+    message->len -= len;
+    if(message->len > 0) {
+      /* The receiver puts the message together again */
+      slot->packet.header.flags = RUDP_MORE;
+    }
+  }
+  sender->seqno += 1;
+  send_packet(false, socket->rsock, &slot->packet, &session->address);
+  sender->cc.ops->on_send(&sender->cc, &now);
+  return slot;
+}
+
+/* Moves queued data into the sliding window of a session, sending it as long as there is room */
+void send_queued_data(struct rudp_socket_list *socket, struct session *session) {
+  struct sender_session *sender = session->sender;
+  while(sender->data_queue != NULL) {
+    /* Send packet, add to window and remove from queue */
+    struct data *item = sender->data_queue;
+    if(!item->message) {
+      if(send_new_data(socket, session, item->item, item->len, NULL) == NULL) {
         break;
       }
-      curr_socket = curr_socket->next;
+      sender->queued -= item->len;
     }
-    if((int)curr_socket->rsock == file) {
-      /* We found the correct socket, now see if a session already exists for this peer */
-      if(curr_socket->sessions_list_head == NULL) {
-        /* The list is empty, so we check if the sender has initiated the protocol properly (by sending a SYN) */
-        if(rudpheader.type == RUDP_SYN) {
-          /* SYN Received. Create a new session at the head of the list */
-          u_int32_t seqno = rudpheader.seqno + 1;
-          create_receiver_session(curr_socket, seqno, &sender);
-          /* Respond with an ACK */
-          struct rudp_packet *p = create_rudp_packet(RUDP_ACK, seqno, 0, NULL);
-          send_packet(true, (rudp_socket_t)file, p, &sender);
-          free(p);
-        }
-        else {
-          /* No sessions exist and we got a non-SYN, so ignore it */
-        }
+    else {
+      /* The next packet of a message */
+      int len = item->len < sender->payload ? item->len : sender->payload;
+      if(send_new_data(socket, session, NULL, len, item) == NULL) {
+        break;
       }
-      else {
-        /* Some sessions exist to be checked */
-        bool_t session_found = false;
-        struct session *curr_session = curr_socket->sessions_list_head;
-        struct session *last_session;
-        while(curr_session != NULL) {
-          if(curr_session->next == NULL) {
-            last_session = curr_session;
-          }
-          if(compare_sockaddr(&curr_session->address, &sender) == 1) {
-            /* Found an existing session */
-            session_found = true;
-            break;
-          }
-
-          curr_session = curr_session->next;
-        }
-        if(session_found == false) {
-          /* No session was found for this peer */
-          if(rudpheader.type == RUDP_SYN) {
-            /* SYN Received. Send an ACK and create a new session */
-            u_int32_t seqno = rudpheader.seqno + 1;
-            create_receiver_session(curr_socket, seqno, &sender);          
-            struct rudp_packet *p = create_rudp_packet(RUDP_ACK, seqno, 0, NULL);
-            send_packet(true, (rudp_socket_t)file, p, &sender);
-            free(p);
-          }
-          else {
-            /* Session does not exist and non-SYN received - ignore it */
-          }
-        }
-        else {
-          /* We found a matching session */ 
-          if(rudpheader.type == RUDP_SYN) {
-            if(curr_session->receiver == NULL || curr_session->receiver->status == OPENING) {
-              /* Create a new receiver session and ACK the SYN*/
-              struct receiver_session *new_receiver_session = malloc(sizeof(struct receiver_session));
-              if(new_receiver_session == NULL) {
-                fprintf(stderr, "receive_callback: Error allocating receiver session\n");
-                return -1;
-              }
-              new_receiver_session->expected_seqno = rudpheader.seqno + 1;
-              new_receiver_session->status = OPENING;
-              new_receiver_session->session_finished = false;
-              curr_session->receiver = new_receiver_session;
-
-              u_int32_t seqno = curr_session->receiver->expected_seqno;
-              struct rudp_packet *p = create_rudp_packet(RUDP_ACK, seqno, 0, NULL);
-              send_packet(true, (rudp_socket_t)file, p, &sender);
-              free(p);
-            }
-            else {
-              /* Received a SYN when there is already an active receiver session, so we ignore it */
-            }
-          }
-          if(rudpheader.type == RUDP_ACK) {
-            u_int32_t ack_sqn = received_packet->header.seqno;
-            if(curr_session->sender->status == SYN_SENT) {
-              /* This an ACK for a SYN */
-              u_int32_t syn_sqn = curr_session->sender->seqno;
-              if( (ack_sqn - 1) == syn_sqn) {
-                /* Delete the retransmission timeout */
-                event_timeout_delete(timeout_callback, curr_session->sender->syn_timeout_arg);
-                struct timeoutargs *t = (struct timeoutargs *)curr_session->sender->syn_timeout_arg;
-                free(t->packet);
-                free(t->recipient);
-                free(t);
-                curr_session->sender->status = OPEN;
-                while(curr_session->sender->data_queue != NULL) {
-                  /* Check if the window is already full */
-                  if(curr_session->sender->sliding_window[RUDP_WINDOW-1] != NULL) {
-                    break;
-                  }
-                  else {
-                    int index;
-                    int i;
-                    /* Find the first unused window slot */
-                    for(i = RUDP_WINDOW-1; i >= 0; i--) {
-                      if(curr_session->sender->sliding_window[i] == NULL) {
-                        index = i;
-                      }
-                    }
-                    /* Send packet, add to window and remove from queue */
-                    u_int32_t seqno = ++syn_sqn;
-                    int len = curr_session->sender->data_queue->len;
-                    char *payload = curr_session->sender->data_queue->item;
-                    struct rudp_packet *datap = create_rudp_packet(RUDP_DATA, seqno, len, payload);
-                    curr_session->sender->seqno += 1;
-                    curr_session->sender->sliding_window[index] = datap;
-                    curr_session->sender->retransmission_attempts[index] = 0;
-                    struct data *temp = curr_session->sender->data_queue;
-                    curr_session->sender->data_queue = curr_session->sender->data_queue->next;
-                    free(temp->item);
-                    free(temp);
-
-                    send_packet(false, (rudp_socket_t)file, datap, &sender);
-                  }
-                }
-              }
-            }
-            else if(curr_session->sender->status == OPEN) {
-              /* This is an ACK for DATA */
-              if(curr_session->sender->sliding_window[0] != NULL) {
-                if(curr_session->sender->sliding_window[0]->header.seqno == (rudpheader.seqno-1)) {
-                  /* Correct ACK received. Remove the first window item and shift the rest left */
-                  event_timeout_delete(timeout_callback, curr_session->sender->data_timeout_arg[0]);
-                  struct timeoutargs *args = (struct timeoutargs *)curr_session->sender->data_timeout_arg[0];
-                  free(args->packet);
-                  free(args->recipient);
-                  free(args);
-                  free(curr_session->sender->sliding_window[0]);
-
-                  int i;
-                  if(RUDP_WINDOW == 1) {
-                    curr_session->sender->sliding_window[0] = NULL;
-                    curr_session->sender->retransmission_attempts[0] = 0;
-                    curr_session->sender->data_timeout_arg[0] = NULL;
-                  }
-                  else {
-                    for(i = 0; i < RUDP_WINDOW - 1; i++) {
-                      curr_session->sender->sliding_window[i] = curr_session->sender->sliding_window[i+1];
-                      curr_session->sender->retransmission_attempts[i] = curr_session->sender->retransmission_attempts[i+1];
-                      curr_session->sender->data_timeout_arg[i] = curr_session->sender->data_timeout_arg[i+1];
-
-                      if(i == RUDP_WINDOW-2) {
-                        curr_session->sender->sliding_window[i+1] = NULL;
-                        curr_session->sender->retransmission_attempts[i+1] = 0;
-                        curr_session->sender->data_timeout_arg[i+1] = NULL;
-                      }
-                    }
-                  }
-
-                  while(curr_session->sender->data_queue != NULL) {
-                    if(curr_session->sender->sliding_window[RUDP_WINDOW-1] != NULL) {
-                      break;
-                    }
-                    else {
-                      int index;
-                      int i;
-                      /* Find the first unused window slot */
-                      for(i = RUDP_WINDOW-1; i >= 0; i--) {
-                        if(curr_session->sender->sliding_window[i] == NULL) {
-                          index = i;
-                        }
-                      }                      
-                      /* Send packet, add to window and remove from queue */
-                      curr_session->sender->seqno = curr_session->sender->seqno + 1;                      
-                      u_int32_t seqno = curr_session->sender->seqno;
-                      int len = curr_session->sender->data_queue->len;
-                      char *payload = curr_session->sender->data_queue->item;
-                      struct rudp_packet *datap = create_rudp_packet(RUDP_DATA, seqno, len, payload);
-                      curr_session->sender->sliding_window[index] = datap;
-                      curr_session->sender->retransmission_attempts[index] = 0;
-                      struct data *temp = curr_session->sender->data_queue;
-                      curr_session->sender->data_queue = curr_session->sender->data_queue->next;
-                      free(temp->item);
-                      free(temp);
-                      send_packet(false, (rudp_socket_t)file, datap, &sender);
-                    }
-                  }
-                  if(curr_socket->close_requested) {
-                    /* Can the socket be closed? */
-                    struct session *head_sessions = curr_socket->sessions_list_head;
-                    while(head_sessions != NULL) {
-                      if(head_sessions->sender->session_finished == false) {
-                        if(head_sessions->sender->data_queue == NULL &&  
-                           head_sessions->sender->sliding_window[0] == NULL && 
-                           head_sessions->sender->status == OPEN) {
-                          head_sessions->sender->seqno += 1;                      
-                          struct rudp_packet *p = create_rudp_packet(RUDP_FIN, head_sessions->sender->seqno, 0, NULL);
-                          send_packet(false, (rudp_socket_t)file, p, &head_sessions->address);
-                          free(p);
-                          head_sessions->sender->status = FIN_SENT;
-                        }
-                      }
-                      head_sessions = head_sessions->next;
-                    }
-                  }
-                }
-              }
-            }
-            else if(curr_session->sender->status == FIN_SENT) {
-              /* Handle ACK for FIN */
-              if( (curr_session->sender->seqno + 1) == received_packet->header.seqno) {
-                event_timeout_delete(timeout_callback, curr_session->sender->fin_timeout_arg);
-                struct timeoutargs *t = curr_session->sender->fin_timeout_arg;
-                free(t->packet);
-                free(t->recipient);
-                free(t);
-                curr_session->sender->session_finished = true;
-                if(curr_socket->close_requested) {
-                  /* See if we can close the socket */
-                  struct session *head_sessions = curr_socket->sessions_list_head;
-                  bool_t all_done = true;
-                  while(head_sessions != NULL) {
-                    if(head_sessions->sender->session_finished == false) {
-                      all_done = false;
-                    }
-                    else if(head_sessions->receiver != NULL && head_sessions->receiver->session_finished == false) {
-                      all_done = false;
-                    }
-                    else {
-                      free(head_sessions->sender);
-                      if(head_sessions->receiver) {
-                        free(head_sessions->receiver);
-                      }
-                    }
-
-                    struct session *temp = head_sessions;
-                    head_sessions = head_sessions->next;
-                    free(temp);
-                  }
-                  if(all_done) {
-                    if(curr_socket->handler != NULL) {
-                      curr_socket->handler((rudp_socket_t)file, RUDP_EVENT_CLOSED, &sender);
-                      event_fd_delete(receive_callback, (rudp_socket_t)file);
-                      close(file);
-                      free(curr_socket);
-                    }
-                  }
-                }
-              }
-              else {
-                /* Received incorrect ACK for FIN - ignore it */
-              }
-            }
-          }
-          else if(rudpheader.type == RUDP_DATA) {
-            /* Handle DATA packet. If the receiver is OPENING, it can transition to OPEN */
-            if(curr_session->receiver->status == OPENING) {
-              if(rudpheader.seqno == curr_session->receiver->expected_seqno) {
-                curr_session->receiver->status = OPEN;
-              }
-            }
-
-            if(rudpheader.seqno == curr_session->receiver->expected_seqno) {
-              /* Sequence numbers match - ACK the data */
-              u_int32_t seqno = rudpheader.seqno + 1;
-              curr_session->receiver->expected_seqno = seqno;
-              struct rudp_packet *p = create_rudp_packet(RUDP_ACK, seqno, 0, NULL);
-  
-              send_packet(true, (rudp_socket_t)file, p, &sender);
-              free(p);
-              
-              /* Pass the data up to the application */
-              if(curr_socket->recv_handler != NULL)
-                curr_socket->recv_handler((rudp_socket_t)file, &sender, 
-                              (void*)&received_packet->payload, received_packet->payload_length);
-            }
-            /* Handle the case where an ACK was lost */
-            else if(SEQ_GEQ(rudpheader.seqno, (curr_session->receiver->expected_seqno - RUDP_WINDOW)) &&
-                SEQ_LT(rudpheader.seqno, curr_session->receiver->expected_seqno)) {
-              u_int32_t seqno = rudpheader.seqno + 1;
-              struct rudp_packet *p = create_rudp_packet(RUDP_ACK, seqno, 0, NULL);
-              send_packet(true, (rudp_socket_t)file, p, &sender);
-              free(p);
-            }
-          }
-          else if(rudpheader.type == RUDP_FIN) {
-            if(curr_session->receiver->status == OPEN) {
-              if(rudpheader.seqno == curr_session->receiver->expected_seqno) {
-                /* If the FIN is correct, we can ACK it */
-                u_int32_t seqno = curr_session->receiver->expected_seqno + 1;
-                struct rudp_packet *p = create_rudp_packet(RUDP_ACK, seqno, 0, NULL);
-                send_packet(true, (rudp_socket_t)file, p, &sender);
-                free(p);
-                curr_session->receiver->session_finished = true;
-
-                if(curr_socket->close_requested) {
-                  /* Can we close the socket now? */
-                  struct session *head_sessions = curr_socket->sessions_list_head;
-                  int all_done = true;
-                  while(head_sessions != NULL) {
-                    if(head_sessions->sender->session_finished == false) {
-                      all_done = false;
-                    }
-                    else if(head_sessions->receiver != NULL && head_sessions->receiver->session_finished == false) {
-                      all_done = false;
-                    }
-                    else {
-                      free(head_sessions->sender);
-                      if(head_sessions->receiver) {
-                        free(head_sessions->receiver);
-                      }
-                    }
-                    
-                    struct session *temp = head_sessions;
-                    head_sessions = head_sessions->next;
-                    free(temp);
-                  }
-                  if(all_done) {
-                    if(curr_socket->handler != NULL) {
-                      curr_socket->handler((rudp_socket_t)file, RUDP_EVENT_CLOSED, &sender);
-                      event_fd_delete(receive_callback, (rudp_socket_t)file);
-                      close(file);
-                      free(curr_socket);
-                    }
-                  }
-                }
-              }
-              else {
-                /* FIN received with incorrect sequence number - ignore it */
-              }
-            }
-          }
-        }
+      sender->queued -= len;
+      if(item->len > 0) {
+        continue;
       }
     }
+    sender->data_queue = item->next;
+    if(sender->data_queue == NULL) {
+      sender->data_queue_tail = NULL;
+    }
+    if(!item->message) {
+      pool_put(&socket->data_pool, item);
+    }
+    else {
+      message_sent(socket, item);
+    }
+  }
+  if(sender->blocked && sender->queued <= socket->sndbuf / 2) {
+    /* Tell the application it may send more, once it is done with the current event */
+    sender->blocked = false;
+    sender->writable = true;
+    socket->writable_pending++;
   }
-
-  free(received_packet);
-  return 0;
 }
 
-/* Close a RUDP socket */
-int rudp_close(rudp_socket_t rsocket) {
-  struct rudp_socket_list *curr_socket = socket_list_head;
-  while(curr_socket->next != NULL) {
-    if(curr_socket->rsock == rsocket) {
-      break;
+/* 
+ * Copies len bytes from the buffers iov, starting at *offset in buffer *index, to dst. 
+ * Advances *index and *offset past them. Returns the number of bytes copied, which is 
+ * less than len if the buffers end first
+ */
+int iov_gather(const struct iovec *iov, int iovcnt, int *index, int *offset, char *dst, int len) {
+  int copied = 0;
+  while(copied < len && *index < iovcnt) {
+    int n = iov[*index].iov_len - *offset;
+    if(n > len - copied) {
+      n = len - copied;
+    }
+    memcpy(dst + copied, (char *)iov[*index].iov_base + *offset, n);
+    copied += n;
+    *offset += n;
+    if(*offset == iov[*index].iov_len) {
+      (*index)++;
+      *offset = 0;
     }
-    curr_socket = curr_socket->next;
-  }
-  if(curr_socket->rsock == rsocket) {
-    curr_socket->close_requested = true;        
-    return 0;
   }
-  
-  return -1;
+  return copied;
 }
 
-/* Register receive callback function */ 
-int rudp_recvfrom_handler(rudp_socket_t rsocket, int (*handler)(rudp_socket_t, 
-            struct sockaddr_in *, char *, int)) {
+/* All of a message is in the sliding window, or was dropped, so RUDP no longer
+ * refers to its buffers. A message from rudp_sendv() is reported to the sendv 
+ * handler when the event loop iteration ends */
+void message_sent(struct rudp_socket_list *socket, struct data *message) {
+  if(message->iovcnt == 0) {
+    message_free(socket, message);
+    return;
+  }
+  message->next = NULL;
+  if(socket->sent_messages == NULL) {
+    socket->sent_messages = message;
+  }
+  else {
+    socket->sent_messages_tail->next = message;
+  }
+  socket->sent_messages_tail = message;
+}
 
-  if(handler == NULL) {
-    fprintf(stderr, "rudp_recvfrom_handler failed: handler callback is null\n");
-    return -1;
+/* Raises RUDP_EVENT_WRITABLE for the sender sessions whose queues have drained */
+void report_writable(struct rudp_socket_list *socket) {
+  if(socket->writable_pending == 0) {
+    return;
   }
-  /* Find the proper socket from the socket list */
-    struct rudp_socket_list *curr_socket = socket_list_head;
-    while(curr_socket->next != NULL) {
-      if(curr_socket->rsock == rsocket) {
-        break;
+  socket->writable_pending = 0;
+  struct session *curr_session;
+  for(curr_session = socket->sessions_list_head; curr_session != NULL; curr_session = curr_session->next) {
+    if(curr_session->sender != NULL && curr_session->sender->writable) {
+      curr_session->sender->writable = false;
+      if(socket->handler != NULL) {
+        socket->handler(socket->rsock, RUDP_EVENT_WRITABLE, &curr_session->address);
       }
-      curr_socket = curr_socket->next;
-    }
-    /* Extra check to handle the case where an invalid rsock is used */
-    if(curr_socket->rsock == rsocket) {
-      curr_socket->recv_handler = handler;
-      return 0;
     }
-  return -1;
+  }
 }
 
-/* Register event handler callback function with a RUDP socket */
-int rudp_event_handler(rudp_socket_t rsocket, 
-         int (*handler)(rudp_socket_t, rudp_event_t, 
-            struct sockaddr_in *)) {
-
-  if(handler == NULL) {
-    fprintf(stderr, "rudp_event_handler failed: handler callback is null\n");
-    return -1;
+/* Raises RUDP_EVENT_TIMEOUT for the peers whose sessions were freed. The
+ * handler may open or free sessions, and those are reported too */
+void report_reaped(struct rudp_socket_list *socket) {
+  while(socket->reaped != NULL) {
+    struct reaped_peer *reaped = socket->reaped;
+    socket->reaped = reaped->next;
+    if(socket->handler != NULL) {
+      socket->handler(socket->rsock, RUDP_EVENT_TIMEOUT, &reaped->peer);
+    }
+    free(reaped);
   }
+}
 
-  /* Find the proper socket from the socket list */
-  struct rudp_socket_list *curr_socket = socket_list_head;
-  while(curr_socket->next != NULL) {
-    if(curr_socket->rsock == rsocket) {
-      break;
+/* Passes the buffers of the sent messages back to the sendv handler. The
+ * handler may send more messages, and those are reported too */
+void report_sent_messages(struct rudp_socket_list *socket) {
+  while(socket->sent_messages != NULL) {
+    struct data *message = socket->sent_messages;
+    socket->sent_messages = message->next;
+    if(socket->sendv_handler != NULL) {
+      socket->sendv_handler(socket->rsock, &message->msg.peer, message->msg.iov, message->iovcnt);
     }
-    curr_socket = curr_socket->next;
+    message_free(socket, message);
   }
+}
 
-  /* Extra check to handle the case where an invalid rsock is used */
-  if(curr_socket->rsock == rsocket) {
-    curr_socket->handler = handler;
-    return 0;
+/* Frees a queue item of a message along with its copy of the data. A shared
+ * payload is freed when the last queue which refers to it is done with it */
+void message_free(struct rudp_socket_list *socket, struct data *message) {
+  if(message->shared == NULL) {
+    free(message->copy);
   }
-  return -1;
+  else if(--message->shared->refs == 0) {
+    free(message->shared);
+  }
+  pool_put(&socket->data_pool, message);
 }
 
-
-/* Sends a block of data to the receiver. Returns 0 on success, -1 on error */
-int rudp_sendto(rudp_socket_t rsocket, void* data, int len, struct sockaddr_in* to) {
-
-  if(len < 0 || len > RUDP_MAXPKTSIZE) {
-    fprintf(stderr, "rudp_sendto Error: attempting to send with invalid max packet size\n");
-    return -1;
+/* Frees a sender session along with its sliding window and queued data */
+void free_sender_session(struct rudp_socket_list *socket, struct sender_session *sender) {
+  if(sender == NULL) {
+    return;
   }
-
-  if(rsocket < 0) {
-    fprintf(stderr, "rudp_sendto Error: attempting to send on invalid socket\n");
-    return -1;
+  while(sender->window_count > 0) {
+    window_remove_head(sender);
   }
-
-  if(to == NULL) {
+  while(sender->data_queue != NULL) {
+    struct data *item = sender->data_queue;
+    sender->data_queue = item->next;
+    if(!item->message) {
+      pool_put(&socket->data_pool, item);
+    }
+    else {
+      message_sent(socket, item);
+    }
+  }
+  cancel_timeout(&sender->syn_timer);
+  cancel_timeout(&sender->fin_timer);
+  cancel_timeout(&sender->probe_timer);
+  cancel_timeout(&sender->pace_timer);
+  free(sender->sliding_window);
+  free(sender);
+}
+
+/* 
+ * Processes an ACK for DATA: everything before ackno is acknowledged, as are the packets 
+ * in the SACK blocks. Returns true if packets were released from the head of the window
+ */
+bool_t window_ack(struct sender_session *sender, u_int32_t ackno, struct rudp_sack *blocks, int nblocks) {
+  bool_t released = false;
+  /* The RTT is sampled from the most recently sent packet this ACK acknowledges,
+   * unless any packet it acknowledges was retransmitted (Karn's algorithm) */
+  struct timeval sample;
+  bool_t sampled = false;
+  bool_t ambiguous = false;
+  int acked = 0; /* Packets acknowledged for the first time */
+  if(sender->window_count > 0 && SEQ_GT(ackno, sender->window_base) &&
+     SEQ_LEQ(ackno, sender->window_base + sender->window_count)) {
+    while(sender->window_count > 0 && SEQ_LT(sender->window_base, ackno)) {
+      struct window_slot *slot = window_slot(sender, 0);
+      if(!slot->sacked) {
+        acked++;
+        if(slot->retransmission_attempts > 0) {
+          ambiguous = true;
+        }
+        else if(!sampled || timercmp(&slot->sent_time, &sample, >)) {
+          sample = slot->sent_time;
+          sampled = true;
+        }
+      }
+      window_remove_head(sender);
+    }
+    released = true;
+  }
+
+  /* Selectively acknowledged packets will not be retransmitted */
+  int i;
+  for(i = 0; i < nblocks; i++) {
+    u_int32_t seqno;
+    for(seqno = blocks[i].start; SEQ_LT(seqno, blocks[i].end); seqno++) {
+      struct window_slot *slot = window_find(sender, seqno);
+      if(slot == NULL) {
+        if(SEQ_LT(seqno, sender->window_base)) {
+          continue;
+        }
+        break; /* Beyond the window */
+      }
+      if(!slot->sacked) {
+        slot->sacked = true;
+        cancel_timeout(&slot->timer);
+        acked++;
+        if(slot->retransmission_attempts > 0) {
+          ambiguous = true;
+        }
+        else if(!sampled || timercmp(&slot->sent_time, &sample, >)) {
+          sample = slot->sent_time;
+          sampled = true;
+        }
+      }
+    }
+  }
+  int rtt = -1;
+  if(sampled && !ambiguous) {
+    rtt = rtt_update(sender, &sample);
+  }
+  if(acked > 0) {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    sender->cc.ops->on_ack(&sender->cc, ackno, acked, rtt, &now);
+  }
+  return released;
+}
+
+/* Updates the RTT estimate and retransmission timeout of a sender session
+ * with the RTT of a packet sent at sent_time, as in RFC 6298. Returns the
+ * RTT in microseconds, or -1 */
+int rtt_update(struct sender_session *sender, struct timeval *sent_time) {
+  struct timeval now, rtt;
+  gettimeofday(&now, NULL);
+  if(timercmp(&now, sent_time, <)) {
+    return -1; /* The clock was set back */
+  }
+  timersub(&now, sent_time, &rtt);
+  int r = rtt.tv_sec * 1000000 + rtt.tv_usec;
+
+  if(!sender->rtt_measured) {
+    sender->srtt = r;
+    sender->rttvar = r / 2;
+    sender->rtt_measured = true;
+  }
+  else {
+    int delta = sender->srtt - r;
+    if(delta < 0) {
+      delta = -delta;
+    }
+    sender->rttvar = (3 * sender->rttvar + delta) / 4;
+    sender->srtt = (7 * sender->srtt + r) / 8;
+  }
+
+  /* The variation term is at least the timer granularity of 1 ms */
+  int var = 4 * sender->rttvar;
+  if(var < 1000) {
+    var = 1000;
+  }
+  sender->rto = sender->srtt + var;
+  if(sender->rto < RUDP_MINTIMEOUT * 1000) {
+    sender->rto = RUDP_MINTIMEOUT * 1000;
+  }
+  if(sender->rto > RUDP_MAXTIMEOUT * 1000) {
+    sender->rto = RUDP_MAXTIMEOUT * 1000;
+  }
+  return r;
+}
+
+/* Returns the timeout in microseconds for a packet which has been retransmitted
+ * attempts times. The timeout doubles with every retransmission */
+int retransmit_delay(struct sender_session *sender, int attempts) {
+  int delay = sender->rto;
+  while(attempts-- > 0 && delay < RUDP_MAXTIMEOUT * 1000) {
+    delay *= 2;
+  }
+  if(delay > RUDP_MAXTIMEOUT * 1000) {
+    delay = RUDP_MAXTIMEOUT * 1000;
+  }
+  return delay;
+}
+
+/* Starts fast recovery after RUDP_DUPACKS duplicate ACKs. The losses among the
+ * packets in the window are repaired without waiting for their timeouts */
+void fast_retransmit(struct rudp_socket_list *socket, struct session *session) {
+  struct sender_session *sender = session->sender;
+  if(sender->window_count == 0) {
+    return;
+  }
+  sender->in_recovery = true;
+  sender->recover = sender->window_base + sender->window_count;
+  sender->high_rxt = sender->window_base;
+  recovery_retransmit(socket, session);
+}
+
+/*
+ * During fast recovery, retransmits the packets before recover which are taken
+ * to be lost and have not been retransmitted during it yet: the head of the
+ * window, which a partial ACK leaves unacknowledged (RFC 6582), and the packets
+ * the receiver is missing although it has SACKed later ones (RFC 6675)
+ */
+void recovery_retransmit(struct rudp_socket_list *socket, struct session *session) {
+  struct sender_session *sender = session->sender;
+  int sacked_end = 0; /* Index after the last SACKed packet */
+  int i;
+  for(i = sender->window_count - 1; i > 0; i--) {
+    if(window_slot(sender, i)->sacked) {
+      sacked_end = i + 1;
+      break;
+    }
+  }
+  i = SEQ_GT(sender->high_rxt, sender->window_base) ? sender->high_rxt - sender->window_base : 0;
+  for(; i < sender->window_count && (i == 0 || i < sacked_end); i++) {
+    u_int32_t seqno = sender->window_base + i;
+    if(SEQ_GEQ(seqno, sender->recover)) {
+      break;
+    }
+    retransmit_slot(socket, session, window_slot(sender, i));
+    sender->high_rxt = seqno + 1;
+  }
+}
+
+/* Retransmits a packet in the window without waiting for its timeout */
+void retransmit_slot(struct rudp_socket_list *socket, struct session *session, struct window_slot *slot) {
+  struct sender_session *sender = session->sender;
+  if(slot->sacked || slot->retransmission_attempts >= RUDP_MAXRETRANS) {
+    return; /* Leave it to the timeout */
+  }
+  cancel_timeout(&slot->timer);
+  slot->retransmission_attempts++;
+  socket->stats.retransmits++;
+  session->stats.retransmits++;
+  sender->cc.ops->on_loss(&sender->cc, slot->packet.header.seqno,
+                          sender->window_base + sender->window_count, sender->window_count, 0);
+  send_packet(false, socket->rsock, &slot->packet, &session->address);
+}
+
+/* Callback function when pacing allows a sender session to send again */
+int pace_callback(int fd, void *args) {
+  struct timeoutargs *timeargs = (struct timeoutargs *)args;
+  struct rudp_socket_list *curr_socket = timeargs->socket;
+  struct session *curr_session = find_session(curr_socket, &timeargs->recipient);
+  if(curr_session != NULL && curr_session->sender != NULL) {
+    /* The timer has fired, so its handle is no longer valid */
+    curr_session->sender->pace_timer = NULL;
+    if(curr_session->sender->status == OPEN) {
+      send_queued_data(curr_socket, curr_session);
+    }
+  }
+  pool_put(&curr_socket->timer_pool, timeargs);
+  return 0;
+}
+
+/*
+ * Sends the next probe of path MTU discovery, unless the largest payload is
+ * known closely enough. The largest payload the MTU allows is probed first,
+ * since that is what most paths take, then the sizes halfway between the
+ * largest which got through and the smallest which did not
+ */
+void probe_next(struct rudp_socket_list *socket, struct session *session) {
+  struct sender_session *sender = session->sender;
+  sender->probe_size = 0;
+  if(sender->status != OPEN || sender->probe_high - sender->probe_low < RUDP_PROBESTEP) {
+    return;
+  }
+  if(sender->probe_high == sender->payload_max) {
+    sender->probe_size = sender->probe_high;
+  }
+  else {
+    sender->probe_size = (sender->probe_low + sender->probe_high + 1) / 2;
+  }
+  sender->probe_attempts = 0;
+  probe_send(socket, session);
+}
+
+/* Sends the probe in flight, padded to its size */
+void probe_send(struct rudp_socket_list *socket, struct session *session) {
+  struct sender_session *sender = session->sender;
+  struct rudp_packet p;
+  init_rudp_packet(&p, RUDP_PROBE, sender->probe_size, sender->probe_size, NULL);
+  memset(p.payload, 0, sender->probe_size);
+  send_packet(false, socket->rsock, &p, &session->address);
+}
+
+/* Echoes a probe from the peer, or takes the echo of our own probe, in which
+ * case DATA packets of its size get through */
+void probe_received(struct rudp_socket_list *socket, struct session *session, struct rudp_packet *p) {
+  struct sender_session *sender = session->sender;
+  if(p->header.length > 0) {
+    if(session->receiver != NULL) {
+      struct rudp_packet echo;
+      init_rudp_packet(&echo, RUDP_PROBE, p->header.seqno, 0, NULL);
+      send_packet(true, socket->rsock, &echo, &session->address);
+    }
+  }
+  else if(sender != NULL && sender->probe_size > 0 && p->header.seqno == sender->probe_size) {
+    cancel_timeout(&sender->probe_timer);
+    sender->payload = sender->probe_low = sender->probe_size;
+    RUDP_DEBUG("Path MTU discovery: %d bytes per packet to %s:%d\n", sender->payload,
+               inet_ntoa(session->address.sin_addr), ntohs(session->address.sin_port));
+    probe_next(socket, session);
+  }
+}
+
+/* Initializes an empty pool of objects of the given size */
+void pool_init(struct pool *pool, int size, int per_slab) {
+  /* Objects are aligned like pointers, and must have room for the free list link */
+  pool->size = (size + sizeof(void *) - 1) / sizeof(void *) * sizeof(void *);
+  pool->per_slab = per_slab;
+  pool->free_list = NULL;
+  pool->slabs = NULL;
+}
+
+/* Takes an object from a pool, allocating a new slab if the pool is empty. Returns NULL on error */
+void *pool_get(struct pool *pool) {
+  if(pool->free_list == NULL) {
+    struct pool_slab *slab = malloc(sizeof(struct pool_slab) + pool->per_slab * pool->size);
+    if(slab == NULL) {
+      fprintf(stderr, "pool_get: Error allocating memory\n");
+      return NULL;
+    }
+    slab->next = pool->slabs;
+    pool->slabs = slab;
+    int i;
+    for(i = 0; i < pool->per_slab; i++) {
+      pool_put(pool, (char *)(slab + 1) + i * pool->size);
+    }
+  }
+  void *object = pool->free_list;
+  pool->free_list = *(void **)object;
+  return object;
+}
+
+/* Returns an object to its pool */
+void pool_put(struct pool *pool, void *object) {
+  *(void **)object = pool->free_list;
+  pool->free_list = object;
+}
+
+/* Frees all memory of a pool. All objects must have been returned to it */
+void pool_destroy(struct pool *pool) {
+  while(pool->slabs != NULL) {
+    struct pool_slab *slab = pool->slabs;
+    pool->slabs = slab->next;
+    free(slab);
+  }
+  pool->free_list = NULL;
+}
+
+/* Finds the session with a peer, or returns NULL */
+struct session *find_session(struct rudp_socket_list *socket, struct sockaddr_in *addr) {
+  if(socket->session_table == NULL) {
+    return NULL;
+  }
+  int mask = socket->table_capacity - 1;
+  int i = session_hash(addr) & mask;
+  while(socket->session_table[i] != NULL) {
+    if(socket->session_table[i] != &deleted_session && 
+       compare_sockaddr(&socket->session_table[i]->address, addr) == 1) {
+      return socket->session_table[i];
+    }
+    i = (i + 1) & mask;
+  }
+  return NULL;
+}
+
+/* Hashes a peer address for the session table */
+u_int32_t session_hash(struct sockaddr_in *addr) {
+  u_int32_t h = addr->sin_addr.s_addr ^ ((u_int32_t)addr->sin_port << 16 | addr->sin_port);
+  h *= 2654435761U; /* Fibonacci hashing, then fold the better mixed upper bits down */
+  return h ^ (h >> 16);
+}
+
+/* Rebuilds the session table with capacity slots, dropping deleted slots */
+int session_table_resize(struct rudp_socket_list *socket, int capacity) {
+  struct session **table = calloc(capacity, sizeof(struct session *));
+  if(table == NULL) {
+    fprintf(stderr, "session_table_resize: Error allocating session table\n");
+    return -1;
+  }
+  int used = 0;
+  struct session *curr_session;
+  for(curr_session = socket->sessions_list_head; curr_session != NULL; curr_session = curr_session->next) {
+    int i = session_hash(&curr_session->address) & (capacity - 1);
+    while(table[i] != NULL) {
+      i = (i + 1) & (capacity - 1);
+    }
+    table[i] = curr_session;
+    used++;
+  }
+  free(socket->session_table);
+  socket->session_table = table;
+  socket->table_capacity = capacity;
+  socket->table_used = used;
+  return 0;
+}
+
+/* Adds a session to the socket's hash table and appends it to its session list,
+ * making room by freeing the least recently active session if the socket has
+ * RUDP_OPT_MAXSESSIONS already. There must not be a session with the same peer yet */
+int session_insert(struct rudp_socket_list *socket, struct session *session) {
+  if(socket->max_sessions > 0 && socket->session_count >= socket->max_sessions) {
+    session_reap(socket, socket->sessions_list_head);
+  }
+  if((socket->table_used + 1) * 4 > socket->table_capacity * 3) {
+    /* Keep the table at most 3/4 full, counting deleted slots */
+    int capacity = socket->table_capacity ? socket->table_capacity : 16;
+    while((socket->session_count + 1) * 2 > capacity) {
+      capacity *= 2;
+    }
+    if(session_table_resize(socket, capacity) < 0) {
+      return -1;
+    }
+  }
+  int mask = socket->table_capacity - 1;
+  int i = session_hash(&session->address) & mask;
+  while(socket->session_table[i] != NULL && socket->session_table[i] != &deleted_session) {
+    i = (i + 1) & mask;
+  }
+  if(socket->session_table[i] == NULL) {
+    socket->table_used++;
+  }
+  socket->session_table[i] = session;
+
+  session->next = NULL;
+  session->prev = socket->sessions_list_tail;
+  if(socket->sessions_list_tail == NULL) {
+    socket->sessions_list_head = session;
+  }
+  else {
+    socket->sessions_list_tail->next = session;
+  }
+  socket->sessions_list_tail = session;
+  socket->session_count++;
+  gettimeofday(&session->last_active, NULL);
+  memset(&session->stats, 0, sizeof(struct rudp_stats));
+  if(socket->idle_timeout > 0 && socket->idle_timer == NULL) {
+    idle_schedule(socket);
+  }
+  return 0;
+}
+
+/* Removes a session from the socket's hash table and session list, without freeing it */
+void session_remove(struct rudp_socket_list *socket, struct session *session) {
+  int mask = socket->table_capacity - 1;
+  int i = session_hash(&session->address) & mask;
+  while(socket->session_table[i] != NULL) {
+    if(socket->session_table[i] == session) {
+      /* A lookup must still probe past this slot */
+      socket->session_table[i] = &deleted_session;
+      break;
+    }
+    i = (i + 1) & mask;
+  }
+
+  if(session->prev == NULL) {
+    socket->sessions_list_head = session->next;
+  }
+  else {
+    session->prev->next = session->next;
+  }
+  if(session->next == NULL) {
+    socket->sessions_list_tail = session->prev;
+  }
+  else {
+    session->next->prev = session->prev;
+  }
+  socket->session_count--;
+}
+
+/* A packet has arrived from the peer of a session. Moves the session to the
+ * end of the list, so that the list stays in order of activity */
+void session_touch(struct rudp_socket_list *socket, struct session *session) {
+  gettimeofday(&session->last_active, NULL);
+  if(session->next == NULL) {
+    return; /* Already the most recently active */
+  }
+  if(session->prev == NULL) {
+    socket->sessions_list_head = session->next;
+  }
+  else {
+    session->prev->next = session->next;
+  }
+  session->next->prev = session->prev;
+  session->next = NULL;
+  session->prev = socket->sessions_list_tail;
+  socket->sessions_list_tail->next = session;
+  socket->sessions_list_tail = session;
+}
+
+/* Frees a session whose peer has gone quiet, or which is evicted to make room
+ * for a new one. If data to or from the peer is cut off with it, the application
+ * hears of it through RUDP_EVENT_TIMEOUT once the event loop iteration ends, as
+ * the caller may be in the middle of changing the session table */
+void session_reap(struct rudp_socket_list *socket, struct session *session) {
+  struct sockaddr_in peer = session->address;
+  struct sender_session *sender = session->sender;
+  struct receiver_session *receiver = session->receiver;
+  bool_t lost = (sender != NULL && !sender->session_finished && 
+                 (sender->data_queue != NULL || sender->window_count > 0)) ||
+                (receiver != NULL && !receiver->session_finished);
+  RUDP_DEBUG("Freeing idle session with %s:%d on socket=%d\n", 
+             inet_ntoa(peer.sin_addr), ntohs(peer.sin_port), (int)socket->rsock);
+  session_remove(socket, session);
+  free_sender_session(socket, session->sender);
+  free_receiver_session(session->receiver);
+  free(session);
+  if(lost && socket->handler != NULL) {
+    struct reaped_peer *reaped = malloc(sizeof(struct reaped_peer));
+    if(reaped == NULL) {
+      fprintf(stderr, "session_reap: Error allocating memory\n");
+      return;
+    }
+    reaped->peer = peer;
+    reaped->next = NULL;
+    if(socket->reaped == NULL) {
+      socket->reaped = reaped;
+    }
+    else {
+      socket->reaped_tail->next = reaped;
+    }
+    socket->reaped_tail = reaped;
+  }
+}
+
+/* Sets the idle timer for when the least recently active session times out */
+void idle_schedule(struct rudp_socket_list *socket) {
+  if(socket->idle_timer != NULL) {
+    event_timeout_cancel(socket->idle_timer);
+    socket->idle_timer = NULL;
+  }
+  if(socket->idle_timeout == 0 || socket->sessions_list_head == NULL) {
+    return;
+  }
+  struct timeval delay, when;
+  delay.tv_sec = socket->idle_timeout / 1000;
+  delay.tv_usec = (socket->idle_timeout % 1000) * 1000;
+  timeradd(&socket->sessions_list_head->last_active, &delay, &when);
+  socket->idle_timer = event_timeout(when, idle_callback, socket, "idle_callback");
+}
+
+/* Callback function when the least recently active session may have timed out.
+ * Frees all sessions which have been idle for RUDP_OPT_IDLE */
+int idle_callback(int fd, void *arg) {
+  struct rudp_socket_list *socket = (struct rudp_socket_list *)arg;
+  /* The timer has fired, so its handle is no longer valid */
+  socket->idle_timer = NULL;
+
+  struct timeval now, delay, idle_since;
+  gettimeofday(&now, NULL);
+  delay.tv_sec = socket->idle_timeout / 1000;
+  delay.tv_usec = (socket->idle_timeout % 1000) * 1000;
+  timersub(&now, &delay, &idle_since);
+  while(socket->sessions_list_head != NULL && 
+        !timercmp(&socket->sessions_list_head->last_active, &idle_since, >)) {
+    session_reap(socket, socket->sessions_list_head);
+  }
+  if(socket->close_requested && close_socket_if_done(socket, NULL)) {
+    /* The socket is gone */
+    return 0;
+  }
+  if(socket->idle_timer == NULL) {
+    idle_schedule(socket);
+  }
+  return 0;
+}
+
+/* Closes a socket on which rudp_close() was called once all of its sessions
+ * are finished. peer is passed to the RUDP_EVENT_CLOSED handler. Returns
+ * true if the socket was closed */
+bool_t close_socket_if_done(struct rudp_socket_list *socket, struct sockaddr_in *peer) {
+  struct session *curr_session;
+  for(curr_session = socket->sessions_list_head; curr_session != NULL; curr_session = curr_session->next) {
+    if(curr_session->sender != NULL && curr_session->sender->session_finished == false) {
+      return false;
+    }
+    if(curr_session->receiver != NULL && curr_session->receiver->session_finished == false) {
+      return false;
+    }
+  }
+
+  /* The last ACKs may still be in the batch */
+  batch_flush(socket);
+  event_flush_delete(flush_callback, socket);
+  if(socket->idle_timer != NULL) {
+    event_timeout_cancel(socket->idle_timer);
+  }
+  emulate_free(socket);
+
+  while(socket->sessions_list_head != NULL) {
+    curr_session = socket->sessions_list_head;
+    session_remove(socket, curr_session);
+    free_sender_session(socket, curr_session->sender);
+    free_receiver_session(curr_session->receiver);
+    free(curr_session);
+  }
+  report_reaped(socket);
+  report_sent_messages(socket);
+  free(socket->session_table);
+  free(socket->syn_history);
+  pool_destroy(&socket->data_pool);
+  pool_destroy(&socket->timer_pool);
+  int i;
+  for(i = 0; i < RUDP_MAXBATCH; i++) {
+    if(socket->rx->rbuf[i] != NULL) {
+      rudp_buf_release(socket->rx->rbuf[i]);
+    }
+  }
+  free(socket->rx);
+  free(socket->tx->packets);
+  free(socket->tx);
+  free(socket->gro_buf);
+  postq_free(socket->postq);
+
+  /* Unlink the socket */
+  struct rudp_socket_list **link = &socket_list_head;
+  while(*link != socket) {
+    link = &(*link)->next;
+  }
+  *link = socket->next;
+
+  if(socket->handler != NULL) {
+    socket->handler(socket->rsock, RUDP_EVENT_CLOSED, peer);
+  }
+  event_fd_delete(receive_callback, socket->rsock);
+  close((int)socket->rsock);
+  free(socket);
+  return true;
+}
+
+/* Allocates a receiver session which expects seqno as the first DATA packet,
+ * from a sender with the given window */
+struct receiver_session *alloc_receiver_session(u_int32_t seqno, int window) {
+  struct receiver_session *receiver = malloc(sizeof(struct receiver_session));
+  if(receiver == NULL) {
+    return NULL;
+  }
+  receiver->status = OPENING;
+  receiver->session_finished = false;
+  receiver->expected_seqno = seqno;
+  receiver->initial_seqno = seqno;
+  receiver->window = window;
+  receiver->reorder_buffer = NULL;
+  receiver->reorder_capacity = 0;
+  receiver->reorder_count = 0;
+  receiver->unacked = 0;
+  receiver->ack_timer = NULL;
+  receiver->message = NULL;
+  receiver->message_len = 0;
+  receiver->message_capacity = 0;
+  receiver->message_discard = false;
+  return receiver;
+}
+
+/* Frees a receiver session along with its reorder buffer */
+void free_receiver_session(struct receiver_session *receiver) {
+  if(receiver == NULL) {
+    return;
+  }
+  cancel_timeout(&receiver->ack_timer);
+  int i;
+  for(i = 0; i < receiver->reorder_capacity; i++) {
+    if(receiver->reorder_buffer[i].buf != NULL) {
+      rudp_buf_release(receiver->reorder_buffer[i].buf);
+    }
+  }
+  free(receiver->reorder_buffer);
+  if(receiver->message != NULL) {
+    rudp_buf_release(receiver->message);
+  }
+  free(receiver);
+}
+
+/* 
+ * Keeps a packet which arrived out of order, if it is within the sender's window.
+ * The packet's buffer *bufp is taken over, if it has one. Returns 0 if the
+ * packet was stored or was already buffered, -1 if it was dropped
+ */
+int reorder_store(struct rudp_socket_list *socket, struct receiver_session *receiver, struct rudp_packet *p, struct rudp_buf **bufp) {
+  u_int32_t offset = p->header.seqno - receiver->expected_seqno;
+  if(offset >= (u_int32_t)receiver->window) {
+    return -1;
+  }
+  if(receiver->window > receiver->reorder_capacity) {
+    /* (Re)allocate the buffer for the sender's window size */
+    int capacity = 4;
+    while(capacity < receiver->window) {
+      capacity *= 2;
+    }
+    struct reorder_slot *buffer = malloc(capacity * sizeof(struct reorder_slot));
+    if(buffer == NULL) {
+      fprintf(stderr, "reorder_store: Error allocating reorder buffer\n");
+      return -1;
+    }
+    int i;
+    for(i = 0; i < capacity; i++) {
+      buffer[i].used = false;
+      buffer[i].buf = NULL;
+    }
+    u_int32_t seqno;
+    int moved = 0;
+    for(seqno = receiver->expected_seqno + 1; moved < receiver->reorder_count; seqno++) {
+      struct reorder_slot *slot = &receiver->reorder_buffer[seqno & (receiver->reorder_capacity - 1)];
+      if(slot->used) {
+        buffer[seqno & (capacity - 1)] = *slot;
+        moved++;
+      }
+    }
+    free(receiver->reorder_buffer);
+    receiver->reorder_buffer = buffer;
+    receiver->reorder_capacity = capacity;
+  }
+
+  struct reorder_slot *slot = &receiver->reorder_buffer[p->header.seqno & (receiver->reorder_capacity - 1)];
+  if(!slot->used) {
+    slot->buf = buf_take(socket->buf_pool, bufp, p);
+    if(slot->buf == NULL) {
+      return -1;
+    }
+    slot->used = true;
+    receiver->reorder_count++;
+  }
+  return 0;
+}
+
+/* Returns the pool of receive buffers with room for payload bytes, creating
+ * it if there is none yet. Returns NULL on error */
+struct buf_pool *buf_pool_find(int payload) {
+  struct buf_pool *bp;
+  for(bp = buf_pools; bp != NULL; bp = bp->next) {
+    if(bp->payload == payload) {
+      return bp;
+    }
+  }
+  bp = malloc(sizeof(struct buf_pool));
+  if(bp == NULL) {
+    fprintf(stderr, "buf_pool_find: Error allocating memory\n");
+    return NULL;
+  }
+  pool_init(&bp->pool, offsetof(struct rudp_buf, packet) + sizeof(struct rudp_hdr) + payload, RUDP_MAXBATCH);
+  bp->released = NULL;
+  bp->payload = payload;
+  bp->next = buf_pools;
+  buf_pools = bp;
+  return bp;
+}
+
+/* Returns a receive buffer from a pool, with one reference. Must be called
+ * from the thread of the pool */
+struct rudp_buf *buf_get(struct buf_pool *pool) {
+  if(pool->pool.free_list == NULL) {
+    /* Reuse the buffers released since, rather than allocate a slab */
+    pool->pool.free_list = __atomic_exchange_n(&pool->released, NULL, __ATOMIC_ACQUIRE);
+  }
+  struct rudp_buf *buf = pool_get(&pool->pool);
+  if(buf == NULL) {
+    fprintf(stderr, "buf_get: Error allocating receive buffer\n");
+    return NULL;
+  }
+  buf->refs = 1;
+  buf->pool = pool;
+  return buf;
+}
+
+/* Returns the buffer of a received packet and clears *bufp, so
+ * that the caller owns its reference. A packet without a buffer, such as
+ * one coalesced by GRO, is copied into a new buffer */
+struct rudp_buf *buf_take(struct buf_pool *pool, struct rudp_buf **bufp, struct rudp_packet *p) {
+  struct rudp_buf *buf = *bufp;
+  if(buf != NULL) {
+    *bufp = NULL;
+    return buf;
+  }
+  buf = buf_get(pool);
+  if(buf != NULL) {
+    memcpy(&buf->packet, p, RUDP_PKTLEN(p));
+  }
+  return buf;
+}
+
+/* Passes the payload of a DATA packet up to the application. A
+ * rudp_recvbuf_handler() gets the packet's buffer, which is set up in *bufp
+ * if the packet does not have one yet. The fragments of a message are passed
+ * up together, once the last one is in, from the buffer they were put
+ * together in */
+void deliver_data(struct rudp_socket_list *socket, struct receiver_session *receiver, struct sockaddr_in *from, struct rudp_packet *p, struct rudp_buf **bufp) {
+  if((p->header.flags & RUDP_MORE) || receiver->message_len > 0 || receiver->message_discard) {
+    int len = reassemble(socket, receiver, p);
+    if(len < 0) {
+      return;
+    }
+    struct rudp_buf *message = receiver->message;
+    char *data = (char *)message->packet.payload;
+    if(socket->recvbuf_handler != NULL) {
+      socket->recvbuf_handler(socket->rsock, from, message, data, len);
+    }
+    else if(socket->recv_handler != NULL) {
+      socket->recv_handler(socket->rsock, from, data, len);
+    }
+    if(__atomic_load_n(&message->refs, __ATOMIC_RELAXED) > 1) {
+      /* The application holds on to the message, the next one needs a buffer of its own */
+      rudp_buf_release(message);
+      receiver->message = NULL;
+      receiver->message_capacity = 0;
+    }
+    return;
+  }
+  if(socket->recvbuf_handler != NULL) {
+    if(*bufp == NULL) {
+      *bufp = buf_take(socket->buf_pool, bufp, p);
+      if(*bufp == NULL) {
+        return;
+      }
+    }
+    p = &(*bufp)->packet;
+    socket->recvbuf_handler(socket->rsock, from, *bufp, p->payload, p->header.length);
+  }
+  else if(socket->recv_handler != NULL) {
+    socket->recv_handler(socket->rsock, from, p->payload, p->header.length);
+  }
+}
+
+/* Keeps a received buffer beyond the call to the handler */
+void rudp_buf_hold(rudp_buf_t buf) {
+  __atomic_add_fetch(&buf->refs, 1, __ATOMIC_RELAXED);
+}
+
+/* Releases a received buffer. May be called from any thread */
+void rudp_buf_release(rudp_buf_t buf) {
+  if(__atomic_sub_fetch(&buf->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+    struct buf_pool *pool = buf->pool;
+    if(pool == NULL) {
+      free(buf);
+      return;
+    }
+    void *head = __atomic_load_n(&pool->released, __ATOMIC_RELAXED);
+    do {
+      *(void **)buf = head;
+    } while(!__atomic_compare_exchange_n(&pool->released, &head, buf, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+  }
+}
+
+/* Appends a fragment to the message being received, which is put together in
+ * the payload of a buffer the receiver session owns. Returns the length of the
+ * message once it is complete, else -1. A message longer than the socket allows
+ * is dropped */
+int reassemble(struct rudp_socket_list *socket, struct receiver_session *receiver, struct rudp_packet *p) {
+  if(!receiver->message_discard) {
+    int len = receiver->message_len + p->header.length;
+    if((len > receiver->message_capacity || receiver->message == NULL) && len <= socket->maxmsg) {
+      int capacity = receiver->message_capacity > 0 ? receiver->message_capacity : 4 * RUDP_MAXPKTSIZE;
+      while(capacity < len) {
+        capacity *= 2;
+      }
+      if(capacity > socket->maxmsg) {
+        capacity = socket->maxmsg;
+      }
+      struct rudp_buf *message = realloc(receiver->message, offsetof(struct rudp_buf, packet) + sizeof(struct rudp_hdr) + capacity);
+      if(message != NULL) {
+        if(receiver->message == NULL) {
+          message->refs = 1;
+          message->pool = NULL;
+        }
+        receiver->message = message;
+        receiver->message_capacity = capacity;
+      }
+    }
+    if(len > receiver->message_capacity || receiver->message == NULL) {
+      RUDP_WARN("reassemble: Dropping message longer than %d bytes\n", socket->maxmsg);
+      receiver->message_discard = true;
+      receiver->message_len = 0;
+    }
+    else {
+      memcpy((char *)receiver->message->packet.payload + receiver->message_len, p->payload, p->header.length);
+      receiver->message_len = len;
+    }
+  }
+  if(p->header.flags & RUDP_MORE) {
+    return -1;
+  }
+  /* The last fragment */
+  int len = receiver->message_len;
+  receiver->message_len = 0;
+  if(receiver->message_discard) {
+    receiver->message_discard = false;
+    return -1;
+  }
+  return len;
+}
+
+/* 
+ * Sends a cumulative ACK for the DATA received in order, with SACK blocks for up to
+ * RUDP_MAXSACK runs of packets held in the reorder buffer
+ */
+void send_data_ack(struct rudp_socket_list *socket, struct session *session) {
+  struct receiver_session *receiver = session->receiver;
+  struct rudp_sack blocks[RUDP_MAXSACK];
+  int nblocks = 0;
+  int seen = 0;
+  u_int32_t seqno;
+
+  for(seqno = receiver->expected_seqno + 1; seen < receiver->reorder_count; seqno++) {
+    if(receiver->reorder_buffer[seqno & (receiver->reorder_capacity - 1)].used) {
+      if(nblocks == 0 || blocks[nblocks-1].end != seqno) {
+        if(nblocks == RUDP_MAXSACK) {
+          break;
+        }
+        blocks[nblocks].start = seqno;
+        nblocks++;
+      }
+      blocks[nblocks-1].end = seqno + 1;
+      seen++;
+    }
+  }
+
+  /* This ACK covers any delayed one */
+  cancel_timeout(&receiver->ack_timer);
+  receiver->unacked = 0;
+
+  struct rudp_packet p;
+  init_rudp_packet(&p, RUDP_ACK, receiver->expected_seqno, nblocks * sizeof(struct rudp_sack), (char *)blocks);
+  send_packet(true, socket->rsock, &p, &session->address);
+}
+
+/*
+ * ACKs a DATA packet received in order. Unless there are packets outside of
+ * the reorder buffer, every socket->delack packets are ACKed together, and an
+ * ACK is delayed by at most RUDP_DELACKTIMEOUT
+ */
+void delay_data_ack(struct rudp_socket_list *socket, struct session *session) {
+  struct receiver_session *receiver = session->receiver;
+  receiver->unacked++;
+  if(receiver->unacked >= socket->delack || receiver->reorder_count > 0) {
+    send_data_ack(socket, session);
+    return;
+  }
+  if(receiver->ack_timer != NULL) {
+    return;
+  }
+  struct timeoutargs *timeargs = pool_get(&socket->timer_pool);
+  if(timeargs == NULL) {
+    fprintf(stderr, "delay_data_ack: Error allocating timeout args\n");
+    send_data_ack(socket, session);
+    return;
+  }
+  timeargs->socket = socket;
+  timeargs->recipient = session->address;
+  timeargs->type = RUDP_ACK;
+  timeargs->seqno = receiver->expected_seqno;
+
+  struct timeval now, delay, timeout_time;
+  gettimeofday(&now, NULL);
+  delay.tv_sec = 0;
+  delay.tv_usec = RUDP_DELACKTIMEOUT * 1000;
+  timeradd(&now, &delay, &timeout_time);
+  receiver->ack_timer = event_timeout(timeout_time, delack_callback, timeargs, "delack_callback");
+  if(receiver->ack_timer == NULL) {
+    fprintf(stderr, "delay_data_ack: Error registering timeout\n");
+    pool_put(&socket->timer_pool, timeargs);
+    send_data_ack(socket, session);
+  }
+}
+
+/* Callback function when an ACK has been delayed long enough */
+int delack_callback(int fd, void *args) {
+  struct timeoutargs *timeargs = (struct timeoutargs *)args;
+  struct rudp_socket_list *curr_socket = timeargs->socket;
+  struct session *curr_session = find_session(curr_socket, &timeargs->recipient);
+  if(curr_session != NULL && curr_session->receiver != NULL) {
+    /* The timer has fired, so its handle is no longer valid */
+    curr_session->receiver->ack_timer = NULL;
+    send_data_ack(curr_socket, curr_session);
+  }
+  pool_put(&curr_socket->timer_pool, timeargs);
+  return 0;
+}
+
+/* Returns 1 if the two sockaddr_in structs are equal and 0 if not */
+int compare_sockaddr(struct sockaddr_in *s1, struct sockaddr_in *s2) {
+  return ((s1->sin_family == s2->sin_family) && (s1->sin_addr.s_addr == s2->sin_addr.s_addr) && (s1->sin_port == s2->sin_port));
+}
+
+/* Creates and returns a RUDP socket */
+rudp_socket_t rudp_socket(int port) {
+  return open_socket(port, false);
+}
+
+/* Creates a socket bound to a port which other sockets, typically those of other
+ * threads, may be bound to as well. The kernel spreads the peers across them */
+rudp_socket_t rudp_socket_shared(int port) {
+  return open_socket(port, true);
+}
+
+/* Creates a socket, with SO_REUSEPORT if it is shared */
+rudp_socket_t open_socket(int port, bool_t shared) {
+  if(rng_seeded == false) {
+    /* Threads which start at the same time still get different seeds */
+    rng_seed = time(NULL) ^ (unsigned long)&rng_seed;
+    rng_seeded = true;
+  }
+  int sockfd;
+  struct sockaddr_in address;
+
+  sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+  if(sockfd < 0) {
+    perror("socket");
+    return (rudp_socket_t)NULL;
+  }
+  if(shared) {
+#ifdef SO_REUSEPORT
+    int on = 1;
+    if(setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+      perror("setsockopt");
+      close(sockfd);
+      return NULL;
+    }
+#else
+    fprintf(stderr, "rudp_socket_shared: SO_REUSEPORT is not supported\n");
+    close(sockfd);
+    return NULL;
+#endif
+  }
+
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_ANY);
+  address.sin_port = htons(port);
+
+  if( bind(sockfd, (struct sockaddr *) &address, sizeof(address)) < 0) {
+    perror("bind");
+    return NULL;
+  }
+
+  /* Set the Don't Fragment bit, path MTU discovery finds out which packets fit */
+#if defined(IP_MTU_DISCOVER)
+  int pmtudisc = IP_PMTUDISC_DO;
+  if(setsockopt(sockfd, IPPROTO_IP, IP_MTU_DISCOVER, &pmtudisc, sizeof(pmtudisc)) < 0) {
+    RUDP_WARN("rudp_socket: Could not set the Don't Fragment bit\n");
+  }
+#elif defined(IP_DONTFRAG)
+  int dontfrag = 1;
+  if(setsockopt(sockfd, IPPROTO_IP, IP_DONTFRAG, &dontfrag, sizeof(dontfrag)) < 0) {
+    RUDP_WARN("rudp_socket: Could not set the Don't Fragment bit\n");
+  }
+#endif
+
+  rudp_socket_t socket = (rudp_socket_t)sockfd;
+
+  /* Create new socket and add to list of sockets */
+  struct rudp_socket_list *new_socket = malloc(sizeof(struct rudp_socket_list));
+  if(new_socket == NULL) {
+    fprintf(stderr, "rudp_socket: Error allocating memory for socket list\n");
+    return (rudp_socket_t) -1;
+  }
+  new_socket->rsock = socket;
+  new_socket->close_requested = false;
+  new_socket->window = RUDP_WINDOW;
+  new_socket->delack = RUDP_DELACK;
+  new_socket->maxmsg = RUDP_MAXMSG;
+  new_socket->sndbuf = RUDP_SNDBUF;
+  new_socket->writable_pending = 0;
+  new_socket->earlydata = 0;
+  new_socket->syn_history = NULL;
+  new_socket->postq = NULL;
+  new_socket->recv_paused = false;
+  new_socket->cc_ops = &rudp_cc_newreno;
+  new_socket->sessions_list_head = NULL;
+  new_socket->sessions_list_tail = NULL;
+  new_socket->session_count = 0;
+  new_socket->idle_timeout = 0;
+  new_socket->max_sessions = 0;
+  new_socket->idle_timer = NULL;
+  memset(&new_socket->stats, 0, sizeof(struct rudp_stats));
+  new_socket->emulation = NULL;
+  new_socket->session_table = NULL;
+  new_socket->table_capacity = 0;
+  new_socket->table_used = 0;
+  pool_init(&new_socket->data_pool, sizeof(struct data), RUDP_POOLSLAB);
+  pool_init(&new_socket->timer_pool, sizeof(struct timeoutargs), RUDP_POOLSLAB);
+  new_socket->batch = RUDP_BATCH;
+  new_socket->rx = malloc(sizeof(struct rudp_rxbatch));
+  new_socket->tx = malloc(sizeof(struct rudp_batch));
+  if(new_socket->rx == NULL || new_socket->tx == NULL) {
+    fprintf(stderr, "rudp_socket: Error allocating packet batches\n");
+    free(new_socket->rx);
+    free(new_socket->tx);
+    free(new_socket);
+    close(sockfd);
+    return NULL;
+  }
+  new_socket->rx->count = 0;
+  memset(new_socket->rx->rbuf, 0, sizeof(new_socket->rx->rbuf));
+  new_socket->tx->count = 0;
+  new_socket->tx->packets = NULL;
+  new_socket->pmtud = true;
+  if(packet_buffers(new_socket, RUDP_MTU) < 0) {
+    free(new_socket->rx);
+    free(new_socket->tx);
+    free(new_socket);
+    close(sockfd);
+    return NULL;
+  }
+  offload_probe(new_socket);
+  new_socket->next = NULL;
+  new_socket->handler = NULL;
+  new_socket->recv_handler = NULL;
+  new_socket->recvbuf_handler = NULL;
+  new_socket->sendv_handler = NULL;
+  new_socket->sent_messages = NULL;
+  new_socket->sent_messages_tail = NULL;
+  new_socket->reaped = NULL;
+  new_socket->reaped_tail = NULL;
+
+  if(socket_list_head == NULL) {
+    socket_list_head = new_socket;
+  }
+  else {
+    struct rudp_socket_list *curr = socket_list_head;
+    while(curr->next != NULL) {
+      curr = curr->next;
+    }
+    curr->next = new_socket;
+  }
+
+  /* Register callback event for this socket descriptor */
+  if(event_fd(sockfd, receive_callback, (void*) sockfd, "receive_callback") < 0) {
+    fprintf(stderr, "Error registering receive callback function");
+  }
+  if(event_flush(flush_callback, new_socket, "flush_callback") < 0) {
+    fprintf(stderr, "Error registering flush callback function");
+  }
+
+  return socket;
+}
+
+/* Finds out whether the kernel can segment (GSO) and coalesce (GRO) UDP
+ * datagrams on a socket. Neither is used until RUDP_OPT_OFFLOAD enables it */
+void offload_probe(struct rudp_socket_list *socket) {
+  socket->gso_supported = false;
+  socket->gro_supported = false;
+  socket->gso = false;
+  socket->gro = false;
+  socket->gro_buf = NULL;
+#ifdef RUDP_MMSG
+  int off = 0;
+  socket->gso_supported = setsockopt((int)socket->rsock, IPPROTO_UDP, UDP_SEGMENT, &off, sizeof(off)) == 0;
+  socket->gro_supported = setsockopt((int)socket->rsock, IPPROTO_UDP, UDP_GRO, &off, sizeof(off)) == 0;
+#endif /* RUDP_MMSG */
+}
+
+/* Turns the offloads supported on a socket on or off. Returns 0 on success,
+ * -1 if none is supported */
+int offload_enable(struct rudp_socket_list *socket, bool_t on) {
+  if(on && !socket->gso_supported && !socket->gro_supported) {
+    return -1;
+  }
+#ifdef RUDP_MMSG
+  if(socket->gro_supported && on != socket->gro) {
+    if(on && socket->gro_buf == NULL) {
+      /* Kept until the socket closes, packets of the current batch may point into it */
+      socket->gro_buf = malloc(RUDP_GROBATCH * RUDP_GROBUFSIZE);
+      if(socket->gro_buf == NULL) {
+        fprintf(stderr, "rudp_setsockopt: Error allocating GRO buffers\n");
+        return -1;
+      }
+    }
+    int v = on;
+    if(setsockopt((int)socket->rsock, IPPROTO_UDP, UDP_GRO, &v, sizeof(v)) < 0) {
+      perror("rudp_setsockopt: UDP_GRO");
+      return -1;
+    }
+    socket->gro = on;
+  }
+  socket->gso = socket->gso_supported && on;
+#endif /* RUDP_MMSG */
+  return 0;
+}
+
+/* Sizes the batch of packets to send and the receive buffers of a socket for
+ * packets of up to mtu bytes. There must not be any packets batched. Returns
+ * 0 on success, -1 on error */
+int packet_buffers(struct rudp_socket_list *socket, int mtu) {
+  int payload_max = mtu - RUDP_IPUDPHDR - sizeof(struct rudp_hdr);
+  struct buf_pool *pool = buf_pool_find(payload_max);
+  char *packets = malloc(RUDP_MAXBATCH * (sizeof(struct rudp_hdr) + payload_max));
+  if(pool == NULL || packets == NULL) {
+    fprintf(stderr, "rudp_socket: Error allocating packet buffers\n");
+    free(packets);
+    return -1;
+  }
+  free(socket->tx->packets);
+  socket->tx->packets = packets;
+  socket->tx->stride = sizeof(struct rudp_hdr) + payload_max;
+  /* The buffers to receive into are taken from the new pool from now on */
+  int i;
+  for(i = 0; i < RUDP_MAXBATCH; i++) {
+    if(socket->rx->rbuf[i] != NULL) {
+      rudp_buf_release(socket->rx->rbuf[i]);
+      socket->rx->rbuf[i] = NULL;
+    }
+  }
+  socket->mtu = mtu;
+  socket->payload_max = payload_max;
+  socket->buf_pool = pool;
+  return 0;
+}
+
+/* Receives up to a batch of datagrams on a socket without blocking. Returns
+ * the number of datagrams, which are left in socket->rx */
+int batch_receive(struct rudp_socket_list *socket) {
+  struct rudp_rxbatch *rx = socket->rx;
+  int n;
+#ifdef RUDP_MMSG
+  struct mmsghdr msgs[RUDP_MAXBATCH];
+  struct iovec iov[RUDP_MAXBATCH];
+  union {
+    char buf[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr align;
+  } ctrl[RUDP_GROBATCH];
+  /* With GRO, a datagram may hold several packets and needs a larger buffer */
+  int vlen = socket->gro && socket->batch > RUDP_GROBATCH ? RUDP_GROBATCH : socket->batch;
+  rx->gro = socket->gro;
+  memset(msgs, 0, vlen * sizeof(struct mmsghdr));
+  for(n = 0; n < vlen; n++) {
+    if(rx->gro) {
+      rx->buf[n] = socket->gro_buf + n * RUDP_GROBUFSIZE;
+      iov[n].iov_len = RUDP_GROBUFSIZE;
+      msgs[n].msg_hdr.msg_control = ctrl[n].buf;
+      msgs[n].msg_hdr.msg_controllen = sizeof(ctrl[n].buf);
+    }
+    else {
+      /* Buffers which were taken over are replaced */
+      if(rx->rbuf[n] == NULL && (rx->rbuf[n] = buf_get(socket->buf_pool)) == NULL) {
+        break;
+      }
+      rx->buf[n] = (char *)&rx->rbuf[n]->packet;
+      iov[n].iov_len = sizeof(struct rudp_hdr) + socket->payload_max;
+    }
+    iov[n].iov_base = rx->buf[n];
+    msgs[n].msg_hdr.msg_name = &rx->addr[n];
+    msgs[n].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+    msgs[n].msg_hdr.msg_iov = &iov[n];
+    msgs[n].msg_hdr.msg_iovlen = 1;
+  }
+  n = recvmmsg((int)socket->rsock, msgs, n, MSG_DONTWAIT, NULL);
+  if(n < 0) {
+    if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+      perror("receive_callback: recvmmsg");
+    }
+    return 0;
+  }
+  int i;
+  for(i = 0; i < n; i++) {
+    rx->len[i] = msgs[i].msg_len;
+    rx->segment[i] = rx->len[i];
+    struct cmsghdr *cm;
+    for(cm = CMSG_FIRSTHDR(&msgs[i].msg_hdr); cm != NULL; cm = CMSG_NXTHDR(&msgs[i].msg_hdr, cm)) {
+      if(cm->cmsg_level == IPPROTO_UDP && cm->cmsg_type == UDP_GRO) {
+        /* Coalesced packets of this size, the last one may be shorter */
+        memcpy(&rx->segment[i], CMSG_DATA(cm), sizeof(int));
+      }
+    }
+  }
+#else
+  rx->gro = false;
+  for(n = 0; n < socket->batch; n++) {
+    socklen_t sender_length = sizeof(struct sockaddr_in);
+    if(rx->rbuf[n] == NULL && (rx->rbuf[n] = buf_get(socket->buf_pool)) == NULL) {
+      break;
+    }
+    rx->buf[n] = (char *)&rx->rbuf[n]->packet;
+    ssize_t bytes = recvfrom((int)socket->rsock, rx->buf[n], sizeof(struct rudp_hdr) + socket->payload_max, MSG_DONTWAIT,
+                             (struct sockaddr *)&rx->addr[n], &sender_length);
+    if(bytes < 0) {
+      if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        perror("receive_callback: recvfrom");
+      }
+      break;
+    }
+    rx->len[n] = bytes;
+    rx->segment[n] = bytes;
+  }
+#endif /* RUDP_MMSG */
+  rx->count = n;
+  return n;
+}
+
+/* Adds a packet to the batch which is sent when the event loop iteration
+ * ends, or right away if the batch is full. Returns 0 on success, -1 on error */
+int batch_send(struct rudp_socket_list *socket, struct rudp_packet *p, struct sockaddr_in *to) {
+  struct rudp_batch *tx = socket->tx;
+  memcpy(batch_packet(tx, tx->count), p, RUDP_PKTLEN(p));
+  tx->addr[tx->count] = *to;
+  tx->count++;
+  if(tx->count >= socket->batch) {
+    return batch_flush(socket);
+  }
+  return 0;
+}
+
+/* Returns the i:th packet of a batch */
+struct rudp_packet *batch_packet(struct rudp_batch *tx, int i) {
+  return (struct rudp_packet *)(tx->packets + i * tx->stride);
+}
+
+/* Returns the number of batched packets, starting at first, which can go out
+ * as the segments of one GSO datagram: DATA packets to the same peer, all of
+ * the same size but the last one, which may be shorter */
+int gso_run(struct rudp_batch *tx, int first) {
+  int size = RUDP_PKTLEN(batch_packet(tx, first));
+  int n = 1;
+  if(batch_packet(tx, first)->header.type != RUDP_DATA) {
+    return 1;
+  }
+  while(first + n < tx->count && n < RUDP_GSOSEGS && (n + 1) * size <= RUDP_GSOBYTES) {
+    struct rudp_packet *p = batch_packet(tx, first + n);
+    if(p->header.type != RUDP_DATA || RUDP_PKTLEN(p) > size ||
+       !compare_sockaddr(&tx->addr[first + n], &tx->addr[first])) {
+      break;
+    }
+    n++;
+    if(RUDP_PKTLEN(p) < size) {
+      break;
+    }
+  }
+  return n;
+}
+
+/* Sends the batched packets of a socket. Returns 0 on success, -1 if a packet
+ * could not be sent */
+int batch_flush(struct rudp_socket_list *socket) {
+  struct rudp_batch *tx = socket->tx;
+  int ret = 0;
+  int sent = 0;
+#ifdef RUDP_MMSG
+  struct mmsghdr msgs[RUDP_MAXBATCH];
+  struct iovec iov[RUDP_MAXBATCH];
+  union {
+    char buf[CMSG_SPACE(sizeof(u_int16_t))];
+    struct cmsghdr align;
+  } ctrl[RUDP_MAXBATCH];
+  int segments[RUDP_MAXBATCH]; /* Number of packets in each message */
+  int i;
+  for(i = 0; i < tx->count; i++) {
+    iov[i].iov_base = batch_packet(tx, i);
+    iov[i].iov_len = RUDP_PKTLEN(batch_packet(tx, i));
+  }
+  while(sent < tx->count) {
+    /* One message per packet, or per run of packets if GSO may segment them */
+    int nmsgs = 0;
+    memset(msgs, 0, (tx->count - sent) * sizeof(struct mmsghdr));
+    for(i = sent; i < tx->count; i += segments[nmsgs++]) {
+      struct msghdr *hdr = &msgs[nmsgs].msg_hdr;
+      segments[nmsgs] = socket->gso ? gso_run(tx, i) : 1;
+      hdr->msg_name = &tx->addr[i];
+      hdr->msg_namelen = sizeof(struct sockaddr_in);
+      hdr->msg_iov = &iov[i];
+      hdr->msg_iovlen = segments[nmsgs];
+      if(segments[nmsgs] > 1) {
+        u_int16_t size = iov[i].iov_len;
+        hdr->msg_control = ctrl[nmsgs].buf;
+        hdr->msg_controllen = sizeof(ctrl[nmsgs].buf);
+        struct cmsghdr *cm = CMSG_FIRSTHDR(hdr);
+        cm->cmsg_level = IPPROTO_UDP;
+        cm->cmsg_type = UDP_SEGMENT;
+        cm->cmsg_len = CMSG_LEN(sizeof(u_int16_t));
+        memcpy(CMSG_DATA(cm), &size, sizeof(u_int16_t));
+      }
+    }
+
+    int n = sendmmsg((int)socket->rsock, msgs, nmsgs, 0);
+    if(n < 0) {
+      if(errno == EINTR) {
+        continue;
+      }
+      if(segments[0] > 1 && (errno == EIO || errno == EINVAL)) {
+        /* The route does not support GSO after all */
+        RUDP_WARN("rudp_sendto: GSO failed, sending packets one by one\n");
+        socket->gso = false;
+        continue;
+      }
+      /* Skip the packets which failed, the retransmission timer takes care of them */
+      if(errno == EMSGSIZE) {
+        /* A probe larger than the path MTU, which the kernel already knows of */
+        RUDP_DEBUG("rudp_sendto: Packet larger than the path MTU\n");
+      }
+      else {
+        fprintf(stderr, "rudp_sendto: sendmmsg failed\n");
+        ret = -1;
+      }
+      n = 1;
+    }
+    for(i = 0; i < n; i++) {
+      sent += segments[i];
+    }
+  }
+#else
+  for(sent = 0; sent < tx->count; sent++) {
+    if(sendto((int)socket->rsock, batch_packet(tx, sent), RUDP_PKTLEN(batch_packet(tx, sent)), 0,
+              (struct sockaddr *)&tx->addr[sent], sizeof(struct sockaddr_in)) < 0) {
+      if(errno == EMSGSIZE) {
+        RUDP_DEBUG("rudp_sendto: Packet larger than the path MTU\n");
+      }
+      else {
+        fprintf(stderr, "rudp_sendto: sendto failed\n");
+        ret = -1;
+      }
+    }
+  }
+#endif /* RUDP_MMSG */
+  tx->count = 0;
+  return ret;
+}
+
+/* Callback function executed at the end of each event loop iteration */
+int flush_callback(int fd, void *arg) {
+  /* Before the batch is sent, since the handlers may add to it */
+  struct rudp_socket_list *socket = (struct rudp_socket_list *)arg;
+  if(socket->reaped != NULL) {
+    report_reaped(socket);
+    if(socket->close_requested && close_socket_if_done(socket, NULL)) {
+      /* The socket is gone */
+      return 0;
+    }
+  }
+  report_writable(socket);
+  report_sent_messages(socket);
+  if(socket->postq != NULL && socket->postq->blocked) {
+    post_drain(socket->postq);
+  }
+  batch_flush((struct rudp_socket_list *)arg);
+  return 0;
+}
+
+/* Callback function executed when something is received on fd. Receives
+ * up to a batch of datagrams with one system call, and processes the
+ * packets in them in turn */
+int receive_callback(int file, void *arg) {
+  struct rudp_socket_list *curr_socket = find_socket((rudp_socket_t)file);
+  if(curr_socket == NULL) {
+    fprintf(stderr, "Error: attempt to receive on invalid socket. Socket not found\n");
+    return -1;
+  }
+  struct rudp_rxbatch *rx = curr_socket->rx;
+  struct rudp_packet aligned __attribute__ ((aligned (8)));
+  int n = batch_receive(curr_socket);
+  int i;
+  for(i = 0; i < n; i++) {
+    /* A datagram coalesced by GRO holds packets of rx->segment[i] bytes */
+    int offset = 0;
+    do {
+      struct rudp_packet *p = (struct rudp_packet *)(rx->buf[i] + offset);
+      int bytes = rx->len[i] - offset < rx->segment[i] ? rx->len[i] - offset : rx->segment[i];
+      if((unsigned long)p->payload % 4 != 0) {
+        /* The application may read the payload as a struct. Oversized packets are dropped anyway */
+        memcpy(&aligned, p, bytes < sizeof(struct rudp_packet) ? bytes : sizeof(struct rudp_packet));
+        p = &aligned;
+      }
+      /* A GRO datagram has no buffers, a packet gets one only when it must be kept */
+      bool_t gro = rx->gro;
+      struct rudp_buf *copy = NULL;
+      struct rudp_buf **bufp = gro ? &copy : &rx->rbuf[i];
+      int ret = receive_packet(curr_socket, p, bytes, &rx->addr[i], bufp);
+      if(copy != NULL && ret != 0) {
+        rudp_buf_release(copy);
+      }
+      if(ret < 0) {
+        return -1;
+      }
+      if(ret > 0) {
+        return 0; /* The socket was closed, along with its batch */
+      }
+      if(*bufp != NULL && (gro || __atomic_load_n(&(*bufp)->refs, __ATOMIC_RELAXED) > 1)) {
+        /* The application holds on to the buffer, the batch needs another one */
+        rudp_buf_release(*bufp);
+        *bufp = NULL;
+      }
+      offset += rx->segment[i];
+    } while(offset < rx->len[i]);
+  }
+  return 0;
+}
+
+/* Processes a packet of the given size received on a socket. *bufp is the
+ * buffer holding the packet, if any, and is cleared if the buffer is taken
+ * over. Returns 0, -1 on a fatal error, or 1 if the packet made the socket close */
+int receive_packet(struct rudp_socket_list *curr_socket, struct rudp_packet *received_packet, int bytes, struct sockaddr_in *from, struct rudp_buf **bufp) {
+  int file = (int)curr_socket->rsock;
+  struct sockaddr_in sender = *from;
+
+  /* The packet is parsed in place. Drop it unless the length field matches what we received */
+  if(bytes < sizeof(struct rudp_hdr) || received_packet->header.version != RUDP_VERSION ||
+     received_packet->header.length > curr_socket->payload_max || RUDP_PKTLEN(received_packet) != bytes) {
+    if(bytes >= sizeof(struct rudp_hdr) && received_packet->header.type == RUDP_PROBE) {
+      /* A probe larger than our MTU, which the peer takes as lost */
+      RUDP_DEBUG("receive_callback: Dropping probe for %u bytes\n", received_packet->header.seqno);
+    }
+    else {
+      RUDP_WARN("receive_callback: Dropping malformed packet (%d bytes)\n", bytes);
+    }
+    return 0;
+  }
+  
+  curr_socket->stats.packets_received++;
+  curr_socket->stats.bytes_received += bytes;
+
+  struct rudp_hdr rudpheader = received_packet->header;
+  RUDP_TRACE_PACKET(RUDP_TRACE_RECV, file, 0, rudpheader.type, rudpheader.seqno, rudpheader.length, &sender);
+  RUDP_DEBUG("Received %s packet from %s:%d seq number=%u on socket=%d\n", packet_type_name(rudpheader.type),
+             inet_ntoa(sender.sin_addr), ntohs(sender.sin_port), rudpheader.seqno, file);
+
+  /* See if a session already exists for this peer */
+  if(curr_socket->sessions_list_head == NULL) {
+    /* The list is empty, so we check if the sender has initiated the protocol properly (by sending a SYN) */
+    if(rudpheader.type == RUDP_SYN && !syn_replayed(curr_socket, rudpheader.seqno, &sender)) {
+      /* SYN Received. Create a new session at the head of the list */
+      u_int32_t seqno = rudpheader.seqno + 1;
+      create_receiver_session(curr_socket, seqno, syn_window(curr_socket, received_packet), &sender);
+      /* Respond with an ACK */
+      struct rudp_packet p;
+      init_rudp_packet(&p, RUDP_ACK, seqno, 0, NULL);
+      send_packet(true, (rudp_socket_t)file, &p, &sender);
+    }
+    else {
+      /* No sessions exist and we got a non-SYN, so ignore it */
+    }
+  }
+  else {
+    /* Some sessions exist to be checked */
+    struct session *curr_session = find_session(curr_socket, &sender);
+    if(curr_session == NULL) {
+      /* No session was found for this peer */
+      if(rudpheader.type == RUDP_SYN && !syn_replayed(curr_socket, rudpheader.seqno, &sender)) {
+        /* SYN Received. Send an ACK and create a new session */
+        u_int32_t seqno = rudpheader.seqno + 1;
+        create_receiver_session(curr_socket, seqno, syn_window(curr_socket, received_packet), &sender);
+        struct rudp_packet p;
+        init_rudp_packet(&p, RUDP_ACK, seqno, 0, NULL);
+        send_packet(true, (rudp_socket_t)file, &p, &sender);
+      }
+      else {
+        /* Session does not exist and non-SYN received - ignore it */
+      }
+    }
+    else {
+      /* We found a matching session */ 
+      session_touch(curr_socket, curr_session);
+      curr_session->stats.packets_received++;
+      curr_session->stats.bytes_received += bytes;
+      if(rudpheader.type == RUDP_SYN) {
+        if(curr_session->receiver != NULL && curr_session->receiver->initial_seqno == rudpheader.seqno + 1) {
+          /* The SYN was retransmitted, so our ACK got lost. The data sent along with
+           * the SYN may have arrived already, so ACK what we have */
+          send_data_ack(curr_socket, curr_session);
+        }
+        else if((curr_session->receiver == NULL || curr_session->receiver->status == OPENING) &&
+                !syn_replayed(curr_socket, rudpheader.seqno, &sender)) {
+          /* Create a new receiver session and ACK the SYN*/
+          struct receiver_session *new_receiver_session = alloc_receiver_session(rudpheader.seqno + 1, syn_window(curr_socket, received_packet));
+          if(new_receiver_session == NULL) {
+            fprintf(stderr, "receive_callback: Error allocating receiver session\n");
+            return -1;
+          }
+          free_receiver_session(curr_session->receiver);
+          curr_session->receiver = new_receiver_session;
+
+          u_int32_t seqno = curr_session->receiver->expected_seqno;
+          struct rudp_packet p;
+          init_rudp_packet(&p, RUDP_ACK, seqno, 0, NULL);
+          send_packet(true, (rudp_socket_t)file, &p, &sender);
+        }
+        else {
+          /* Received a SYN when there is already an active receiver session, or one
+           * which was accepted before, so we ignore it */
+        }
+      }
+      if(rudpheader.type == RUDP_ACK && curr_session->sender != NULL) {
+        u_int32_t ack_sqn = received_packet->header.seqno;
+        int nblocks = received_packet->header.length / sizeof(struct rudp_sack);
+        if(nblocks > RUDP_MAXSACK) {
+          nblocks = RUDP_MAXSACK;
+        }
+        if(curr_session->sender->status == SYN_SENT) {
+          /* This an ACK for a SYN, or already for the data sent along with it */
+          struct sender_session *syn_sender = curr_session->sender;
+          if(SEQ_GT(ack_sqn, syn_sender->syn_seqno) && SEQ_LEQ(ack_sqn, syn_sender->seqno + 1)) {
+            /* Delete the retransmission timeout */
+            cancel_timeout(&syn_sender->syn_timer);
+            struct timeval now;
+            gettimeofday(&now, NULL);
+            syn_sender->handshake = (now.tv_sec - syn_sender->syn_first_sent.tv_sec) * 1000000 +
+                                    (now.tv_usec - syn_sender->syn_first_sent.tv_usec);
+            if(syn_sender->syn_retransmit_attempts == 0) {
+              rtt_update(syn_sender, &syn_sender->syn_sent_time);
+            }
+            syn_sender->status = OPEN;
+            if(syn_sender->window_count > 0) {
+              window_ack(syn_sender, ack_sqn, (struct rudp_sack *)received_packet->payload, nblocks);
+            }
+            probe_next(curr_socket, curr_session);
+            send_queued_data(curr_socket, curr_session);
+          }
+        }
+        else if(curr_session->sender->status == OPEN) {
+          /* This is an ACK for DATA, possibly with SACK blocks */
+          if(window_ack(curr_session->sender, rudpheader.seqno, (struct rudp_sack *)received_packet->payload, nblocks)) {
+            /* The ACK released at least one packet from the window */
+            struct sender_session *acked_sender = curr_session->sender;
+            if(acked_sender->in_recovery && acked_sender->window_count > 0 &&
+               SEQ_LT(acked_sender->window_base, acked_sender->recover)) {
+              /* A partial ACK: the new head of the window was lost as well */
+              recovery_retransmit(curr_socket, curr_session);
+            }
+            else {
+              acked_sender->in_recovery = false;
+              acked_sender->dup_acks = 0;
+            }
+            send_queued_data(curr_socket, curr_session);
+            if(curr_socket->close_requested) {
+              send_fins(curr_socket);
+            }
+          }
+          else if(rudpheader.seqno == curr_session->sender->window_base && curr_session->sender->window_count > 0) {
+            /* A duplicate ACK: the receiver got a later packet, but still misses the head of the window */
+            curr_session->sender->dup_acks++;
+            if(curr_session->sender->in_recovery) {
+              /* Its SACK blocks may show more holes */
+              recovery_retransmit(curr_socket, curr_session);
+            }
+            else if(curr_session->sender->dup_acks >= RUDP_DUPACKS) {
+              fast_retransmit(curr_socket, curr_session);
+            }
+          }
+        }
+        else if(curr_session->sender->status == FIN_SENT) {
+          /* Handle ACK for FIN */
+          if( (curr_session->sender->seqno + 1) == received_packet->header.seqno) {
+            cancel_timeout(&curr_session->sender->fin_timer);
+            curr_session->sender->session_finished = true;
+            if(curr_socket->close_requested && close_socket_if_done(curr_socket, &sender)) {
+              /* The socket is gone */
+              return 1;
+            }
+          }
+          else {
+            /* Received incorrect ACK for FIN - ignore it */
+          }
+        }
+      }
+      else if(rudpheader.type == RUDP_DATA && curr_session->receiver != NULL) {
+        /* Handle DATA packet. If the receiver is OPENING, it can transition to OPEN */
+        struct receiver_session *receiver = curr_session->receiver;
+        if(receiver->status == OPENING) {
+          if(rudpheader.seqno == receiver->expected_seqno) {
+            receiver->status = OPEN;
+          }
+        }
+
+        if(rudpheader.seqno == receiver->expected_seqno) {
+          /* Sequence numbers match. Packets buffered right after this one are now in order too */
+          u_int32_t first = receiver->expected_seqno;
+          receiver->expected_seqno++;
+          while(receiver->reorder_count > 0 &&
+                receiver->reorder_buffer[receiver->expected_seqno & (receiver->reorder_capacity - 1)].used) {
+            /* The slot is released, but its packet stays intact until delivered below */
+            receiver->reorder_buffer[receiver->expected_seqno & (receiver->reorder_capacity - 1)].used = false;
+            receiver->reorder_count--;
+            receiver->expected_seqno++;
+          }
+          /* ACK the data. A packet which filled a gap is ACKed right away */
+          if(receiver->expected_seqno - first > 1) {
+            send_data_ack(curr_socket, curr_session);
+          }
+          else {
+            delay_data_ack(curr_socket, curr_session);
+          }
+              
+          /* Pass the data up to the application, in order, straight from the receive buffers */
+          deliver_data(curr_socket, receiver, &sender, received_packet, bufp);
+          u_int32_t seqno;
+          for(seqno = first + 1; seqno != receiver->expected_seqno; seqno++) {
+            struct reorder_slot *slot = &receiver->reorder_buffer[seqno & (receiver->reorder_capacity - 1)];
+            deliver_data(curr_socket, receiver, &sender, &slot->buf->packet, &slot->buf);
+            rudp_buf_release(slot->buf);
+            slot->buf = NULL;
+          }
+        }
+        else if(SEQ_GT(rudpheader.seqno, receiver->expected_seqno)) {
+          /* Out of order. Keep it if it fits in our window, and tell the sender what we have */
+          curr_socket->stats.out_of_order++;
+          curr_session->stats.out_of_order++;
+          reorder_store(curr_socket, receiver, received_packet, bufp);
+          send_data_ack(curr_socket, curr_session);
+        }
+        /* Handle the case where an ACK was lost */
+        else if(SEQ_GEQ(rudpheader.seqno, (receiver->expected_seqno - receiver->window))) {
+          curr_socket->stats.duplicates++;
+          curr_session->stats.duplicates++;
+          send_data_ack(curr_socket, curr_session);
+        }
+      }
+      else if(rudpheader.type == RUDP_FIN && curr_session->receiver != NULL) {
+        if(curr_session->receiver->status == OPEN) {
+          if(rudpheader.seqno == curr_session->receiver->expected_seqno) {
+            /* If the FIN is correct, we can ACK it, along with any DATA whose ACK is delayed */
+            u_int32_t seqno = curr_session->receiver->expected_seqno + 1;
+            cancel_timeout(&curr_session->receiver->ack_timer);
+            struct rudp_packet p;
+            init_rudp_packet(&p, RUDP_ACK, seqno, 0, NULL);
+            send_packet(true, (rudp_socket_t)file, &p, &sender);
+            curr_session->receiver->session_finished = true;
+
+            if(curr_socket->close_requested && close_socket_if_done(curr_socket, &sender)) {
+              /* The socket is gone */
+              return 1;
+            }
+          }
+          else {
+            /* FIN received with incorrect sequence number - ignore it */
+          }
+        }
+      }
+      else if(rudpheader.type == RUDP_PROBE) {
+        probe_received(curr_socket, curr_session, received_packet);
+      }
+    }
+  }
+
+  return 0;
+}
+
+/* With RUDP_OPT_NOREPLAY, returns true if a SYN from the peer with this sequence
+ * number has been accepted before. The initial sequence number of a session is
+ * random, so that is a duplicate of an old SYN, and the data which came along
+ * with it must not be delivered again. Otherwise the SYN is recorded */
+bool_t syn_replayed(struct rudp_socket_list *socket, u_int32_t seqno, struct sockaddr_in *from) {
+  struct syn_history *history = socket->syn_history;
+  if(history == NULL) {
+    return false;
+  }
+  int i;
+  for(i = 0; i < history->count; i++) {
+    if(history->syn[i].seqno == seqno && compare_sockaddr(&history->syn[i].addr, from) == 1) {
+      RUDP_WARN("receive_callback: Ignoring replayed SYN from %s:%d\n", inet_ntoa(from->sin_addr), ntohs(from->sin_port));
+      return true;
+    }
+  }
+  history->syn[history->next].addr = *from;
+  history->syn[history->next].seqno = seqno;
+  history->next = (history->next + 1) % RUDP_SYNHISTORY;
+  if(history->count < RUDP_SYNHISTORY) {
+    history->count++;
+  }
+  return false;
+}
+
+/* Close a RUDP socket */
+int rudp_close(rudp_socket_t rsocket) {
+  struct rudp_socket_list *curr_socket = socket_list_head;
+  while(curr_socket->next != NULL) {
+    if(curr_socket->rsock == rsocket) {
+      break;
+    }
+    curr_socket = curr_socket->next;
+  }
+  if(curr_socket->rsock == rsocket) {
+    curr_socket->close_requested = true;        
+    /* Sessions which have sent everything will not see another ACK */
+    send_fins(curr_socket);
+    return 0;
+  }
+  
+  return -1;
+}
+
+/* Set a socket option. Returns 0 on success, -1 on error */
+int rudp_setsockopt(rudp_socket_t rsocket, rudp_sockopt_t option, const void *value, int len) {
+  struct rudp_socket_list *curr_socket = find_socket(rsocket);
+  if(curr_socket == NULL) {
+    fprintf(stderr, "rudp_setsockopt Error: attempting to set option on invalid socket\n");
+    return -1;
+  }
+  if(value == NULL || len != sizeof(int)) {
+    fprintf(stderr, "rudp_setsockopt Error: invalid option value\n");
+    return -1;
+  }
+  int v = *(const int *)value;
+  struct session *curr_session;
+
+  switch(option) {
+  case RUDP_OPT_WINDOW:
+    if(v < 1 || v > RUDP_MAXWINDOW) {
+      fprintf(stderr, "rudp_setsockopt Error: window must be between 1 and %d\n", RUDP_MAXWINDOW);
+      return -1;
+    }
+    curr_socket->window = v;
+    /* Each session has up to a window of packets queued and timers pending, so the pools grow by that much */
+    curr_socket->data_pool.per_slab = v > RUDP_POOLSLAB ? v : RUDP_POOLSLAB;
+    curr_socket->timer_pool.per_slab = curr_socket->data_pool.per_slab;
+    /* Sessions which are waiting for room in the window may be able to send now */
+    for(curr_session = curr_socket->sessions_list_head; curr_session != NULL; curr_session = curr_session->next) {
+      if(curr_session->sender != NULL && curr_session->sender->status == OPEN) {
+        send_queued_data(curr_socket, curr_session);
+      }
+    }
+    return 0;
+  case RUDP_OPT_CONGESTION:
+    if(v == RUDP_CC_NONE) {
+      curr_socket->cc_ops = &rudp_cc_none;
+    }
+    else if(v == RUDP_CC_NEWRENO) {
+      curr_socket->cc_ops = &rudp_cc_newreno;
+    }
+    else if(v == RUDP_CC_PACING) {
+      curr_socket->cc_ops = &rudp_cc_pacing;
+    }
+    else {
+      fprintf(stderr, "rudp_setsockopt Error: unknown congestion control algorithm %d\n", v);
+      return -1;
+    }
+    /* Existing sender sessions start over with the new algorithm */
+    for(curr_session = curr_socket->sessions_list_head; curr_session != NULL; curr_session = curr_session->next) {
+      struct sender_session *sender = curr_session->sender;
+      if(sender == NULL) {
+        continue;
+      }
+      cancel_timeout(&sender->pace_timer);
+      sender->cc.ops = curr_socket->cc_ops;
+      sender->cc.ops->init(&sender->cc);
+      if(sender->status == OPEN) {
+        send_queued_data(curr_socket, curr_session);
+      }
+    }
+    return 0;
+  case RUDP_OPT_BATCH:
+    if(v < 1 || v > RUDP_MAXBATCH) {
+      fprintf(stderr, "rudp_setsockopt Error: batch size must be between 1 and %d\n", RUDP_MAXBATCH);
+      return -1;
+    }
+    /* Anything batched beyond the new size goes out now */
+    if(curr_socket->tx->count >= v) {
+      batch_flush(curr_socket);
+    }
+    curr_socket->batch = v;
+    return 0;
+  case RUDP_OPT_DELACK:
+    if(v < 1 || v > RUDP_MAXWINDOW) {
+      fprintf(stderr, "rudp_setsockopt Error: packets per ACK must be between 1 and %d\n", RUDP_MAXWINDOW);
+      return -1;
+    }
+    curr_socket->delack = v;
+    return 0;
+  case RUDP_OPT_MAXMSG:
+    if(v < RUDP_MAXPKTSIZE) {
+      fprintf(stderr, "rudp_setsockopt Error: max. message size must be at least %d\n", RUDP_MAXPKTSIZE);
+      return -1;
+    }
+    curr_socket->maxmsg = v;
+    return 0;
+  case RUDP_OPT_SNDBUF:
+    if(v < 1) {
+      fprintf(stderr, "rudp_setsockopt Error: send buffer size must be positive\n");
+      return -1;
+    }
+    curr_socket->sndbuf = v;
+    return 0;
+  case RUDP_OPT_EARLYDATA:
+    if(v < 0 || v > RUDP_MAXWINDOW) {
+      fprintf(stderr, "rudp_setsockopt Error: early data must be between 0 and %d packets\n", RUDP_MAXWINDOW);
+      return -1;
+    }
+    curr_socket->earlydata = v;
+    return 0;
+  case RUDP_OPT_NOREPLAY:
+    if(v == 0) {
+      free(curr_socket->syn_history);
+      curr_socket->syn_history = NULL;
+    }
+    else if(curr_socket->syn_history == NULL) {
+      curr_socket->syn_history = malloc(sizeof(struct syn_history));
+      if(curr_socket->syn_history == NULL) {
+        fprintf(stderr, "rudp_setsockopt Error: allocating SYN history\n");
+        return -1;
+      }
+      curr_socket->syn_history->next = 0;
+      curr_socket->syn_history->count = 0;
+    }
+    return 0;
+  case RUDP_OPT_IDLE:
+    if(v < 0) {
+      fprintf(stderr, "rudp_setsockopt Error: idle timeout must not be negative\n");
+      return -1;
+    }
+    curr_socket->idle_timeout = v;
+    idle_schedule(curr_socket);
+    return 0;
+  case RUDP_OPT_MAXSESSIONS:
+    if(v < 0) {
+      fprintf(stderr, "rudp_setsockopt Error: max. number of sessions must not be negative\n");
+      return -1;
+    }
+    curr_socket->max_sessions = v;
+    while(v > 0 && curr_socket->session_count > v) {
+      session_reap(curr_socket, curr_socket->sessions_list_head);
+    }
+    return 0;
+  case RUDP_OPT_LOSS:
+  case RUDP_OPT_DELAY:
+  case RUDP_OPT_REORDER:
+    return emulate_setsockopt(curr_socket, option, v);
+  case RUDP_OPT_MTU:
+    if(v < RUDP_MAXPKTSIZE + RUDP_IPUDPHDR + (int)sizeof(struct rudp_hdr) || v > RUDP_MAXMTU) {
+      fprintf(stderr, "rudp_setsockopt Error: MTU must be between %d and %d\n",
+              RUDP_MAXPKTSIZE + RUDP_IPUDPHDR + (int)sizeof(struct rudp_hdr), RUDP_MAXMTU);
+      return -1;
+    }
+    if(curr_socket->sessions_list_head != NULL) {
+      /* The window slots of the sessions are sized for the old MTU */
+      fprintf(stderr, "rudp_setsockopt Error: MTU can only be set before any sessions exist\n");
+      return -1;
+    }
+    batch_flush(curr_socket);
+    return packet_buffers(curr_socket, v);
+  case RUDP_OPT_PMTUD:
+    curr_socket->pmtud = v != 0;
+    return 0;
+  case RUDP_OPT_OFFLOAD:
+    if(offload_enable(curr_socket, v != 0) < 0) {
+      fprintf(stderr, "rudp_setsockopt Error: UDP segmentation offload is not available\n");
+      return -1;
+    }
+    return 0;
+  default:
+    fprintf(stderr, "rudp_setsockopt Error: unknown option %d\n", option);
+    return -1;
+  }
+}
+
+/* Get the round-trip time estimate of the sender session with a peer */
+int rudp_get_rtt(rudp_socket_t rsocket, struct sockaddr_in *peer, struct rudp_rtt *rtt) {
+  struct rudp_socket_list *curr_socket = find_socket(rsocket);
+  if(curr_socket == NULL) {
+    fprintf(stderr, "rudp_get_rtt Error: invalid socket\n");
+    return -1;
+  }
+  if(peer == NULL || rtt == NULL) {
+    fprintf(stderr, "rudp_get_rtt Error: invalid argument\n");
+    return -1;
+  }
+  struct session *curr_session = find_session(curr_socket, peer);
+  if(curr_session == NULL || curr_session->sender == NULL) {
+    fprintf(stderr, "rudp_get_rtt Error: no data has been sent to this peer\n");
+    return -1;
+  }
+  rtt->srtt = curr_session->sender->srtt;
+  rtt->rttvar = curr_session->sender->rttvar;
+  rtt->rto = curr_session->sender->rto;
+  return 0;
+}
+
+/* Get the counters of the session with a peer, or of the whole socket */
+int rudp_get_stats(rudp_socket_t rsocket, struct sockaddr_in *peer, struct rudp_stats *stats) {
+  struct rudp_socket_list *curr_socket = find_socket(rsocket);
+  if(curr_socket == NULL) {
+    fprintf(stderr, "rudp_get_stats Error: invalid socket\n");
+    return -1;
+  }
+  if(stats == NULL) {
+    fprintf(stderr, "rudp_get_stats Error: invalid argument\n");
+    return -1;
+  }
+  struct session *curr_session;
+  if(peer == NULL) {
+    *stats = curr_socket->stats;
+    stats->window = 0;
+    stats->queued = 0;
+    for(curr_session = curr_socket->sessions_list_head; curr_session != NULL; curr_session = curr_session->next) {
+      if(curr_session->sender != NULL) {
+        stats->window += curr_session->sender->window_count;
+        stats->queued += curr_session->sender->queued;
+      }
+    }
+    stats->cwnd = 0;
+    stats->srtt = 0;
+    stats->rttvar = 0;
+    stats->rto = 0;
+    stats->handshake = 0;
+    stats->pktsize = 0;
+    return 0;
+  }
+  curr_session = find_session(curr_socket, peer);
+  if(curr_session == NULL) {
+    fprintf(stderr, "rudp_get_stats Error: no session with this peer\n");
+    return -1;
+  }
+  *stats = curr_session->stats;
+  struct sender_session *sender = curr_session->sender;
+  stats->window = sender != NULL ? sender->window_count : 0;
+  stats->queued = sender != NULL ? sender->queued : 0;
+  stats->cwnd = sender != NULL ? sender->cc.cwnd : 0;
+  stats->srtt = sender != NULL ? sender->srtt : 0;
+  stats->rttvar = sender != NULL ? sender->rttvar : 0;
+  stats->rto = sender != NULL ? sender->rto : 0;
+  stats->handshake = sender != NULL ? sender->handshake : 0;
+  stats->pktsize = sender != NULL ? sender->payload : 0;
+  return 0;
+}
+
+/* Register receive callback function */ 
+int rudp_recvfrom_handler(rudp_socket_t rsocket, int (*handler)(rudp_socket_t, 
+            struct sockaddr_in *, char *, int)) {
+
+  if(handler == NULL) {
+    fprintf(stderr, "rudp_recvfrom_handler failed: handler callback is null\n");
+    return -1;
+  }
+  /* Find the proper socket from the socket list */
+    struct rudp_socket_list *curr_socket = socket_list_head;
+    while(curr_socket->next != NULL) {
+      if(curr_socket->rsock == rsocket) {
+        break;
+      }
+      curr_socket = curr_socket->next;
+    }
+    /* Extra check to handle the case where an invalid rsock is used */
+    if(curr_socket->rsock == rsocket) {
+      curr_socket->recv_handler = handler;
+      return 0;
+    }
+  return -1;
+}
+
+/* Register a receive callback function which is passed the buffer of the data */
+int rudp_recvbuf_handler(rudp_socket_t rsocket, int (*handler)(rudp_socket_t, 
+            struct sockaddr_in *, rudp_buf_t, char *, int)) {
+  if(handler == NULL) {
+    fprintf(stderr, "rudp_recvbuf_handler failed: handler callback is null\n");
+    return -1;
+  }
+  struct rudp_socket_list *curr_socket = find_socket(rsocket);
+  if(curr_socket == NULL) {
+    fprintf(stderr, "rudp_recvbuf_handler failed: invalid socket\n");
+    return -1;
+  }
+  curr_socket->recvbuf_handler = handler;
+  return 0;
+}
+
+/* Stops reading packets from the socket if pause is nonzero, or reads them
+ * again. Timers keep running meanwhile. Returns 0 on success, -1 on error */
+int rudp_recv_pause(rudp_socket_t rsocket, int pause) {
+  struct rudp_socket_list *curr_socket = find_socket(rsocket);
+  if(curr_socket == NULL) {
+    fprintf(stderr, "rudp_recv_pause failed: invalid socket\n");
+    return -1;
+  }
+  if(pause && !curr_socket->recv_paused) {
+    event_fd_delete(receive_callback, rsocket);
+  }
+  else if(!pause && curr_socket->recv_paused) {
+    if(event_fd(rsock_fd(rsocket), receive_callback, rsocket, "receive_callback") < 0) {
+      fprintf(stderr, "rudp_recv_pause: Error registering receive callback function\n");
+      return -1;
+    }
+  }
+  curr_socket->recv_paused = pause != 0;
+  return 0;
+}
+
+/* Register event handler callback function with a RUDP socket */
+int rudp_event_handler(rudp_socket_t rsocket, 
+         int (*handler)(rudp_socket_t, rudp_event_t, 
+            struct sockaddr_in *)) {
+
+  if(handler == NULL) {
+    fprintf(stderr, "rudp_event_handler failed: handler callback is null\n");
+    return -1;
+  }
+
+  /* Find the proper socket from the socket list */
+  struct rudp_socket_list *curr_socket = socket_list_head;
+  while(curr_socket->next != NULL) {
+    if(curr_socket->rsock == rsocket) {
+      break;
+    }
+    curr_socket = curr_socket->next;
+  }
+
+  /* Extra check to handle the case where an invalid rsock is used */
+  if(curr_socket->rsock == rsocket) {
+    curr_socket->handler = handler;
+    return 0;
+  }
+  return -1;
+}
+
+
+/* Sends a block of data to the receiver. Data longer than a packet is sent as
+ * a message of several. Returns 0 on success, 1 if the data is queued but the
+ * queue is full, -1 on error */
+int rudp_sendto(rudp_socket_t rsocket, void* data, int len, struct sockaddr_in* to) {
+
+  if(rsocket < 0) {
+    fprintf(stderr, "rudp_sendto Error: attempting to send on invalid socket\n");
+    return -1;
+  }
+
+  if(to == NULL) {
     fprintf(stderr, "rudp_sendto Error: attempting to send to an invalid address\n");
     return -1;
   }
 
-  bool_t new_session_created = true;
-  u_int32_t seqno = 0;
-  if(socket_list_head == NULL) {
-    fprintf(stderr, "Error: attempt to send on invalid socket. No sockets in the list\n");
+  struct rudp_socket_list *curr_socket = find_socket(rsocket);
+  if(curr_socket == NULL) {
+    fprintf(stderr, "Error: attempt to send on invalid socket. Socket not found\n");
+    return -1;
+  }
+
+  if(len < 0 || len > curr_socket->maxmsg) {
+    fprintf(stderr, "rudp_sendto Error: attempting to send with invalid max message size\n");
+    return -1;
+  }
+
+  /* See if a session already exists for this peer */
+  struct session *curr_session = find_session(curr_socket, to);
+  if(len <= RUDP_MAXPKTSIZE && curr_session != NULL && curr_session->sender != NULL) {
+    struct sender_session *sender = curr_session->sender;
+    if(sender->status == OPEN && sender->data_queue == NULL &&
+       send_new_data(curr_socket, curr_session, data, len, NULL) != NULL) {
+      /* Sent right away, without queueing */
+      return 0;
+    }
+  }
+
+  /* The data has to wait in the queue */
+  struct data *data_item = pool_get(&curr_socket->data_pool);
+  if(data_item == NULL) {
+    fprintf(stderr, "rudp_sendto: Error allocating data queue\n");
+    return -1;
+  }  
+  data_item->len = len;
+  data_item->message = false;
+  data_item->copy = NULL;
+  data_item->shared = NULL;
+  data_item->iovcnt = 0;
+  data_item->next = NULL;
+  if(len <= RUDP_MAXPKTSIZE) {
+    memcpy(data_item->item, data, len);
+  }
+  else {
+    data_item->message = true;
+    data_item->copy = malloc(len);
+    if(data_item->copy == NULL) {
+      fprintf(stderr, "rudp_sendto: Error allocating memory\n");
+      pool_put(&curr_socket->data_pool, data_item);
+      return -1;
+    }
+    memcpy(data_item->copy, data, len);
+    data_item->iov_offset = 0;
+  }
+  return queue_data(curr_socket, data_item, to);
+}
+
+/* Sends the same data to n peers. The queues of the peers share one copy of it,
+ * which is freed once every peer's session has moved it into its sliding window.
+ * Returns the number of peers whose queue is full, or -1 */
+int rudp_sendto_many(rudp_socket_t rsocket, void *data, int len, struct sockaddr_in *to, int n) {
+
+  if(to == NULL || n < 1) {
+    fprintf(stderr, "rudp_sendto_many Error: attempting to send to an invalid address\n");
+    return -1;
+  }
+
+  struct rudp_socket_list *curr_socket = find_socket(rsocket);
+  if(curr_socket == NULL) {
+    fprintf(stderr, "Error: attempt to send on invalid socket. Socket not found\n");
     return -1;
   }
-  else {
-    /* Find the correct socket in our list */
-    struct rudp_socket_list *curr_socket = socket_list_head;
-    while(curr_socket != NULL) {
-      if(curr_socket->rsock == rsocket) {
+
+  if(len < 0 || len > curr_socket->maxmsg) {
+    fprintf(stderr, "rudp_sendto_many Error: attempting to send with invalid max message size\n");
+    return -1;
+  }
+
+  struct payload *shared = malloc(sizeof(struct payload) + len);
+  if(shared == NULL) {
+    fprintf(stderr, "rudp_sendto_many: Error allocating memory\n");
+    return -1;
+  }
+  memcpy(shared->data, data, len);
+  /* Held until all peers are queued, so that a peer which sends it right away
+   * does not free it */
+  shared->refs = 1;
+
+  int i, ret, full = 0;
+  for(i = 0; i < n; i++) {
+    struct data *data_item = pool_get(&curr_socket->data_pool);
+    if(data_item == NULL) {
+      fprintf(stderr, "rudp_sendto_many: Error allocating data queue\n");
+      full = -1;
+      break;
+    }
+    shared->refs++;
+    data_item->len = len;
+    data_item->message = true;
+    data_item->copy = shared->data;
+    data_item->shared = shared;
+    data_item->iovcnt = 0;
+    data_item->iov_offset = 0;
+    data_item->next = NULL;
+    if((ret = queue_data(curr_socket, data_item, &to[i])) < 0) {
+      full = -1;
+      break;
+    }
+    full += ret;
+  }
+  if(--shared->refs == 0) {
+    free(shared);
+  }
+  return full;
+}
+
+/* Sends a message gathered from iovcnt buffers, as many packets as it takes. If a
+ * sendv handler is registered, the packets are made from the buffers as they are
+ * sent, and the handler is called once they may be reused. Otherwise the data is
+ * copied right away. Returns as rudp_sendto() */
+int rudp_sendv(rudp_socket_t rsocket, const struct iovec *iov, int iovcnt, struct sockaddr_in *to) {
+
+  if(iov == NULL || iovcnt < 1 || iovcnt > RUDP_MAXIOV) {
+    fprintf(stderr, "rudp_sendv Error: attempting to send with invalid number of buffers\n");
+    return -1;
+  }
+
+  if(to == NULL) {
+    fprintf(stderr, "rudp_sendv Error: attempting to send to an invalid address\n");
+    return -1;
+  }
+
+  struct rudp_socket_list *curr_socket = find_socket(rsocket);
+  if(curr_socket == NULL) {
+    fprintf(stderr, "Error: attempt to send on invalid socket. Socket not found\n");
+    return -1;
+  }
+
+  int i, len = 0;
+  for(i = 0; i < iovcnt; i++) {
+    len += iov[i].iov_len;
+  }
+  if(len > curr_socket->maxmsg) {
+    fprintf(stderr, "rudp_sendv Error: attempting to send with invalid max message size\n");
+    return -1;
+  }
+
+  /* The message is kept track of also when it is copied, so that the handler hears of it */
+  struct data *message = pool_get(&curr_socket->data_pool);
+  if(message == NULL) {
+    fprintf(stderr, "rudp_sendv: Error allocating data queue\n");
+    return -1;
+  }
+  memcpy(message->msg.iov, iov, iovcnt * sizeof(struct iovec));
+  memcpy(&message->msg.peer, to, sizeof(struct sockaddr_in));
+  message->message = true;
+  message->copy = NULL;
+  message->shared = NULL;
+  message->iovcnt = iovcnt;
+  message->iov_index = 0;
+  message->iov_offset = 0;
+  message->len = len;
+  message->next = NULL;
+
+  if(len <= RUDP_MAXPKTSIZE) {
+    /* A message of one packet is as cheap to copy as to refer to */
+    char payload[RUDP_MAXPKTSIZE];
+    iov_gather(iov, iovcnt, &message->iov_index, &message->iov_offset, payload, len);
+    int ret = rudp_sendto(rsocket, payload, len, to);
+    if(ret < 0) {
+      pool_put(&curr_socket->data_pool, message);
+      return -1;
+    }
+    message_sent(curr_socket, message);
+    return ret;
+  }
+  if(curr_socket->sendv_handler == NULL) {
+    /* There is no telling the application when the buffers are free again */
+    message->copy = malloc(len);
+    if(message->copy == NULL) {
+      fprintf(stderr, "rudp_sendv: Error allocating memory\n");
+      pool_put(&curr_socket->data_pool, message);
+      return -1;
+    }
+    iov_gather(iov, iovcnt, &message->iov_index, &message->iov_offset, message->copy, len);
+    message->iov_offset = 0;
+  }
+  return queue_data(curr_socket, message, to);
+}
+
+/* Returns the submission queue of a socket, which is created on first use. It
+ * must be called from the thread of the socket. Returns NULL on error */
+rudp_postq_t rudp_postq(rudp_socket_t rsocket) {
+  struct rudp_socket_list *curr_socket = find_socket(rsocket);
+  if(curr_socket == NULL) {
+    fprintf(stderr, "rudp_postq Error: invalid socket\n");
+    return NULL;
+  }
+  if(curr_socket->postq != NULL) {
+    return curr_socket->postq;
+  }
+
+  struct rudp_postq *q = malloc(sizeof(struct rudp_postq));
+  if(q == NULL) {
+    fprintf(stderr, "rudp_postq: Error allocating memory\n");
+    return NULL;
+  }
+#ifdef RUDP_EVENTFD
+  q->wakeup[0] = q->wakeup[1] = eventfd(0, EFD_NONBLOCK);
+  if(q->wakeup[0] < 0) {
+    perror("eventfd");
+    free(q);
+    return NULL;
+  }
+#else
+  if(pipe(q->wakeup) < 0) {
+    perror("pipe");
+    free(q);
+    return NULL;
+  }
+  fcntl(q->wakeup[0], F_SETFL, O_NONBLOCK);
+  fcntl(q->wakeup[1], F_SETFL, O_NONBLOCK);
+#endif
+  q->rsock = rsocket;
+  q->head = 0;
+  q->tail = 0;
+  q->pending = 0;
+  q->blocked = false;
+  unsigned int i;
+  for(i = 0; i < RUDP_POSTRING; i++) {
+    q->ring[i].seq = i;
+  }
+  if(event_fd(q->wakeup[0], post_callback, q, "post_callback") < 0) {
+    fprintf(stderr, "rudp_postq: Error registering post callback function\n");
+    postq_free(q);
+    return NULL;
+  }
+  curr_socket->postq = q;
+  return q;
+}
+
+/* Hands data to the event loop of the queue's socket, which sends it with
+ * rudp_sendto(). May be called from any thread. Returns 0 on success, -1 on
+ * error, with errno set to EAGAIN if the queue is full */
+int rudp_post(rudp_postq_t q, void *data, int len, struct sockaddr_in *to) {
+  if(q == NULL || to == NULL || len < 0) {
+    fprintf(stderr, "rudp_post Error: invalid argument\n");
+    errno = EINVAL;
+    return -1;
+  }
+
+  /* Claim a slot */
+  struct rudp_post *slot;
+  unsigned int pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+  for(;;) {
+    slot = &q->ring[pos & (RUDP_POSTRING - 1)];
+    int turn = (int)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos);
+    if(turn == 0) {
+      if(__atomic_compare_exchange_n(&q->tail, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
         break;
       }
-      curr_socket = curr_socket->next;
     }
-    if(curr_socket->rsock == rsocket) {
-      /* We found the correct socket, now see if a session already exists for this peer */
-      struct data *data_item = malloc(sizeof(struct data));
-      if(data_item == NULL) {
-        fprintf(stderr, "rudp_sendto: Error allocating data queue\n");
-        return -1;
-      }  
-      data_item->item = malloc(len);
-      if(data_item->item == NULL) {
-        fprintf(stderr, "rudp_sendto: Error allocating data queue item\n");
-        return -1;
-      }
-      memcpy(data_item->item, data, len);
-      data_item->len = len;
-      data_item->next = NULL;
+    else if(turn < 0) {
+      /* The event loop has not taken the data of the last round yet */
+      errno = EAGAIN;
+      return -1;
+    }
+    else {
+      pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+    }
+  }
+
+  slot->copy = NULL;
+  if(len > RUDP_MAXPKTSIZE) {
+    slot->copy = malloc(len);
+    if(slot->copy == NULL) {
+      /* The slot is claimed, so pass it on empty */
+      fprintf(stderr, "rudp_post: Error allocating memory\n");
+      len = -1;
+    }
+    else {
+      memcpy(slot->copy, data, len);
+    }
+  }
+  else {
+    memcpy(slot->item, data, len);
+  }
+  slot->len = len;
+  slot->to = *to;
+  __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+
+  /* Wake up the event loop, unless another producer already has */
+  if(__atomic_exchange_n(&q->pending, 1, __ATOMIC_SEQ_CST) == 0) {
+#ifdef RUDP_EVENTFD
+    u_int64_t one = 1;
+    if(write(q->wakeup[1], &one, sizeof(one)) < 0 && errno != EAGAIN) {
+#else
+    if(write(q->wakeup[1], "", 1) < 0 && errno != EAGAIN) {
+#endif
+      perror("rudp_post: write");
+    }
+  }
+  return len < 0 ? -1 : 0;
+}
+
+/* Callback function executed when producers have woken up the event loop.
+ * Sends the data in the submission queue */
+int post_callback(int fd, void *arg) {
+  struct rudp_postq *q = (struct rudp_postq *)arg;
+  char buf[64];
+  while(read(fd, buf, sizeof(buf)) > 0) {
+  }
+  /* Data posted from here on wakes the event loop up again */
+  __atomic_store_n(&q->pending, 0, __ATOMIC_SEQ_CST);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  post_drain(q);
+  return 0;
+}
 
-      if(curr_socket->sessions_list_head == NULL) {
-        /* The list is empty, so we create a new sender session at the head of the list */
-        seqno = rand();
-        create_sender_session(curr_socket, seqno, to, &data_item);
+/* Sends the data in a submission queue with rudp_sendto(), in order, until
+ * the queue for a peer is full. The rest is left in the ring, so that the
+ * producers see it fill up, and the end of each event loop iteration tries
+ * again until that peer can take more, or its session is gone */
+void post_drain(struct rudp_postq *q) {
+  if(q->blocked) {
+    struct session *session = find_session(find_socket(q->rsock), &q->blocked_to);
+    if(session != NULL && session->sender != NULL && session->sender->blocked) {
+      return;
+    }
+    q->blocked = false;
+  }
+  while(!q->blocked) {
+    struct rudp_post *slot = &q->ring[q->head & (RUDP_POSTRING - 1)];
+    if(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != q->head + 1) {
+      break;
+    }
+    if(slot->len >= 0) {
+      int ret = rudp_sendto(q->rsock, slot->copy != NULL ? slot->copy : slot->item, slot->len, &slot->to);
+      if(ret < 0) {
+        RUDP_WARN("post_drain: Dropping %d bytes posted for %s:%d\n", slot->len,
+                  inet_ntoa(slot->to.sin_addr), ntohs(slot->to.sin_port));
       }
-      else {
-        bool_t session_found = false;
-        struct session *curr_session = curr_socket->sessions_list_head;
-        struct session *last_in_list;
-        while(curr_session != NULL) {
-          if(compare_sockaddr(&curr_session->address, to) == 1) {
-            bool_t data_is_queued = false;
-            bool_t we_must_queue = true;
-
-            if(curr_session->sender==NULL) {
-              seqno = rand();
-              create_sender_session(curr_socket, seqno, to, &data_item);
-              struct rudp_packet *p = create_rudp_packet(RUDP_SYN, seqno, 0, NULL);            
-              send_packet(false, rsocket, p, to);
-              free(p);
-              new_session_created = false ; /* Dont send the SYN twice */
-              break;
-            }
+      else if(ret > 0) {
+        q->blocked = true;
+        q->blocked_to = slot->to;
+      }
+    }
+    free(slot->copy);
+    __atomic_store_n(&slot->seq, q->head + RUDP_POSTRING, __ATOMIC_RELEASE);
+    q->head++;
+  }
+  struct rudp_socket_list *socket = find_socket(q->rsock);
+  if(socket->close_requested) {
+    send_fins(socket);
+  }
+}
 
-            if(curr_session->sender->data_queue != NULL)
-              data_is_queued = true;
-
-            if(curr_session->sender->status == OPEN && !data_is_queued) {
-              int i;
-              for(i = 0; i < RUDP_WINDOW; i++) {
-                if(curr_session->sender->sliding_window[i] == NULL) {
-                  curr_session->sender->seqno = curr_session->sender->seqno + 1;
-                  struct rudp_packet *datap = create_rudp_packet(RUDP_DATA, curr_session->sender->seqno, len, data);
-                  curr_session->sender->sliding_window[i] = datap;
-                  curr_session->sender->retransmission_attempts[i] = 0;
-                  send_packet(false, rsocket, datap, to);
-                  we_must_queue = false;
-                  break;
-                }
-              }
-            }
+/* Is nothing left in a submission queue, nor being put into it? */
+bool_t postq_empty(struct rudp_postq *q) {
+  return __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE) == q->head;
+}
 
-            if(we_must_queue == true) {
-              if(curr_session->sender->data_queue == NULL) {
-                /* First entry in the data queue */
-                curr_session->sender->data_queue = data_item;
-              }
-              else {
-                /* Add to end of data queue */
-                struct data *curr_socket = curr_session->sender->data_queue;
-                while(curr_socket->next != NULL) {
-                  curr_socket = curr_socket->next;
-                }
-                curr_socket->next = data_item;
-              }
-            }
+/* Sends a FIN on each sender session of a socket which rudp_close() was
+ * called on, once it has no data left to send. Data still in the submission
+ * queue was posted before rudp_close(), so it holds off the FINs */
+void send_fins(struct rudp_socket_list *socket) {
+  if(socket->postq != NULL && !postq_empty(socket->postq)) {
+    return;
+  }
+  struct session *curr_session;
+  for(curr_session = socket->sessions_list_head; curr_session != NULL; curr_session = curr_session->next) {
+    struct sender_session *sender = curr_session->sender;
+    if(sender != NULL && !sender->session_finished && sender->data_queue == NULL &&
+       sender->window_count == 0 && sender->status == OPEN) {
+      sender->seqno += 1;
+      struct rudp_packet p;
+      init_rudp_packet(&p, RUDP_FIN, sender->seqno, 0, NULL);
+      send_packet(false, socket->rsock, &p, &curr_session->address);
+      sender->status = FIN_SENT;
+    }
+  }
+}
 
-            session_found = true;
-            new_session_created = false;
-            break;
-          }
-          if(curr_session->next==NULL)
-            last_in_list=curr_session;
+/* Frees a submission queue along with data not sent yet */
+void postq_free(struct rudp_postq *q) {
+  if(q == NULL) {
+    return;
+  }
+  event_fd_delete(post_callback, q);
+  while(__atomic_load_n(&q->ring[q->head & (RUDP_POSTRING - 1)].seq, __ATOMIC_ACQUIRE) == q->head + 1) {
+    free(q->ring[q->head & (RUDP_POSTRING - 1)].copy);
+    q->head++;
+  }
+  close(q->wakeup[0]);
+  if(q->wakeup[1] != q->wakeup[0]) {
+    close(q->wakeup[1]);
+  }
+  free(q);
+}
 
-          curr_session = curr_session->next;
-        }
-        if(!session_found) {
-          /* If not, create a new session */
-          seqno = rand();
-          create_sender_session(curr_socket, seqno, to, &data_item);
-        }
-      }
+/* Appends an item to the data queue for a peer, and sends what it can if the item
+ * is at the head of the queue. If there is no sender session for the peer yet, one 
+ * is created and its SYN sent. Returns 0 on success, 1 if the queue is now full,
+ * -1 on error, in which case the item is freed */
+int queue_data(struct rudp_socket_list *socket, struct data *data_item, struct sockaddr_in *to) {
+  u_int32_t seqno = 0;
+  struct session *curr_session = find_session(socket, to);
+  if(curr_session == NULL) {
+    /* No session exists for this peer, so we create a new sender session */
+    seqno = rand_r(&rng_seed);
+    create_sender_session(socket, seqno, to, &data_item);
+  }
+  else if(curr_session->sender == NULL) {
+    /* We have only received from this peer so far, so add a sender to its session */
+    seqno = rand_r(&rng_seed);
+    curr_session->sender = alloc_sender_session(socket, seqno, &data_item);
+    if(curr_session->sender == NULL) {
+      message_free(socket, data_item);
+      return -1;
+    }
+  }
+  else {
+    /* Add to end of data queue */
+    struct sender_session *sender = curr_session->sender;
+    if(sender->data_queue == NULL) {
+      sender->data_queue = data_item;
     }
     else {
-      fprintf(stderr, "Error: attempt to send on invalid socket. Socket not found\n");
-      return -1;
+      sender->data_queue_tail->next = data_item;
     }
+    sender->data_queue_tail = data_item;
+    sender->queued += data_item->len;
+    if((sender->status == OPEN || (sender->status == SYN_SENT && socket->earlydata > 0)) &&
+       sender->data_queue == data_item) {
+      send_queued_data(socket, curr_session);
+    }
+    return queue_full(socket, to);
+  }
+
+  /* Send the SYN for the new session, followed by the data which may go along with it */
+  struct rudp_packet p;
+  init_syn_packet(&p, socket, seqno);
+  send_packet(false, socket->rsock, &p, to);
+  if(socket->earlydata > 0 && (curr_session = find_session(socket, to)) != NULL &&
+     curr_session->sender != NULL) {
+    send_queued_data(socket, curr_session);
+  }
+  return queue_full(socket, to);
+}
+
+/* Returns 1 if the data queue for a peer holds sndbuf bytes or more, in which
+ * case RUDP_EVENT_WRITABLE is raised once it has drained to half of that, else 0 */
+int queue_full(struct rudp_socket_list *socket, struct sockaddr_in *to) {
+  struct session *curr_session = find_session(socket, to);
+  if(curr_session == NULL || curr_session->sender == NULL ||
+     curr_session->sender->queued < socket->sndbuf) {
+    return 0;
+  }
+  curr_session->sender->blocked = true;
+  return 1;
+}
+
+/* Register a callback function which is passed back the buffers of each message
+ * from rudp_sendv() once they may be reused */
+int rudp_sendv_handler(rudp_socket_t rsocket, int (*handler)(rudp_socket_t, 
+            struct sockaddr_in *, const struct iovec *, int)) {
+  if(handler == NULL) {
+    fprintf(stderr, "rudp_sendv_handler failed: handler callback is null\n");
+    return -1;
   }
-  if(new_session_created == true) {
-    /* Send the SYN for the new session */
-    struct rudp_packet *p = create_rudp_packet(RUDP_SYN, seqno, 0, NULL);    
-    send_packet(false, rsocket, p, to);
-    free(p);
+  struct rudp_socket_list *curr_socket = find_socket(rsocket);
+  if(curr_socket == NULL) {
+    fprintf(stderr, "rudp_sendv_handler failed: invalid socket\n");
+    return -1;
   }
+  curr_socket->sendv_handler = handler;
   return 0;
 }
 
 /* Callback function when a timeout occurs */
 int timeout_callback(int fd, void *args) {
   struct timeoutargs *timeargs=(struct timeoutargs*)args;
-  struct rudp_socket_list *curr_socket = socket_list_head;
-  while(curr_socket != NULL) {
-    if(curr_socket->rsock == timeargs->fd) {
-      break;
+  struct rudp_socket_list *curr_socket = timeargs->socket;
+  struct session *curr_session = find_session(curr_socket, &timeargs->recipient);
+  RUDP_TRACE_PACKET(RUDP_TRACE_TIMEOUT, rsock_fd(curr_socket->rsock),
+                    curr_session != NULL && curr_session->sender != NULL ? curr_session->sender->window_count : 0,
+                    timeargs->type, timeargs->seqno, 0, &timeargs->recipient);
+  if(curr_session != NULL && curr_session->sender != NULL) {
+    struct sender_session *sender = curr_session->sender;
+    struct rudp_packet packet;
+    if(timeargs->type != RUDP_PROBE) {
+      /* A lost probe only means that the path does not take packets that large */
+      curr_socket->stats.timeouts++;
+      curr_session->stats.timeouts++;
     }
-    curr_socket = curr_socket->next;
-  }
-  if(curr_socket->rsock == timeargs->fd) {
-    bool_t session_found = false;
-      /* Check if we already have a session for this peer */
-      struct session *curr_session = curr_socket->sessions_list_head;
-      while(curr_session != NULL) {
-        if(compare_sockaddr(&curr_session->address, timeargs->recipient) == 1) {
-          /* Found an existing session */
-          session_found = true;
-          break;
-        }
-        curr_session = curr_session->next;
+    /* The timer has fired, so its handle is no longer valid */
+    if(timeargs->type == RUDP_SYN) {
+      sender->syn_timer = NULL;
+      if(sender->syn_retransmit_attempts >= RUDP_MAXRETRANS) {
+        curr_socket->handler(curr_socket->rsock, RUDP_EVENT_TIMEOUT, &timeargs->recipient);
       }
-      if(session_found == true) {
-        if(timeargs->packet->header.type == RUDP_SYN) {
-          if(curr_session->sender->syn_retransmit_attempts >= RUDP_MAXRETRANS) {
-            curr_socket->handler(timeargs->fd, RUDP_EVENT_TIMEOUT, timeargs->recipient);
-          }
-          else {
-            curr_session->sender->syn_retransmit_attempts++;
-            send_packet(false, timeargs->fd, timeargs->packet, timeargs->recipient);
-            free(timeargs->packet);
-          }
-        }
-        else if(timeargs->packet->header.type == RUDP_FIN) {
-          if(curr_session->sender->fin_retransmit_attempts >= RUDP_MAXRETRANS) {
-            curr_socket->handler(timeargs->fd, RUDP_EVENT_TIMEOUT, timeargs->recipient);
-          }
-          else {
-            curr_session->sender->fin_retransmit_attempts++;
-            send_packet(false, timeargs->fd, timeargs->packet, timeargs->recipient);
-            free(timeargs->packet);
-          }
-        }
-        else {
-          int i;
-          int index;
-          for(i = 0; i < RUDP_WINDOW; i++) {
-            if(curr_session->sender->sliding_window[i] != NULL && 
-               curr_session->sender->sliding_window[i]->header.seqno == timeargs->packet->header.seqno) {
-              index = i;
-            }
-          }
+      else {
+        sender->syn_retransmit_attempts++;
+        init_syn_packet(&packet, curr_socket, timeargs->seqno);
+        send_packet(false, curr_socket->rsock, &packet, &timeargs->recipient);
+      }
+    }
+    else if(timeargs->type == RUDP_FIN) {
+      sender->fin_timer = NULL;
+      if(sender->fin_retransmit_attempts >= RUDP_MAXRETRANS) {
+        curr_socket->handler(curr_socket->rsock, RUDP_EVENT_TIMEOUT, &timeargs->recipient);
+      }
+      else {
+        sender->fin_retransmit_attempts++;
+        init_rudp_packet(&packet, RUDP_FIN, timeargs->seqno, 0, NULL);
+        send_packet(false, curr_socket->rsock, &packet, &timeargs->recipient);
+      }
+    }
+    else if(timeargs->type == RUDP_PROBE) {
+      sender->probe_timer = NULL;
+      if(++sender->probe_attempts < RUDP_PROBETRIES && sender->status == OPEN) {
+        probe_send(curr_socket, curr_session);
+      }
+      else {
+        /* Too large for the path, try a smaller one */
+        sender->probe_high = sender->probe_size - 1;
+        probe_next(curr_socket, curr_session);
+      }
+    }
+    else {
+      struct window_slot *slot = window_find(sender, timeargs->seqno);
 
-          if(curr_session->sender->retransmission_attempts[index] >= RUDP_MAXRETRANS) {
-            curr_socket->handler(timeargs->fd, RUDP_EVENT_TIMEOUT, timeargs->recipient);
-          }
-          else {
-            curr_session->sender->retransmission_attempts[index]++;
-            send_packet(false, timeargs->fd, timeargs->packet, timeargs->recipient);
-            free(timeargs->packet);
-          }
-        }
+      if(slot == NULL) {
+        /* Packet is no longer in the window */
+      }
+      else if(slot->retransmission_attempts >= RUDP_MAXRETRANS) {
+        slot->timer = NULL;
+        curr_socket->handler(curr_socket->rsock, RUDP_EVENT_TIMEOUT, &timeargs->recipient);
+      }
+      else {
+        /* A timeout ends fast recovery, the timers repair the window from here */
+        sender->in_recovery = false;
+        sender->dup_acks = 0;
+        slot->timer = NULL;
+        slot->retransmission_attempts++;
+        curr_socket->stats.retransmits++;
+        curr_session->stats.retransmits++;
+        sender->cc.ops->on_loss(&sender->cc, slot->packet.header.seqno,
+                                sender->window_base + sender->window_count, sender->window_count, 1);
+        send_packet(false, curr_socket->rsock, &slot->packet, &timeargs->recipient);
       }
     }
+  }
 
-  free(timeargs->packet);
-  free(timeargs->recipient);
-  free(timeargs);
+  pool_put(&curr_socket->timer_pool, timeargs);
   return 0;
 }
 
-/* Transmit a packet via UDP */
+/* Transmit a packet via UDP. The packet is added to the socket's batch, which
+ * goes out with one sendmmsg() when the event loop iteration ends, runs of
+ * DATA for one peer as a single UDP GSO datagram where that is enabled. Unless
+ * the packet is an ACK, its retransmission timer is started */
 int send_packet(bool_t is_ack, rudp_socket_t rsocket, struct rudp_packet *p, struct sockaddr_in *recipient) {
-  char type[5];
-  short t=p->header.type;
-  if(t == 1)
-    strcpy(type, "DATA");
-  else if(t == 2)
-    strcpy(type, "ACK");
-  else if(t == 4)
-    strcpy(type, "SYN");
-  else if(t == 5)
-    strcpy(type, "FIN");
-  else
-    strcpy(type, "BAD");
-
-  printf("Sending %s packet to %s:%d seq number=%u on socket=%d\n",type, 
-       inet_ntoa(recipient->sin_addr), ntohs(recipient->sin_port), p->header.seqno, (int)rsocket);
+  struct rudp_socket_list *curr_socket = find_socket(rsocket);
+  if(curr_socket == NULL) {
+    fprintf(stderr, "send_packet: Error: attempt to send on invalid socket\n");
+    return -1;
+  }
+  RUDP_DEBUG("Sending %s packet to %s:%d seq number=%u on socket=%d\n", packet_type_name(p->header.type),
+             inet_ntoa(recipient->sin_addr), ntohs(recipient->sin_port), p->header.seqno, (int)rsocket);
 
   if (DROP != 0 && rand() % DROP == 1) {
-      printf("Dropped\n");
+    RUDP_DEBUG("Dropped\n");
+    RUDP_TRACE_PACKET(RUDP_TRACE_SEND, rsock_fd(rsocket), RUDP_TRACE_DROPPED, p->header.type, p->header.seqno, p->header.length, recipient);
+  }
+  else if(curr_socket->emulation != NULL && emulate_send(curr_socket, p, recipient)) {
+    /* Dropped or held back by the emulation, which has traced it */
   }
   else {
-    if (sendto((int)rsocket, p, sizeof(struct rudp_packet), 0, (struct sockaddr*)recipient, sizeof(struct sockaddr_in)) < 0) {
-      fprintf(stderr, "rudp_sendto: sendto failed\n");
+    RUDP_TRACE_PACKET(RUDP_TRACE_SEND, rsock_fd(rsocket), 0, p->header.type, p->header.seqno, p->header.length, recipient);
+    if(batch_send(curr_socket, p, recipient) < 0) {
       return -1;
     }
   }
+  struct session *curr_session = find_session(curr_socket, recipient);
+  curr_socket->stats.packets_sent++;
+  curr_socket->stats.bytes_sent += RUDP_PKTLEN(p);
+  if(curr_session != NULL) {
+    curr_session->stats.packets_sent++;
+    curr_session->stats.bytes_sent += RUDP_PKTLEN(p);
+  }
 
   if(!is_ack) {
-    /* Set a timeout event if the packet isn't an ACK */
-    struct timeoutargs *timeargs = malloc(sizeof(struct timeoutargs));
-    if(timeargs == NULL) {
-      fprintf(stderr, "send_packet: Error allocating timeout args\n");
-      return -1;
+    /* Set a timeout event if the packet isn't an ACK. The sender session's
+     * RTT estimate determines the timeout */
+    if(curr_session == NULL || curr_session->sender == NULL) {
+      return 0; /* There is nothing to retransmit for */
     }
-    timeargs->packet = malloc(sizeof(struct rudp_packet));
-    if(timeargs->packet == NULL) {
-      fprintf(stderr, "send_packet: Error allocating timeout args packet\n");
-      return -1;
+    struct window_slot *slot = NULL;
+    int attempts = 0;
+    if(p->header.type == RUDP_SYN) {
+      attempts = curr_session->sender->syn_retransmit_attempts;
+    }
+    else if(p->header.type == RUDP_FIN) {
+      attempts = curr_session->sender->fin_retransmit_attempts;
+    }
+    else if(p->header.type == RUDP_PROBE) {
+      attempts = curr_session->sender->probe_attempts;
     }
-    timeargs->recipient = malloc(sizeof(struct sockaddr_in));
-    if(timeargs->packet == NULL) {
-      fprintf(stderr, "send_packet: Error allocating timeout args recipient\n");
+    else if(p->header.type == RUDP_DATA) {
+      slot = window_find(curr_session->sender, p->header.seqno);
+      if(slot == NULL) {
+        return 0;
+      }
+      attempts = slot->retransmission_attempts;
+    }
+
+    struct timeoutargs *timeargs = pool_get(&curr_socket->timer_pool);
+    if(timeargs == NULL) {
+      fprintf(stderr, "send_packet: Error allocating timeout args\n");
       return -1;
     }
-    timeargs->fd = rsocket;
-    memcpy(timeargs->packet, p, sizeof(struct rudp_packet));
-    memcpy(timeargs->recipient, recipient, sizeof(struct sockaddr_in));  
-  
+    timeargs->socket = curr_socket;
+    timeargs->recipient = *recipient;
+    timeargs->type = p->header.type;
+    timeargs->seqno = p->header.seqno;
+
     struct timeval currentTime;
     gettimeofday(&currentTime, NULL);
     struct timeval delay;
-    delay.tv_sec = RUDP_TIMEOUT/1000;
-    delay.tv_usec= 0;
+    int usec = retransmit_delay(curr_session->sender, attempts);
+    delay.tv_sec = usec / 1000000;
+    delay.tv_usec = usec % 1000000;
     struct timeval timeout_time;
     timeradd(&currentTime, &delay, &timeout_time);
 
-    struct rudp_socket_list *curr_socket = socket_list_head;
-    while(curr_socket != NULL) {
-      if(curr_socket->rsock == timeargs->fd) {
-        break;
-      }
-      curr_socket = curr_socket->next;
+    event_timer_t timer = event_timeout(timeout_time, timeout_callback, timeargs, "timeout_callback");
+    if(timer == NULL) {
+      fprintf(stderr, "send_packet: Error registering timeout\n");
+      pool_put(&curr_socket->timer_pool, timeargs);
+      return -1;
     }
-    if(curr_socket->rsock == timeargs->fd) {
-      bool_t session_found = false;
-        /* Check if we already have a session for this peer */
-        struct session *curr_session = curr_socket->sessions_list_head;
-        while(curr_session != NULL) {
-          if(compare_sockaddr(&curr_session->address, timeargs->recipient) == 1) {
-            /* Found an existing session */
-            session_found = true;
-            break;
-          }
-          curr_session = curr_session->next;
-        }
-        if(session_found) {
-          if(timeargs->packet->header.type == RUDP_SYN) {
-            curr_session->sender->syn_timeout_arg = timeargs;
-          }
-          else if(timeargs->packet->header.type == RUDP_FIN) {
-            curr_session->sender->fin_timeout_arg = timeargs;
-          }
-          else if(timeargs->packet->header.type == RUDP_DATA) {
-            int i;
-            int index;
-            for(i = 0; i < RUDP_WINDOW; i++) {
-              if(curr_session->sender->sliding_window[i] != NULL && 
-                 curr_session->sender->sliding_window[i]->header.seqno == timeargs->packet->header.seqno) {
-                index = i;
-              }
-            }
-            curr_session->sender->data_timeout_arg[index] = timeargs;
-          }
-        }
-      }
-      event_timeout(timeout_time, timeout_callback, timeargs, "timeout_callback");
+
+    if(p->header.type == RUDP_SYN) {
+      curr_session->sender->syn_timer = timer;
+      curr_session->sender->syn_sent_time = currentTime;
+    }
+    else if(p->header.type == RUDP_FIN) {
+      curr_session->sender->fin_timer = timer;
+    }
+    else if(p->header.type == RUDP_PROBE) {
+      curr_session->sender->probe_timer = timer;
+    }
+    else if(slot != NULL) {
+      slot->timer = timer;
+      slot->sent_time = currentTime;
+    }
+  }
+  return 0;
+}
+
+/* Sets one of the emulated network conditions of a socket */
+int emulate_setsockopt(struct rudp_socket_list *socket, rudp_sockopt_t option, int v) {
+  if(v < 0 || (option != RUDP_OPT_DELAY && v > 1000)) {
+    fprintf(stderr, "rudp_setsockopt Error: emulated network conditions out of range\n");
+    return -1;
+  }
+  if(socket->emulation == NULL) {
+    socket->emulation = malloc(sizeof(struct emulation));
+    if(socket->emulation == NULL) {
+      fprintf(stderr, "rudp_setsockopt Error: allocating emulation\n");
+      return -1;
+    }
+    memset(socket->emulation, 0, sizeof(struct emulation));
+    socket->emulation->seed = (unsigned int)time(NULL) ^ (unsigned int)(long)socket->rsock;
+  }
+  if(option == RUDP_OPT_LOSS) {
+    socket->emulation->loss = v;
+  }
+  else if(option == RUDP_OPT_DELAY) {
+    socket->emulation->delay = v;
+  }
+  else {
+    socket->emulation->reorder = v;
+  }
+  return 0;
+}
+
+/* Passes a packet through the emulated network. Returns true if it was dropped
+ * or held back, false if it is to be sent right away */
+bool_t emulate_send(struct rudp_socket_list *socket, struct rudp_packet *p, struct sockaddr_in *to) {
+  struct emulation *emulation = socket->emulation;
+  if(emulation->loss > 0 && rand_r(&emulation->seed) % 1000 < emulation->loss) {
+    RUDP_DEBUG("Dropped\n");
+    RUDP_TRACE_PACKET(RUDP_TRACE_SEND, rsock_fd(socket->rsock), RUDP_TRACE_DROPPED, p->header.type, p->header.seqno, p->header.length, to);
+    return true;
+  }
+  int delay = emulation->delay;
+  if(emulation->reorder > 0 && rand_r(&emulation->seed) % 1000 < emulation->reorder) {
+    delay += delay > RUDP_REORDERDELAY ? delay : RUDP_REORDERDELAY;
+  }
+  if(delay == 0) {
+    return false;
+  }
+
+  struct delayed *d = malloc(offsetof(struct delayed, packet) + RUDP_PKTLEN(p));
+  if(d == NULL) {
+    return false; /* Send it now rather than lose it */
+  }
+  memcpy(&d->packet, p, RUDP_PKTLEN(p));
+  d->socket = socket;
+  d->to = *to;
+  struct timeval now, wait, when;
+  gettimeofday(&now, NULL);
+  wait.tv_sec = delay / 1000;
+  wait.tv_usec = (delay % 1000) * 1000;
+  timeradd(&now, &wait, &when);
+  d->timer = event_timeout(when, delayed_callback, d, "delayed_callback");
+  if(d->timer == NULL) {
+    free(d);
+    return false;
+  }
+  d->prev = NULL;
+  d->next = emulation->held;
+  if(d->next != NULL) {
+    d->next->prev = d;
+  }
+  emulation->held = d;
+  RUDP_TRACE_PACKET(RUDP_TRACE_SEND, rsock_fd(socket->rsock), RUDP_TRACE_HELD, p->header.type, p->header.seqno, p->header.length, to);
+  return true;
+}
+
+/* Callback function when a packet held back by the emulation is due */
+int delayed_callback(int fd, void *arg) {
+  struct delayed *d = (struct delayed *)arg;
+  struct emulation *emulation = d->socket->emulation;
+  if(d->prev == NULL) {
+    emulation->held = d->next;
+  }
+  else {
+    d->prev->next = d->next;
   }
+  if(d->next != NULL) {
+    d->next->prev = d->prev;
+  }
+  RUDP_TRACE_PACKET(RUDP_TRACE_SEND, rsock_fd(d->socket->rsock), 0, d->packet.header.type, d->packet.header.seqno, d->packet.header.length, &d->to);
+  batch_send(d->socket, &d->packet, &d->to);
+  free(d);
   return 0;
 }
+
+/* Drops the packets a socket's emulation holds back, and the emulation */
+void emulate_free(struct rudp_socket_list *socket) {
+  struct emulation *emulation = socket->emulation;
+  if(emulation == NULL) {
+    return;
+  }
+  while(emulation->held != NULL) {
+    struct delayed *d = emulation->held;
+    emulation->held = d->next;
+    event_timeout_cancel(d->timer);
+    free(d);
+  }
+  free(emulation);
+  socket->emulation = NULL;
+}
+
+/* Cancel a pending retransmission timeout and return its arguments to the pool */
+void cancel_timeout(event_timer_t *timer) {
+  if(*timer == NULL)
+    return;
+  struct timeoutargs *args = (struct timeoutargs *)event_timeout_arg(*timer);
+  event_timeout_cancel(*timer);
+  pool_put(&args->socket->timer_pool, args);
+  *timer = NULL;
+}
+
+/* Set the level up to which messages are logged */
+void rudp_set_log_level(int level) {
+  rudp_log_level = level;
+}
+
+/* Writes a log message, warnings and errors to stderr and the rest to stdout */
+void rudp_log(int level, const char *format, ...) {
+  va_list ap;
+  va_start(ap, format);
+  vfprintf(level <= RUDP_LOG_WARN ? stderr : stdout, format, ap);
+  va_end(ap);
+}
+
+/* Returns the name of a packet type for logging */
+const char *packet_type_name(u_int16_t type) {
+  switch(type) {
+  case RUDP_DATA:
+    return "DATA";
+  case RUDP_ACK:
+    return "ACK";
+  case RUDP_SYN:
+    return "SYN";
+  case RUDP_FIN:
+    return "FIN";
+  case RUDP_PROBE:
+    return "PROBE";
+  default:
+    return "BAD";
+  }
+}
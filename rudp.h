@@ -1,11 +1,30 @@
 #ifndef RUDP_PROTO_H
 #define	RUDP_PROTO_H
 
-#define RUDP_VERSION	1	/* Protocol version */
-#define RUDP_MAXPKTSIZE 1000	/* Number of data bytes that can sent in a packet, RUDP header not included */
+#define RUDP_VERSION	3	/* Protocol version */
+#define RUDP_MAXPKTSIZE 1000	/* Number of data bytes a packet carries on any path, RUDP header not included */
+#define RUDP_MTU	1500	/* Default size of the largest IP packet sent or received, RUDP_OPT_MTU */
+#define RUDP_MAXMTU	9000	/* Upper limit for RUDP_OPT_MTU, that of jumbo frames */
+#define RUDP_IPUDPHDR	28	/* Bytes of the IPv4 and UDP headers in front of a packet */
+#define RUDP_MAXPAYLOAD	(RUDP_MAXMTU - RUDP_IPUDPHDR - (int)sizeof(struct rudp_hdr))	/* Most data bytes a packet can carry */
+#define RUDP_PROBETRIES	3	/* Number of times a probe is lost before its size is taken to be too large */
+#define RUDP_PROBESTEP	16	/* Path MTU discovery stops once it knows the largest payload to within this many bytes */
 #define RUDP_MAXRETRANS 5	/* Max. number of retransmissions */
-#define RUDP_TIMEOUT	2000	/* Timeout for the first retransmission in milliseconds */
-#define RUDP_WINDOW	3	/* Max. number of unacknowledged packets that can be sent to the network*/
+#define RUDP_TIMEOUT	2000	/* Retransmission timeout in milliseconds until the RTT has been measured */
+#define RUDP_MINTIMEOUT	10	/* Lower bound for the retransmission timeout in milliseconds */
+#define RUDP_MAXTIMEOUT	60000	/* Upper bound for the retransmission timeout in milliseconds, backoff included */
+#define RUDP_WINDOW	3	/* Default max. number of unacknowledged packets that can be sent to the network*/
+#define RUDP_MAXWINDOW	16384	/* Upper limit for RUDP_OPT_WINDOW, well below the range of SEQ_LT() and friends */
+#define RUDP_MAXSACK	4	/* Max. number of SACK blocks in an ACK */
+#define RUDP_DUPACKS	3	/* Number of duplicate ACKs which trigger a fast retransmit */
+#define RUDP_DELACK	1	/* Default number of in-order DATA packets per ACK, 1 for no delayed ACKs */
+#define RUDP_DELACKTIMEOUT	5	/* Max. time in milliseconds an ACK is delayed, below RUDP_MINTIMEOUT */
+#define RUDP_BATCH	32	/* Default max. number of packets received or sent with one system call */
+#define RUDP_MAXBATCH	64	/* Upper limit for RUDP_OPT_BATCH */
+#define RUDP_MAXMSG	65536	/* Default max. size of a message, RUDP_OPT_MAXMSG */
+#define RUDP_SNDBUF	65536	/* Default number of bytes queued per peer before sending blocks, RUDP_OPT_SNDBUF */
+#define RUDP_SYNHISTORY	256	/* Number of SYNs remembered per socket with RUDP_OPT_NOREPLAY */
+#define RUDP_REORDERDELAY	1	/* Min. extra delay in milliseconds of packets reordered by RUDP_OPT_REORDER */
 
 /* Packet types */
 
@@ -13,6 +32,7 @@
 #define RUDP_ACK	2
 #define RUDP_SYN	4
 #define RUDP_FIN	5
+#define RUDP_PROBE	6
 
 /*
  * Sequence numbers are 32-bit integers operated on with modular arithmetic.
@@ -24,12 +44,55 @@
 #define	SEQ_GT(a,b)	((short)((a)-(b)) > 0)
 #define	SEQ_GEQ(a,b)	((short)((a)-(b)) >= 0)
 
-/* RUDP packet header */
+/*
+ * RUDP packet header. On the wire, the header is followed by exactly
+ * length bytes of payload.
+ */
 
 struct rudp_hdr {
   u_int16_t version;
   u_int16_t type;
   u_int32_t seqno;
+  u_int16_t length;	/* Number of payload bytes following the header */
+  u_int16_t flags;	/* RUDP_MORE or zero. Also pads the header so that the payload is 32-bit aligned */
+}__attribute__ ((packed));
+
+/*
+ * Header flags. A message longer than RUDP_MAXPKTSIZE is sent as DATA packets 
+ * with consecutive sequence numbers, all but the last of which have RUDP_MORE set
+ */
+
+#define RUDP_MORE	0x0001	/* More fragments of the message follow */
+
+/*
+ * Path MTU discovery. Sessions start out sending packets of RUDP_MAXPKTSIZE
+ * bytes of data. Once the SYN is ACKed, the sender probes for larger ones with
+ * PROBE packets, sent with the Don't Fragment bit set, whose seqno and length
+ * are both the payload size probed and whose payload is padding. The receiver
+ * echoes a probe it gets as a PROBE with the same seqno and no payload, and
+ * from then on the sender's DATA packets carry up to that many bytes
+ */
+
+/*
+ * Selective acknowledgement (SACK) block. An ACK for DATA acknowledges all
+ * packets before its sequence number. Its payload holds up to RUDP_MAXSACK
+ * blocks, each of which acknowledges the packets from start up to, but not
+ * including, end, which the receiver has buffered out of order.
+ */
+
+struct rudp_sack {
+  u_int32_t start;
+  u_int32_t end;
+}__attribute__ ((packed));
+
+/*
+ * Payload of a SYN: the max. number of packets the sender keeps 
+ * unacknowledged, in network byte order. The receiver buffers packets 
+ * which arrive out of order, and ACKs duplicates, within that window
+ */
+
+struct rudp_syn {
+  u_int32_t window;
 }__attribute__ ((packed));
 
 #endif /* RUDP_PROTO_H */
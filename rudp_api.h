@@ -1,8 +1,13 @@
 #ifndef RUDP_API_H
 #define RUDP_API_H
 
-#define RUDP_MAXPKTSIZE 1000    /* Number of data bytes that can sent in a
-                                 * packet, RUDP header not included */
+#include <sys/uio.h>
+
+#define RUDP_MAXPKTSIZE 1000    /* Number of data bytes a packet carries at
+                                 * least, RUDP header not included. Packets
+                                 * carry more once path MTU discovery allows */
+#define RUDP_MAXIOV     32      /* Max. number of buffers of a message for 
+                                 * rudp_sendv() */
 
 /*
  * Event types for callback notifications
@@ -11,14 +16,109 @@
 typedef enum {
   RUDP_EVENT_TIMEOUT, 
   RUDP_EVENT_CLOSED,
+  RUDP_EVENT_WRITABLE,  /* The queue for the peer has room again */
 } rudp_event_t; 
 
+/*
+ * Socket options for rudp_setsockopt()
+ */
+
+typedef enum {
+  RUDP_OPT_WINDOW,      /* int: max. number of unacknowledged packets per peer */
+  RUDP_OPT_CONGESTION,  /* int: congestion control algorithm, a rudp_cc_t */
+  RUDP_OPT_BATCH,       /* int: max. number of packets per recvmmsg()/sendmmsg() */
+  RUDP_OPT_OFFLOAD,     /* int: nonzero to use UDP GSO/GRO where the kernel has them */
+  RUDP_OPT_DELACK,      /* int: ACK every Nth in-order DATA packet, or after a short delay */
+  RUDP_OPT_MAXMSG,      /* int: max. number of bytes of a message sent or received */
+  RUDP_OPT_SNDBUF,      /* int: bytes queued per peer before rudp_sendto() reports it full */
+  RUDP_OPT_EARLYDATA,   /* int: DATA packets a new session sends along with its SYN */
+  RUDP_OPT_NOREPLAY,    /* int: nonzero to ignore SYNs, and their early data, seen before */
+  RUDP_OPT_IDLE,        /* int: milliseconds after which a silent peer's session is freed, 0 for never */
+  RUDP_OPT_MAXSESSIONS, /* int: max. number of sessions, the least recently active is freed first */
+  RUDP_OPT_LOSS,        /* int: emulated loss of outgoing packets, per mille */
+  RUDP_OPT_DELAY,       /* int: emulated delay of outgoing packets, milliseconds */
+  RUDP_OPT_REORDER,     /* int: outgoing packets held back by another delay to reorder them, per mille */
+  RUDP_OPT_MTU,         /* int: bytes of the largest IP packet sent or received, only before any sessions exist */
+  RUDP_OPT_PMTUD,       /* int: nonzero to probe for the largest packets the path takes, 0 to send them right away */
+} rudp_sockopt_t;
+
+/*
+ * Congestion control algorithms for RUDP_OPT_CONGESTION
+ */
+
+typedef enum {
+  RUDP_CC_NONE,         /* Only the window limits the sender */
+  RUDP_CC_NEWRENO,      /* Loss-based, as TCP NewReno (the default) */
+  RUDP_CC_PACING,       /* Paced at the estimated bottleneck bandwidth */
+} rudp_cc_t;
+
+/*
+ * Log levels for rudp_set_log_level(). Messages above RUDP_LOG_LEVEL, which
+ * may be defined when compiling rudp.c and is RUDP_LOG_WARN otherwise, are 
+ * compiled out altogether. RUDP_LOG_DEBUG traces every packet sent and received
+ */
+
+#define RUDP_LOG_NONE   0
+#define RUDP_LOG_ERROR  1
+#define RUDP_LOG_WARN   2
+#define RUDP_LOG_INFO   3
+#define RUDP_LOG_DEBUG  4
+
+/*
+ * Round-trip time estimate of a session, as returned by rudp_get_rtt().
+ * All values are in microseconds
+ */
+
+struct rudp_rtt {
+  int srtt;     /* Smoothed round-trip time, 0 until the first measurement */
+  int rttvar;   /* Round-trip time variation */
+  int rto;      /* Retransmission timeout, before backoff */
+};
+
+/*
+ * Counters of a socket, or of its session with one peer, as returned by 
+ * rudp_get_stats(). The counters of a socket include those of sessions
+ * which have been freed
+ */
+
+struct rudp_stats {
+  unsigned long long packets_sent;      /* All packet types, retransmissions included */
+  unsigned long long bytes_sent;        /* RUDP headers included */
+  unsigned long long packets_received;  /* Well-formed packets */
+  unsigned long long bytes_received;
+  unsigned long long retransmits;       /* DATA packets sent again */
+  unsigned long long timeouts;          /* Retransmission timeouts of DATA, SYN and FIN */
+  unsigned long long duplicates;        /* DATA packets which had been received already */
+  unsigned long long out_of_order;      /* DATA packets received ahead of a missing one */
+  /* The following reflect the current state, summed over the sessions for a socket */
+  int window;     /* Packets in the sliding window */
+  int queued;     /* Bytes waiting in the data queue */
+  int cwnd;       /* Congestion window in packets, for a peer only */
+  int srtt;       /* As in struct rudp_rtt, for a peer only */
+  int rttvar;
+  int rto;
+  int handshake;  /* Microseconds from the first SYN to its ACK, for a peer only, 0 if unknown */
+  int pktsize;    /* Data bytes per DATA packet, as path MTU discovery found, for a peer only */
+};
+
 /*
  * RUDP socket handle
  */
 
 typedef void *rudp_socket_t;
 
+/*
+ * Handle of a received buffer, see rudp_recvbuf_handler()
+ */
+
+typedef struct rudp_buf *rudp_buf_t;
+
+/*
+ * Handle of the submission queue of a socket, see rudp_post()
+ */
+
+typedef struct rudp_postq *rudp_postq_t;
+
 /*
  * Prototypes
  */
@@ -29,25 +129,134 @@ typedef void *rudp_socket_t;
 rudp_socket_t rudp_socket(int port);
 
 /* 
- * Socket termination
+ * Socket creation, sharing the port with other sockets created this way 
+ * (SO_REUSEPORT). Each thread may run an event loop with sockets of its 
+ * own; the kernel spreads the peers across the sockets on the port
+ */
+rudp_socket_t rudp_socket_shared(int port);
+
+/* 
+ * Socket termination. Data queued or posted before is still sent, then 
+ * each session is ended with a FIN
  */
 int rudp_close(rudp_socket_t rsocket);
 
 /* 
- * Send a datagram 
+ * Set a socket option. value points to an int, len is sizeof(int)
+ */
+int rudp_setsockopt(rudp_socket_t rsocket, rudp_sockopt_t option, 
+            const void *value, int len);
+
+/* 
+ * Get the round-trip time estimate for data sent to peer
+ */
+int rudp_get_rtt(rudp_socket_t rsocket, struct sockaddr_in *peer, 
+         struct rudp_rtt *rtt);
+
+/* 
+ * Get the counters of the session with peer, or of the whole socket if 
+ * peer is NULL
+ */
+int rudp_get_stats(rudp_socket_t rsocket, struct sockaddr_in *peer, 
+         struct rudp_stats *stats);
+
+/* 
+ * Set the level up to which messages are logged, RUDP_LOG_WARN by default
+ */
+void rudp_set_log_level(int level);
+
+/* 
+ * Trace the RUDP sockets and the event loop of the calling thread into a 
+ * ring of records (RUDP_TRACERECORDS if records is 0) in the file at path, 
+ * which rudp_tracedump decodes. rudp_trace_close stops it
+ */
+int rudp_trace_open(const char *path, int records);
+int rudp_trace_close();
+
+/* 
+ * Send a datagram. Up to RUDP_MAXPKTSIZE bytes go in one packet. A longer 
+ * message, up to RUDP_OPT_MAXMSG bytes, is sent in several, and the receiver 
+ * puts it together again before it is passed to its handler. Data which 
+ * does not fit in the window is queued. Returns 1 when the queue for the 
+ * peer is full: the application should then hold off sending to it until 
+ * RUDP_EVENT_WRITABLE
  */
 int rudp_sendto(rudp_socket_t rsocket, void* data, int len, 
         struct sockaddr_in* to);
 
+/* 
+ * Send the same datagram to n peers, as by rudp_sendto() to each of them, 
+ * but with a single copy of the data which all their queues share. 
+ * Returns the number of peers whose queue is full
+ */
+int rudp_sendto_many(rudp_socket_t rsocket, void *data, int len, 
+        struct sockaddr_in *to, int n);
+
+/* 
+ * Send a message gathered from iovcnt buffers, as by rudp_sendto(). With a 
+ * sendv handler registered, a message of more than one packet is not copied
+ * and the buffers must stay unchanged until the handler is passed them back
+ */
+int rudp_sendv(rudp_socket_t rsocket, const struct iovec *iov, int iovcnt, 
+       struct sockaddr_in *to);
+
+/* 
+ * Get the submission queue of a socket, through which other threads hand 
+ * data to the socket's event loop. Call from the thread of the socket; the 
+ * queue goes away when the socket is closed
+ */
+rudp_postq_t rudp_postq(rudp_socket_t rsocket);
+
+/* 
+ * Send a datagram from any thread. The data is copied into the queue, and 
+ * the event loop sends it with rudp_sendto(), in order. While the queue for 
+ * a peer is full, the event loop takes nothing more from the queue. Returns 
+ * -1 with errno set to EAGAIN if the queue is full
+ */
+int rudp_post(rudp_postq_t q, void *data, int len, struct sockaddr_in *to);
+
+/* 
+ * Register callback function which is passed the buffers of each message 
+ * from rudp_sendv() once they are no longer needed. It is called from the 
+ * event loop after rudp_sendv() has returned
+ */
+int rudp_sendv_handler(rudp_socket_t rsocket, 
+           int (*handler)(rudp_socket_t, 
+                  struct sockaddr_in *, 
+                  const struct iovec *, int));
+
 /* 
  * Register callback function for packet receiption 
  * Note: data and len arguments to callback function 
- * are only valid during the call to the handler
+ * are only valid during the call to the handler.
+ * data points into the buffer the packet was received into; it is not copied
  */
 int rudp_recvfrom_handler(rudp_socket_t rsocket, 
               int (*handler)(rudp_socket_t, 
                      struct sockaddr_in *, 
                      char *, int));
+
+/*
+ * Register callback function for packet receiption, instead of the above.
+ * The handler is also passed the buffer which holds data. It may call
+ * rudp_buf_hold() on it to keep data valid after it returns, and gives the
+ * buffer back with rudp_buf_release() when it is done with it, from any 
+ * thread. A message put together from several packets is passed in a 
+ * buffer of its own, which is held and released the same way
+ */
+int rudp_recvbuf_handler(rudp_socket_t rsocket, 
+             int (*handler)(rudp_socket_t, 
+                    struct sockaddr_in *, 
+                    rudp_buf_t, char *, int));
+void rudp_buf_hold(rudp_buf_t buf);
+void rudp_buf_release(rudp_buf_t buf);
+
+/*
+ * Stop reading packets from the socket (pause nonzero), or read them again.
+ * While paused nothing is received or acknowledged, so that the peers' 
+ * windows fill and they hold off sending; timers keep running
+ */
+int rudp_recv_pause(rudp_socket_t rsocket, int pause);
 /*
  * Register callback handler for event notifications
  */
@@ -0,0 +1,613 @@
+/*
+ * rudp_bench: A throughput and latency benchmark for RUDP.
+ * "rudp_bench -r port" receives on the given port, "rudp_bench [options]
+ * host:port" sends to such a receiver. Without either, both run over
+ * loopback in one process, the receiver in a thread of its own. With -C
+ * the receiver checks that every message arrives whole and in order, which
+ * "make check" relies on.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <netdb.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "rudp_api.h"
+#include "event.h"
+
+#define BENCH_DATA 1
+#define BENCH_END 2
+#define BENCH_MAXSESSIONS 1024  /* Max. number of sessions of a run */
+#define BENCH_MAXMSG (1024 * 1024)  /* Max. message size */
+#define BENCH_PORT 45678  /* Port of the receiver over loopback */
+#define BENCH_CHECKTIME 120  /* Seconds after which a checked run is taken to hang */
+
+/* Byte i of the message with sequence number seq, in a checked run */
+#define BENCH_BYTE(seq, i) ((char) ((seq) * 131 + (i)))
+
+/* Header of each benchmark message */
+struct bench_hdr {
+  u_int32_t type;
+  u_int32_t sessions;  /* Number of sessions of the run */
+  u_int32_t session;  /* Index of the sending session */
+  u_int32_t seq;  /* Number of DATA messages the session sent before this one */
+  u_int32_t sent[2];  /* Time of rudp_sendto() in microseconds, by the sender's clock, high half first */
+};
+
+/* A sending session, with a socket of its own */
+struct bsession {
+  rudp_socket_t rsock;
+  rudp_postq_t postq;  /* Submission queue of rsock, with -P */
+  long long sent;  /* Bytes sent so far */
+  u_int32_t seq;  /* DATA messages sent so far */
+  int blocked;  /* Is the RUDP queue full? */
+  int done;  /* Has END been sent? */
+};
+
+/* Prototypes */
+int usage();
+u_int64_t now_usec();
+double cpu_seconds();
+void setopts(rudp_socket_t rsock, int sender);
+void *receiver(void *arg);
+int bench_recv(rudp_socket_t rsocket, struct sockaddr_in *remote, char *buf, int len);
+int recv_eventhandler(rudp_socket_t rsocket, rudp_event_t event, struct sockaddr_in *remote);
+void recv_report();
+void sender(struct sockaddr_in *to);
+int bench_msg(struct bsession *b, int type);
+void bench_send(struct bsession *b);
+void *producer(void *arg);
+int posted(int fd, void *arg);
+int send_eventhandler(rudp_socket_t rsocket, rudp_event_t event, struct sockaddr_in *remote);
+static int compare_int(const void *a, const void *b);
+
+/* Options */
+int msgsize = 1000;  /* Bytes per message, header included */
+long long total = 100LL * 1024 * 1024;  /* Bytes to send per session */
+int nsessions = 1;  /* Number of sending sessions */
+int window = 0;  /* RUDP window size, 0 for the default */
+int congestion = -1;  /* RUDP congestion control algorithm, -1 for the default */
+int offload = 0;  /* Use UDP GSO/GRO */
+int loss = 0;  /* Emulated loss, per mille */
+int delay = 0;  /* Emulated delay, milliseconds */
+int reorder = 0;  /* Emulated reordering, per mille */
+int mtu = 0;  /* RUDP MTU, 0 for the default */
+int earlydata = 0;  /* DATA packets sent along with the SYN */
+int noreplay = 0;  /* Receiver ignores SYNs seen before */
+int post = 0;  /* Hand the messages to RUDP from another thread with rudp_post() */
+int check = 0;  /* Vary the message sizes and check what arrives */
+int loopback = 0;  /* Run sender and receiver in this process */
+char *tracefile = NULL;  /* Trace RUDP into this file, and the receiver over loopback into one with .recv added */
+
+/* Sender state */
+struct sockaddr_in peer;  /* The receiver */
+struct bsession bsessions[BENCH_MAXSESSIONS];
+int closed = 0;  /* Number of sessions whose socket is closed */
+u_int64_t send_start, send_end;
+char *msg;  /* The message sent over and over */
+int postpipe[2];  /* The producer tells the event loop that it is done through it */
+
+/* Receiver state, only touched by the receiver thread */
+rudp_socket_t recv_sock;
+int ends = 0;  /* Number of sessions which have finished */
+int expected = 0;  /* Number of sessions of the run */
+long long recv_bytes = 0;
+long long recv_msgs = 0;
+u_int32_t recv_seq[BENCH_MAXSESSIONS];  /* DATA messages received from each session */
+u_int64_t recv_start, recv_end;
+double recv_cpu;  /* CPU time of the receiver thread when the run started */
+int *latency = NULL;  /* Delivery latency of each message in microseconds */
+int nlatency = 0;
+int latency_capacity = 0;
+
+/* usage: how to use program */
+int usage() {
+  fprintf(stderr, "Usage: rudp_bench [-r port] [-s msgsize] [-b MB-per-session] [-n sessions] "
+          "[-w window] [-c none|newreno|pacing] [-g] [-l loss%%] [-D delay-ms] [-R reorder%%] [-M mtu] "
+          "[-e packets] [-N] [-P] [-C] [-T tracefile] [host:port]\n");
+  exit(1);
+}
+
+int main(int argc, char* argv[]) {
+  struct sockaddr_in to;
+  struct hostent *hp;
+  pthread_t thread;
+  char *port;
+  int recvport = 0;
+  int c;
+
+  opterr = 0;
+  while ((c = getopt(argc, argv, "r:s:b:n:w:c:gl:D:R:M:e:NPCT:")) != -1) {
+    if (c == 'r') {
+      recvport = atoi(optarg);
+    }
+    else if (c == 's') {
+      msgsize = atoi(optarg);
+      if (msgsize < (int) sizeof(struct bench_hdr) || msgsize > BENCH_MAXMSG)
+        usage();
+    }
+    else if (c == 'b') {
+      total = (long long) (atof(optarg) * 1024 * 1024);
+    }
+    else if (c == 'n') {
+      nsessions = atoi(optarg);
+      if (nsessions < 1 || nsessions > BENCH_MAXSESSIONS)
+        usage();
+    }
+    else if (c == 'w') {
+      window = atoi(optarg);
+    }
+    else if (c == 'c') {
+      if (strcmp(optarg, "none") == 0)
+        congestion = RUDP_CC_NONE;
+      else if (strcmp(optarg, "newreno") == 0)
+        congestion = RUDP_CC_NEWRENO;
+      else if (strcmp(optarg, "pacing") == 0)
+        congestion = RUDP_CC_PACING;
+      else
+        usage();
+    }
+    else if (c == 'g') {
+      offload = 1;
+    }
+    else if (c == 'l') {
+      loss = (int) (atof(optarg) * 10);
+    }
+    else if (c == 'D') {
+      delay = atoi(optarg);
+    }
+    else if (c == 'R') {
+      reorder = (int) (atof(optarg) * 10);
+    }
+    else if (c == 'M') {
+      mtu = atoi(optarg);
+    }
+    else if (c == 'e') {
+      earlydata = atoi(optarg);
+    }
+    else if (c == 'N') {
+      noreplay = 1;
+    }
+    else if (c == 'P') {
+      post = 1;
+    }
+    else if (c == 'C') {
+      check = 1;
+    }
+    else if (c == 'T') {
+      tracefile = optarg;
+    }
+    else
+      usage();
+  }
+  if (check)
+    alarm(BENCH_CHECKTIME);
+
+  if (recvport > 0) {
+    /* Serve one run after the other */
+    if (optind != argc)
+      usage();
+    for (;;)
+      receiver(&recvport);
+  }
+
+  memset(&to, 0, sizeof(to));
+  to.sin_family = AF_INET;
+  if (optind == argc) {
+    loopback = 1;
+    recvport = BENCH_PORT;
+    to.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    to.sin_port = htons(recvport);
+    if (pthread_create(&thread, NULL, receiver, &recvport) != 0) {
+      fprintf(stderr, "rudp_bench: pthread_create() failed\n");
+      exit(1);
+    }
+    usleep(100000);  /* Let the receiver bind its socket */
+  }
+  else if (optind == argc - 1 && (port = strchr(argv[optind], ':')) != NULL) {
+    *port++ = '\0';
+    to.sin_port = htons(atoi(port));
+    if ((hp = gethostbyname(argv[optind])) == NULL) {
+      fprintf(stderr, "Can't locate host \"%s\"\n", argv[optind]);
+      exit(1);
+    }
+    memcpy(&to.sin_addr, hp->h_addr, sizeof(struct in_addr));
+  }
+  else
+    usage();
+
+  sender(&to);
+  if (loopback)
+    pthread_join(thread, NULL);
+  return 0;
+}
+
+/* now_usec: the time of day in microseconds */
+u_int64_t now_usec() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (u_int64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/* cpu_seconds: user and system time of the calling thread, where it can be told */
+double cpu_seconds() {
+  struct rusage ru;
+#ifdef RUSAGE_THREAD
+  getrusage(RUSAGE_THREAD, &ru);
+#else
+  getrusage(RUSAGE_SELF, &ru);
+#endif
+  return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec +
+    (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+/*
+ * setopts: apply the RUDP options of the run to a socket. The network is
+ * only emulated for the senders, so that the receiver's last ACK cannot be
+ * lost once it has closed its socket; NOREPLAY is the receiver's
+ */
+void setopts(rudp_socket_t rsock, int sender) {
+  int maxmsg = BENCH_MAXMSG;
+
+  if ((window > 0 && rudp_setsockopt(rsock, RUDP_OPT_WINDOW, &window, sizeof(window)) < 0) ||
+      (congestion >= 0 &&
+       rudp_setsockopt(rsock, RUDP_OPT_CONGESTION, &congestion, sizeof(congestion)) < 0) ||
+      (offload && rudp_setsockopt(rsock, RUDP_OPT_OFFLOAD, &offload, sizeof(offload)) < 0) ||
+      rudp_setsockopt(rsock, RUDP_OPT_MAXMSG, &maxmsg, sizeof(maxmsg)) < 0 ||
+      (mtu > 0 && rudp_setsockopt(rsock, RUDP_OPT_MTU, &mtu, sizeof(mtu)) < 0) ||
+      (sender && loss > 0 && rudp_setsockopt(rsock, RUDP_OPT_LOSS, &loss, sizeof(loss)) < 0) ||
+      (sender && delay > 0 && rudp_setsockopt(rsock, RUDP_OPT_DELAY, &delay, sizeof(delay)) < 0) ||
+      (sender && reorder > 0 && rudp_setsockopt(rsock, RUDP_OPT_REORDER, &reorder, sizeof(reorder)) < 0) ||
+      (sender && earlydata > 0 &&
+       rudp_setsockopt(rsock, RUDP_OPT_EARLYDATA, &earlydata, sizeof(earlydata)) < 0) ||
+      (!sender && noreplay && rudp_setsockopt(rsock, RUDP_OPT_NOREPLAY, &noreplay, sizeof(noreplay)) < 0)) {
+    fprintf(stderr, "rudp_bench: rudp_setsockopt() failed\n");
+    exit(1);
+  }
+}
+
+/*
+ * receiver: receive one run on the given port, then report on it
+ */
+
+void *receiver(void *arg) {
+  int port = *(int *) arg;
+  char path[FILENAME_MAX];
+
+  if (tracefile != NULL) {
+    snprintf(path, sizeof(path), loopback ? "%s.recv" : "%s", tracefile);
+    if (rudp_trace_open(path, 0) < 0)
+      exit(1);
+  }
+
+  if ((recv_sock = rudp_socket(port)) == NULL) {
+    fprintf(stderr, "rudp_bench: rudp_socket() failed\n");
+    exit(1);
+  }
+  setopts(recv_sock, 0);
+  rudp_recvfrom_handler(recv_sock, bench_recv);
+  rudp_event_handler(recv_sock, recv_eventhandler);
+  ends = 0;
+  expected = 0;
+  recv_bytes = 0;
+  recv_msgs = 0;
+  memset(recv_seq, 0, sizeof(recv_seq));
+  nlatency = 0;
+  eventloop(0);
+  return NULL;
+}
+
+/* bench_recv: callback function for received benchmark messages */
+int bench_recv(rudp_socket_t rsocket, struct sockaddr_in *remote, char *buf, int len) {
+  struct bench_hdr hdr;
+  u_int64_t now = now_usec();
+  u_int32_t session, seq;
+  int i;
+
+  if (len < (int) sizeof(hdr)) {
+    fprintf(stderr, "rudp_bench: short message (%d bytes)\n", len);
+    if (check)
+      exit(1);
+    return 0;
+  }
+  memcpy(&hdr, buf, sizeof(hdr));
+  if (expected == 0) {
+    expected = ntohl(hdr.sessions);
+    recv_start = now;
+    recv_cpu = cpu_seconds();
+  }
+  session = ntohl(hdr.session);
+  seq = ntohl(hdr.seq);
+  if (session >= BENCH_MAXSESSIONS) {
+    fprintf(stderr, "rudp_bench: message of unknown session %u\n", session);
+    exit(1);
+  }
+  if (check && seq != recv_seq[session]) {
+    /* END tells how many DATA messages went before it */
+    fprintf(stderr, "rudp_bench: session %u: message %u arrived after %u\n",
+            session, seq, recv_seq[session]);
+    exit(1);
+  }
+  if (ntohl(hdr.type) == BENCH_END) {
+    recv_end = now;
+    if (++ends == expected)
+      recv_report();
+    return 0;
+  }
+
+  if (check) {
+    for (i = sizeof(hdr); i < len; i++) {
+      if (buf[i] != BENCH_BYTE(seq, i)) {
+        fprintf(stderr, "rudp_bench: session %u: message %u of %d bytes differs at byte %d\n",
+                session, seq, len, i);
+        exit(1);
+      }
+    }
+  }
+  recv_seq[session]++;
+  recv_bytes += len;
+  recv_msgs++;
+  if (nlatency == latency_capacity) {
+    latency_capacity = latency_capacity ? latency_capacity * 2 : 65536;
+    if ((latency = realloc(latency, latency_capacity * sizeof(int))) == NULL) {
+      fprintf(stderr, "rudp_bench: realloc failed\n");
+      exit(1);
+    }
+  }
+  latency[nlatency++] = (int) (now - ((u_int64_t) ntohl(hdr.sent[0]) << 32 | ntohl(hdr.sent[1])));
+  return 0;
+}
+
+/* recv_eventhandler: callback function for RUDP events of the receiver */
+int recv_eventhandler(rudp_socket_t rsocket, rudp_event_t event, struct sockaddr_in *remote) {
+  if (event == RUDP_EVENT_TIMEOUT) {
+    fprintf(stderr, "rudp_bench: receiver timed out\n");
+    exit(1);
+  }
+  return 0;
+}
+
+/* recv_report: print what the receiver saw of the run, and close its socket */
+void recv_report() {
+  struct rudp_stats st;
+  double secs = (recv_end - recv_start) / 1e6;
+  double cpu = cpu_seconds() - recv_cpu;
+
+  if (secs <= 0)
+    secs = 1e-6;
+  memset(&st, 0, sizeof(st));
+  rudp_get_stats(recv_sock, NULL, &st);
+  qsort(latency, nlatency, sizeof(int), compare_int);
+  printf("recv: %lld msgs %lld bytes in %.3f s: %.1f MB/s %.0f msgs/s %.0f pkts/s\n",
+         recv_msgs, recv_bytes, secs, recv_bytes / secs / 1e6, recv_msgs / secs,
+         st.packets_received / secs);
+  if (nlatency > 0) {
+    printf("recv: latency p50 %d us p99 %d us max %d us\n",
+           latency[nlatency / 2], latency[(int) (nlatency * 0.99)], latency[nlatency - 1]);
+  }
+  printf("recv: %llu duplicates %llu out of order, cpu %.3f s (%.2f s/GB)\n",
+         st.duplicates, st.out_of_order, cpu, recv_bytes > 0 ? cpu / (recv_bytes / 1e9) : 0);
+  if (check)
+    printf("recv: all %d sessions checked\n", expected);
+  fflush(stdout);
+  /* The socket closes once the senders' FINs are in, and the event loop returns */
+  rudp_close(recv_sock);
+}
+
+/*
+ * sender: run the sending sessions until all are closed, then report
+ */
+
+void sender(struct sockaddr_in *to) {
+  pthread_t thread;
+  double cpu;
+  double secs;
+  int i;
+
+  peer = *to;
+  if (tracefile != NULL && rudp_trace_open(tracefile, 0) < 0)
+    exit(1);
+  if ((msg = malloc(msgsize)) == NULL) {
+    fprintf(stderr, "rudp_bench: malloc failed\n");
+    exit(1);
+  }
+  memset(msg, 0x5a, msgsize);
+  for (i = 0; i < nsessions; i++) {
+    if ((bsessions[i].rsock = rudp_socket(0)) == NULL) {
+      fprintf(stderr, "rudp_bench: rudp_socket() failed\n");
+      exit(1);
+    }
+    setopts(bsessions[i].rsock, 1);
+    rudp_event_handler(bsessions[i].rsock, send_eventhandler);
+    if (post && (bsessions[i].postq = rudp_postq(bsessions[i].rsock)) == NULL) {
+      fprintf(stderr, "rudp_bench: rudp_postq() failed\n");
+      exit(1);
+    }
+  }
+  cpu = cpu_seconds();
+  send_start = now_usec();
+  if (post) {
+    if (pipe(postpipe) < 0 ||
+        event_fd(postpipe[0], posted, NULL, "posted") < 0 ||
+        pthread_create(&thread, NULL, producer, NULL) != 0) {
+      fprintf(stderr, "rudp_bench: can't start the producer\n");
+      exit(1);
+    }
+  }
+  else {
+    for (i = 0; i < nsessions; i++)
+      bench_send(&bsessions[i]);
+  }
+  eventloop(0);
+  if (post)
+    pthread_join(thread, NULL);
+  secs = (send_end - send_start) / 1e6;
+  cpu = cpu_seconds() - cpu;
+  if (secs <= 0)
+    secs = 1e-6;
+
+  printf("send: %d sessions x %lld bytes in %.3f s: %.1f MB/s %.0f msgs/s, cpu %.3f s (%.2f s/GB)\n",
+         nsessions, total, secs, nsessions * total / secs / 1e6,
+         nsessions * (double) ((total + msgsize - 1) / msgsize) / secs,
+         cpu, total > 0 ? cpu / (nsessions * total / 1e9) : 0);
+  fflush(stdout);
+  free(msg);
+}
+
+/*
+ * bench_msg: put the next message of a session into msg and return its
+ * length. In a checked run the sizes of the DATA messages vary up to
+ * msgsize, so that they take different numbers of packets
+ */
+int bench_msg(struct bsession *b, int type) {
+  struct bench_hdr *hdr = (struct bench_hdr *) msg;
+  u_int64_t now;
+  int len = sizeof(struct bench_hdr);
+  int i;
+
+  if (type == BENCH_DATA) {
+    len = check ? len + b->seq * 7919u % (msgsize - len + 1) : msgsize;
+    if (len > total - b->sent)
+      len = total - b->sent;
+    if (len < (int) sizeof(struct bench_hdr))
+      len = sizeof(struct bench_hdr);
+    for (i = sizeof(struct bench_hdr); check && i < len; i++)
+      msg[i] = BENCH_BYTE(b->seq, i);
+  }
+  hdr->type = htonl(type);
+  hdr->sessions = htonl(nsessions);
+  hdr->session = htonl(b - bsessions);
+  hdr->seq = htonl(b->seq);
+  now = now_usec();
+  hdr->sent[0] = htonl((u_int32_t) (now >> 32));
+  hdr->sent[1] = htonl((u_int32_t) now);
+  return len;
+}
+
+/* bench_send: send messages until the RUDP queue is full or the session is done */
+void bench_send(struct bsession *b) {
+  int len;
+  int ret;
+
+  while (!b->blocked && b->sent < total) {
+    len = bench_msg(b, BENCH_DATA);
+    if ((ret = rudp_sendto(b->rsock, msg, len, &peer)) < 0) {
+      fprintf(stderr, "rudp_bench: send failure\n");
+      exit(1);
+    }
+    b->sent += len;
+    b->seq++;
+    b->blocked = ret;
+  }
+  if (b->sent >= total && !b->done) {
+    /* All queued, END goes last */
+    len = bench_msg(b, BENCH_END);
+    if (rudp_sendto(b->rsock, msg, len, &peer) < 0) {
+      fprintf(stderr, "rudp_bench: send failure\n");
+      exit(1);
+    }
+    b->done = 1;
+    rudp_close(b->rsock);
+  }
+}
+
+/*
+ * producer: with -P, hand the messages of all sessions to their event loop
+ * with rudp_post(), a message of each in turn, and wait while a queue is full
+ */
+void *producer(void *arg) {
+  struct bsession *b;
+  int active = 1;
+  int type;
+  int len;
+  int i;
+
+  while (active) {
+    active = 0;
+    for (i = 0; i < nsessions; i++) {
+      b = &bsessions[i];
+      if (b->done)
+        continue;
+      active = 1;
+      type = b->sent < total ? BENCH_DATA : BENCH_END;
+      len = bench_msg(b, type);
+      while (rudp_post(b->postq, msg, len, &peer) < 0) {
+        if (errno != EAGAIN) {
+          fprintf(stderr, "rudp_bench: post failure\n");
+          exit(1);
+        }
+        usleep(100);
+      }
+      if (type == BENCH_END) {
+        b->done = 1;
+      }
+      else {
+        b->sent += len;
+        b->seq++;
+      }
+    }
+  }
+  if (write(postpipe[1], "", 1) != 1) {
+    fprintf(stderr, "rudp_bench: can't wake up the event loop\n");
+    exit(1);
+  }
+  return NULL;
+}
+
+/*
+ * posted: callback function for when the producer is done. The sockets
+ * send what is still in their queues before they close
+ */
+int posted(int fd, void *arg) {
+  char c;
+  int i;
+
+  if (read(fd, &c, 1) != 1)
+    return 0;
+  event_fd_delete(posted, NULL);
+  close(postpipe[0]);
+  close(postpipe[1]);
+  for (i = 0; i < nsessions; i++)
+    rudp_close(bsessions[i].rsock);
+  return 0;
+}
+
+/* send_eventhandler: callback function for RUDP events of the senders */
+int send_eventhandler(rudp_socket_t rsocket, rudp_event_t event, struct sockaddr_in *remote) {
+  int i;
+
+  switch (event) {
+  case RUDP_EVENT_TIMEOUT:
+    fprintf(stderr, "rudp_bench: sender timed out\n");
+    exit(1);
+    break;
+  case RUDP_EVENT_WRITABLE:
+    for (i = 0; i < nsessions && !post; i++) {
+      if (bsessions[i].rsock == rsocket) {
+        bsessions[i].blocked = 0;
+        bench_send(&bsessions[i]);
+        break;
+      }
+    }
+    break;
+  case RUDP_EVENT_CLOSED:
+    /* Everything of the session has been acknowledged */
+    if (++closed == nsessions)
+      send_end = now_usec();
+    break;
+  }
+  return 0;
+}
+
+/* compare_int: qsort() order of ints */
+static int compare_int(const void *a, const void *b) {
+  return *(const int *) a - *(const int *) b;
+}
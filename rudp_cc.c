@@ -0,0 +1,258 @@
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/time.h>
+
+#include "rudp.h"
+#include "rudp_cc.h"
+
+/** rudp_cc.c
+ *
+ * This file implements the congestion control algorithms for RUDP senders
+ */
+
+#define PACING_STARTUP_GAIN	2885	/* Pacing gain during startup, 2/ln(2), in thousandths */
+#define PACING_CWND_GAIN	2	/* Congestion window in multiples of the bandwidth-delay product */
+#define PACING_MINRTT_EXPIRY	10	/* Seconds after which min_rtt is replaced by a new sample */
+#define PACING_BURST	1000	/* Microseconds of sending a paced sender may catch up on at once */
+
+/* Pacing gains in steady state, one per round, in thousandths */
+static const int pacing_gain_cycle[] = {1250, 750, 1000, 1000, 1000, 1000, 1000, 1000};
+
+/* Prototypes */
+int cc_usec_between(struct timeval *from, struct timeval *to);
+void cc_none_init(struct rudp_cc *cc);
+void cc_none_on_ack(struct rudp_cc *cc, u_int32_t ackno, int acked, int rtt, struct timeval *now);
+void cc_none_on_loss(struct rudp_cc *cc, u_int32_t seqno, u_int32_t next_seqno, int inflight, int timeout);
+int cc_none_can_send(struct rudp_cc *cc, int inflight, struct timeval *now, struct timeval *when);
+void cc_none_on_send(struct rudp_cc *cc, struct timeval *now);
+void newreno_init(struct rudp_cc *cc);
+void newreno_on_ack(struct rudp_cc *cc, u_int32_t ackno, int acked, int rtt, struct timeval *now);
+void newreno_on_loss(struct rudp_cc *cc, u_int32_t seqno, u_int32_t next_seqno, int inflight, int timeout);
+int cc_window_can_send(struct rudp_cc *cc, int inflight, struct timeval *now, struct timeval *when);
+void pacing_init(struct rudp_cc *cc);
+int pacing_bw(struct rudp_cc *cc);
+int pacing_rate(struct rudp_cc *cc);
+void pacing_on_ack(struct rudp_cc *cc, u_int32_t ackno, int acked, int rtt, struct timeval *now);
+void pacing_on_loss(struct rudp_cc *cc, u_int32_t seqno, u_int32_t next_seqno, int inflight, int timeout);
+int pacing_can_send(struct rudp_cc *cc, int inflight, struct timeval *now, struct timeval *when);
+void pacing_on_send(struct rudp_cc *cc, struct timeval *now);
+
+const struct rudp_cc_ops rudp_cc_none = {
+  "none", cc_none_init, cc_none_on_ack, cc_none_on_loss, cc_none_can_send, cc_none_on_send
+};
+const struct rudp_cc_ops rudp_cc_newreno = {
+  "newreno", newreno_init, newreno_on_ack, newreno_on_loss, cc_window_can_send, cc_none_on_send
+};
+const struct rudp_cc_ops rudp_cc_pacing = {
+  "pacing", pacing_init, pacing_on_ack, pacing_on_loss, pacing_can_send, pacing_on_send
+};
+
+/* Returns the microseconds from one time to another */
+int cc_usec_between(struct timeval *from, struct timeval *to) {
+  return (to->tv_sec - from->tv_sec) * 1000000 + (to->tv_usec - from->tv_usec);
+}
+
+/*
+ * No congestion control: only the sliding window limits the sender
+ */
+
+void cc_none_init(struct rudp_cc *cc) {
+  const struct rudp_cc_ops *ops = cc->ops;
+  memset(cc, 0, sizeof(struct rudp_cc));
+  cc->ops = ops;
+  cc->cwnd = RUDP_MAXWINDOW;
+}
+void cc_none_on_ack(struct rudp_cc *cc, u_int32_t ackno, int acked, int rtt, struct timeval *now) {
+}
+void cc_none_on_loss(struct rudp_cc *cc, u_int32_t seqno, u_int32_t next_seqno, int inflight, int timeout) {
+}
+int cc_none_can_send(struct rudp_cc *cc, int inflight, struct timeval *now, struct timeval *when) {
+  return 1;
+}
+void cc_none_on_send(struct rudp_cc *cc, struct timeval *now) {
+}
+
+/* A new packet may be sent if there is room in the congestion window */
+int cc_window_can_send(struct rudp_cc *cc, int inflight, struct timeval *now, struct timeval *when) {
+  if(inflight < cc->cwnd) {
+    return 1;
+  }
+  timerclear(when);
+  return 0;
+}
+
+/*
+ * NewReno: slow start, then one more packet per window of ACKs. A loss halves
+ * the window once per window of data, a timeout shrinks it to one packet and
+ * slow starts again
+ */
+
+void newreno_init(struct rudp_cc *cc) {
+  cc_none_init(cc);
+  cc->cwnd = RUDP_CC_INITWINDOW;
+  cc->ssthresh = RUDP_MAXWINDOW;
+}
+void newreno_on_ack(struct rudp_cc *cc, u_int32_t ackno, int acked, int rtt, struct timeval *now) {
+  if(cc->in_recovery) {
+    if(SEQ_LT(ackno, cc->recover)) {
+      return; /* Still repairing the loss, the window does not grow */
+    }
+    cc->in_recovery = 0;
+    cc->cwnd_acked = 0;
+    return;
+  }
+  if(cc->cwnd < cc->ssthresh) {
+    /* Slow start */
+    cc->cwnd += acked;
+    if(cc->cwnd > cc->ssthresh) {
+      cc->cwnd = cc->ssthresh;
+    }
+  }
+  else {
+    /* Congestion avoidance */
+    cc->cwnd_acked += acked;
+    while(cc->cwnd_acked >= cc->cwnd) {
+      cc->cwnd_acked -= cc->cwnd;
+      cc->cwnd++;
+    }
+  }
+  if(cc->cwnd > RUDP_MAXWINDOW) {
+    cc->cwnd = RUDP_MAXWINDOW;
+  }
+}
+void newreno_on_loss(struct rudp_cc *cc, u_int32_t seqno, u_int32_t next_seqno, int inflight, int timeout) {
+  if(!cc->in_recovery || SEQ_GEQ(seqno, cc->recover)) {
+    /* A new congestion event */
+    cc->ssthresh = inflight / 2;
+    if(cc->ssthresh < RUDP_CC_MINWINDOW) {
+      cc->ssthresh = RUDP_CC_MINWINDOW;
+    }
+    cc->cwnd = cc->ssthresh;
+    cc->cwnd_acked = 0;
+    cc->in_recovery = 1;
+    cc->recover = next_seqno;
+  }
+  if(timeout) {
+    /* Slow start again from one packet. As in RFC 6582, a timeout ends the
+     * recovery, so that the window grows with the next ACK */
+    cc->cwnd = 1;
+    cc->in_recovery = 0;
+  }
+}
+
+/*
+ * Pacing: estimates the bottleneck bandwidth as the highest delivery rate of
+ * the last RUDP_CC_BWROUNDS rounds and the path delay as the smallest RTT, and
+ * spaces packets out at that bandwidth times a gain. During startup the gain
+ * is high enough to double the rate every round, until the bandwidth estimate
+ * stops growing. Afterwards it cycles to probe for more bandwidth and drain
+ * the queue that caused. The congestion window is a multiple of the
+ * bandwidth-delay product, so that the queue at the bottleneck stays short
+ */
+
+void pacing_init(struct rudp_cc *cc) {
+  cc_none_init(cc);
+  cc->cwnd = RUDP_CC_INITWINDOW;
+}
+
+/* Returns the bottleneck bandwidth estimate in packets per second, 0 if unknown */
+int pacing_bw(struct rudp_cc *cc) {
+  int i, bw = 0;
+  for(i = 0; i < RUDP_CC_BWROUNDS; i++) {
+    if(cc->bw[i] > bw) {
+      bw = cc->bw[i];
+    }
+  }
+  return bw;
+}
+
+/* Returns the pacing rate in packets per second, 0 for no pacing */
+int pacing_rate(struct rudp_cc *cc) {
+  int gain = cc->filled_pipe ? pacing_gain_cycle[cc->round % 8] : PACING_STARTUP_GAIN;
+  return (long long)pacing_bw(cc) * gain / 1000;
+}
+void pacing_on_ack(struct rudp_cc *cc, u_int32_t ackno, int acked, int rtt, struct timeval *now) {
+  if(rtt > 0 && (cc->min_rtt == 0 || rtt <= cc->min_rtt ||
+                 now->tv_sec - cc->min_rtt_time.tv_sec > PACING_MINRTT_EXPIRY)) {
+    cc->min_rtt = rtt;
+    cc->min_rtt_time = *now;
+  }
+
+  cc->round_delivered += acked;
+  if(!timerisset(&cc->round_start)) {
+    cc->round_start = *now;
+  }
+  int elapsed = cc_usec_between(&cc->round_start, now);
+  if(cc->min_rtt > 0 && elapsed >= cc->min_rtt) {
+    /* End of the round: take a delivery rate sample */
+    cc->round++;
+    cc->bw[cc->round % RUDP_CC_BWROUNDS] = (long long)cc->round_delivered * 1000000 / elapsed;
+    cc->round_delivered = 0;
+    cc->round_start = *now;
+
+    int bw = pacing_bw(cc);
+    if(!cc->filled_pipe) {
+      if(bw >= cc->full_bw + cc->full_bw / 4) {
+        cc->full_bw = bw;
+        cc->full_bw_rounds = 0;
+      }
+      else if(++cc->full_bw_rounds >= 3) {
+        cc->filled_pipe = 1;
+      }
+    }
+  }
+
+  if(!cc->filled_pipe) {
+    cc->cwnd += acked;
+  }
+  else {
+    int bdp = (long long)pacing_bw(cc) * cc->min_rtt / 1000000;
+    cc->cwnd = PACING_CWND_GAIN * bdp;
+  }
+  if(cc->cwnd < RUDP_CC_INITWINDOW) {
+    cc->cwnd = RUDP_CC_INITWINDOW;
+  }
+  if(cc->cwnd > RUDP_MAXWINDOW) {
+    cc->cwnd = RUDP_MAXWINDOW;
+  }
+}
+void pacing_on_loss(struct rudp_cc *cc, u_int32_t seqno, u_int32_t next_seqno, int inflight, int timeout) {
+  /* Loss alone does not indicate congestion, but after a timeout the
+   * bandwidth estimate is rebuilt from scratch */
+  if(timeout) {
+    memset(cc->bw, 0, sizeof(cc->bw));
+    cc->round_delivered = 0;
+    timerclear(&cc->round_start);
+    cc->cwnd = RUDP_CC_INITWINDOW;
+  }
+}
+int pacing_can_send(struct rudp_cc *cc, int inflight, struct timeval *now, struct timeval *when) {
+  if(!cc_window_can_send(cc, inflight, now, when)) {
+    return 0;
+  }
+  if(pacing_rate(cc) > 0 && timercmp(now, &cc->next_send, <)) {
+    *when = cc->next_send;
+    return 0;
+  }
+  return 1;
+}
+void pacing_on_send(struct rudp_cc *cc, struct timeval *now) {
+  int rate = pacing_rate(cc);
+  if(rate <= 0) {
+    return;
+  }
+  /* A sender which fell behind, e.g. because of timer granularity, may
+   * catch up on at most PACING_BURST microseconds of packets */
+  struct timeval burst, earliest, interval;
+  burst.tv_sec = 0;
+  burst.tv_usec = PACING_BURST;
+  timersub(now, &burst, &earliest);
+  if(timercmp(&cc->next_send, &earliest, <)) {
+    cc->next_send = earliest;
+  }
+  int usec = 1000000 / rate;
+  interval.tv_sec = usec / 1000000;
+  interval.tv_usec = usec % 1000000;
+  timeradd(&cc->next_send, &interval, &cc->next_send);
+}
@@ -0,0 +1,64 @@
+#ifndef RUDP_CC_H
+#define RUDP_CC_H
+
+#include <sys/types.h>
+#include <sys/time.h>
+
+/** rudp_cc.h
+ *
+ * Congestion control for RUDP sender sessions. Each algorithm is a table of
+ * callbacks, which rudp.c calls from the send and ACK paths. The number of
+ * packets in flight is the number of packets in the sliding window.
+ */
+
+#define RUDP_CC_INITWINDOW	4	/* Initial congestion window in packets */
+#define RUDP_CC_MINWINDOW	2	/* Congestion window after a loss is at least this */
+#define RUDP_CC_BWROUNDS	10	/* Number of rounds the pacing bandwidth estimate is taken over */
+
+struct rudp_cc_ops;
+
+/* Congestion control state of a sender session */
+struct rudp_cc {
+  const struct rudp_cc_ops *ops;
+  int cwnd; /* Congestion window, max. number of packets in flight */
+
+  /* NewReno */
+  int ssthresh; /* Slow start threshold in packets */
+  int cwnd_acked; /* Packets acknowledged since cwnd last grew in congestion avoidance */
+  int in_recovery; /* Has cwnd been reduced for a loss which is not yet repaired? */
+  u_int32_t recover; /* Losses before this seqno belong to the current recovery */
+
+  /* Pacing */
+  struct timeval next_send; /* Earliest time the next packet may be sent */
+  int min_rtt; /* Smallest RTT sample in microseconds, 0 if there is none */
+  struct timeval min_rtt_time; /* When min_rtt was taken */
+  int bw[RUDP_CC_BWROUNDS]; /* Delivery rate of the last rounds in packets per second */
+  int round; /* Number of the current round, which lasts min_rtt */
+  int round_delivered; /* Packets acknowledged in the current round */
+  struct timeval round_start;
+  int full_bw; /* Bandwidth estimate when it last grew by 25% during startup */
+  int full_bw_rounds; /* Rounds since then */
+  int filled_pipe; /* Has startup ended? */
+};
+
+struct rudp_cc_ops {
+  const char *name;
+  void (*init)(struct rudp_cc *cc);
+  /* An ACK up to ackno acknowledged acked more packets. rtt is an RTT sample in
+   * microseconds, or -1 */
+  void (*on_ack)(struct rudp_cc *cc, u_int32_t ackno, int acked, int rtt, struct timeval *now);
+  /* The packet seqno is retransmitted after a timeout or duplicate ACKs, with
+   * inflight packets in flight and next_seqno the next new sequence number */
+  void (*on_loss)(struct rudp_cc *cc, u_int32_t seqno, u_int32_t next_seqno, int inflight, int timeout);
+  /* Returns nonzero if a new packet may be sent now. Otherwise, *when is the
+   * time at which it may be sent, or is cleared if an ACK must arrive first */
+  int (*can_send)(struct rudp_cc *cc, int inflight, struct timeval *now, struct timeval *when);
+  /* A new packet has been sent */
+  void (*on_send)(struct rudp_cc *cc, struct timeval *now);
+};
+
+extern const struct rudp_cc_ops rudp_cc_none; /* Flow control by the window only */
+extern const struct rudp_cc_ops rudp_cc_newreno; /* Loss-based AIMD, as TCP NewReno */
+extern const struct rudp_cc_ops rudp_cc_pacing; /* Paced at the estimated bottleneck bandwidth, BBR style */
+
+#endif /* RUDP_CC_H */
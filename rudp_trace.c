@@ -0,0 +1,125 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/mman.h>
+#include <netinet/in.h>
+
+#include "rudp_api.h"
+#include "rudp_trace.h"
+
+/** rudp_trace.c
+ *
+ * This file implements the ring buffer trace of RUDP and the event loop
+ */
+
+/* Prototypes */
+struct rudp_trace_record *trace_next();
+void trace_publish();
+
+__thread struct rudp_trace *rudp_tracer = NULL;
+
+int rudp_trace_open(const char *path, int records) {
+  if(rudp_tracer != NULL) {
+    rudp_trace_close();
+  }
+  if(records <= 0) {
+    records = RUDP_TRACERECORDS;
+  }
+  u_int32_t n = 1;
+  while(n < records && n < (1U << 30) / sizeof(struct rudp_trace_record)) {
+    n <<= 1;
+  }
+
+  struct rudp_trace *t = malloc(sizeof(struct rudp_trace));
+  if(t == NULL) {
+    fprintf(stderr, "rudp_trace_open: Error allocating memory\n");
+    return -1;
+  }
+  t->size = sizeof(struct rudp_trace_header) + n * sizeof(struct rudp_trace_record);
+  if((t->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
+    perror("rudp_trace_open: open");
+    free(t);
+    return -1;
+  }
+  if(ftruncate(t->fd, t->size) < 0) {
+    perror("rudp_trace_open: ftruncate");
+    close(t->fd);
+    free(t);
+    return -1;
+  }
+  /* Shared, so that the records reach the file even if the process dies */
+  void *map = mmap(NULL, t->size, PROT_READ | PROT_WRITE, MAP_SHARED, t->fd, 0);
+  if(map == MAP_FAILED) {
+    perror("rudp_trace_open: mmap");
+    close(t->fd);
+    free(t);
+    return -1;
+  }
+  t->header = map;
+  t->ring = (struct rudp_trace_record *)(t->header + 1);
+  t->head = 0;
+  t->mask = n - 1;
+  memcpy(t->header->magic, RUDP_TRACEMAGIC, sizeof(t->header->magic));
+  t->header->version = RUDP_TRACEVERSION;
+  t->header->records = n;
+  t->header->head = 0;
+  rudp_tracer = t;
+  return 0;
+}
+
+int rudp_trace_close() {
+  struct rudp_trace *t = rudp_tracer;
+  if(t == NULL) {
+    return 0;
+  }
+  rudp_tracer = NULL;
+  munmap(t->header, t->size);
+  close(t->fd);
+  free(t);
+  return 0;
+}
+
+/* Returns the record to fill in next, with the time set */
+struct rudp_trace_record *trace_next() {
+  struct rudp_trace *t = rudp_tracer;
+  struct rudp_trace_record *r = &t->ring[t->head & t->mask];
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  r->usec = (u_int64_t)now.tv_sec * 1000000 + now.tv_usec;
+  return r;
+}
+
+/* Makes the record filled in last visible to readers of the file */
+void trace_publish() {
+  struct rudp_trace *t = rudp_tracer;
+  t->head++;
+  __atomic_store_n(&t->header->head, t->head, __ATOMIC_RELEASE);
+}
+
+void rudp_trace_packet(u_int16_t event, int fd, int arg, u_int16_t type, u_int32_t seqno, u_int16_t length,
+                       struct sockaddr_in *peer) {
+  struct rudp_trace_record *r = trace_next();
+  r->event = event;
+  r->type = type;
+  r->u.pkt.seqno = seqno;
+  r->u.pkt.addr = peer->sin_addr.s_addr;
+  r->u.pkt.port = peer->sin_port;
+  r->u.pkt.length = length;
+  r->arg = arg;
+  r->fd = fd;
+  trace_publish();
+}
+
+void rudp_trace_event(u_int16_t event, int fd, int arg, const char *name) {
+  struct rudp_trace_record *r = trace_next();
+  r->event = event;
+  r->type = 0;
+  strncpy(r->u.name, name != NULL ? name : "", RUDP_TRACENAME);
+  r->arg = arg;
+  r->fd = fd;
+  trace_publish();
+}
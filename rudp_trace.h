@@ -0,0 +1,92 @@
+#ifndef RUDP_TRACE_H
+#define RUDP_TRACE_H
+
+#include <sys/types.h>
+#include <netinet/in.h>
+
+/** rudp_trace.h
+ *
+ * Binary trace of the packets sent and received, the retransmission timeouts
+ * and the dispatching of the event loop. Each thread, and so each event loop,
+ * traces into a file of its own, which is mapped into memory and used as a
+ * ring of fixed-size records. Only the thread itself writes to it, so no
+ * locks are taken; the number of records written is published after each
+ * record, so that rudp_tracedump can read the file while it is written.
+ * When tracing is off, each trace point costs one test of a thread local
+ * pointer. Defining RUDP_NOTRACE compiles them out altogether.
+ */
+
+#define RUDP_TRACEMAGIC	"RUDPTRC"
+#define RUDP_TRACEVERSION	1
+#define RUDP_TRACERECORDS	65536	/* Default number of records in the ring */
+#define RUDP_TRACENAME	12	/* Bytes of a callback name kept in a record */
+
+/* Record types */
+#define RUDP_TRACE_SEND	1	/* send_packet(). arg is RUDP_TRACE_DROPPED, RUDP_TRACE_HELD or 0 */
+#define RUDP_TRACE_RECV	2	/* A well-formed packet came in */
+#define RUDP_TRACE_TIMEOUT	3	/* timeout_callback(). arg is the number of packets in the window */
+#define RUDP_TRACE_WAIT	4	/* The event loop waits. arg is the timeout in ms, or -1 */
+#define RUDP_TRACE_FD	5	/* A file descriptor callback is dispatched */
+#define RUDP_TRACE_TIMER	6	/* A timer callback is dispatched. arg is how many ms late it is */
+
+#define RUDP_TRACE_DROPPED	1	/* Dropped by DROP or the emulation */
+#define RUDP_TRACE_HELD	2	/* Held back by the emulation, to be sent later */
+
+/* A trace record. For packets, type is the packet type and fd the socket;
+ * for the event loop, fd is the descriptor dispatched, if any */
+struct rudp_trace_record {
+  u_int64_t usec; /* Time of day in microseconds */
+  u_int16_t event; /* RUDP_TRACE_* */
+  u_int16_t type;
+  union {
+    struct {
+      u_int32_t seqno;
+      u_int32_t addr; /* Peer, in network byte order */
+      u_int16_t port;
+      u_int16_t length; /* Payload bytes */
+    } pkt;
+    char name[RUDP_TRACENAME]; /* Callback, not NUL terminated if it is as long */
+  } u;
+  int32_t arg;
+  int32_t fd;
+};
+
+/* The trace file: this header, then the ring of records */
+struct rudp_trace_header {
+  char magic[8];
+  u_int32_t version;
+  u_int32_t records; /* Size of the ring, a power of two */
+  u_int64_t head; /* Number of records written; the next goes to head % records */
+  char pad[40]; /* Keeps the records 64-byte aligned */
+};
+
+struct rudp_trace {
+  struct rudp_trace_header *header;
+  struct rudp_trace_record *ring;
+  u_int64_t head;
+  u_int32_t mask;
+  size_t size; /* Bytes mapped */
+  int fd;
+};
+
+extern __thread struct rudp_trace *rudp_tracer; /* Trace of this thread, NULL when off */
+
+void rudp_trace_packet(u_int16_t event, int fd, int arg, u_int16_t type, u_int32_t seqno, u_int16_t length,
+                       struct sockaddr_in *peer);
+void rudp_trace_event(u_int16_t event, int fd, int arg, const char *name);
+
+#ifndef RUDP_NOTRACE
+#define RUDP_TRACE_PACKET(...) do { \
+    if(rudp_tracer != NULL) \
+      rudp_trace_packet(__VA_ARGS__); \
+  } while(0)
+#define RUDP_TRACE_EVENT(...) do { \
+    if(rudp_tracer != NULL) \
+      rudp_trace_event(__VA_ARGS__); \
+  } while(0)
+#else
+#define RUDP_TRACE_PACKET(...) do { } while(0)
+#define RUDP_TRACE_EVENT(...) do { } while(0)
+#endif
+
+#endif /* RUDP_TRACE_H */
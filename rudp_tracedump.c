@@ -0,0 +1,236 @@
+/*
+ * rudp_tracedump: Print the records of RUDP trace files, as written after
+ * rudp_trace_open(), as a timeline. A file may be dumped while the process
+ * is still tracing into it.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "rudp.h"
+#include "rudp_trace.h"
+
+#define DUMP_MAXPEERS 1024  /* Peers whose DATA seqnos are followed to spot retransmissions */
+
+/* Highest DATA seqno sent to a peer from a socket */
+struct dpeer {
+  int fd;
+  u_int32_t addr;
+  u_int16_t port;
+  u_int32_t seqno;
+};
+
+/* Prototypes */
+int usage();
+int dump(char *path);
+void print_record(struct rudp_trace_record *r);
+const char *type_name(u_int16_t type);
+int retransmitted(struct rudp_trace_record *r);
+
+/* Options */
+int relative = 0;  /* Print times relative to the first record */
+
+struct dpeer dpeers[DUMP_MAXPEERS];
+int ndpeers = 0;
+u_int64_t first_usec = 0;
+u_int64_t last_usec = 0;
+
+/* usage: how to use program */
+int usage() {
+  fprintf(stderr, "Usage: rudp_tracedump [-r] tracefile...\n");
+  exit(1);
+}
+
+int main(int argc, char* argv[]) {
+  int c;
+  int ret = 0;
+
+  opterr = 0;
+  while ((c = getopt(argc, argv, "r")) != -1) {
+    if (c == 'r')
+      relative = 1;
+    else
+      usage();
+  }
+  if (optind == argc)
+    usage();
+  for (; optind < argc; optind++) {
+    if (dump(argv[optind]) < 0)
+      ret = 1;
+  }
+  return ret;
+}
+
+/*
+ * dump: print the records which are in the ring of a trace file, oldest
+ * first. The ring is copied and the number of records written read again
+ * afterwards, so that records overwritten meanwhile are left out
+ */
+
+int dump(char *path) {
+  struct rudp_trace_header *header;
+  struct rudp_trace_record *ring, *copy;
+  struct stat st;
+  u_int64_t head, after, first, i;
+  u_int32_t n;
+  void *map;
+  int fd;
+
+  if ((fd = open(path, O_RDONLY)) < 0) {
+    perror(path);
+    return -1;
+  }
+  if (fstat(fd, &st) < 0 || st.st_size < sizeof(struct rudp_trace_header)) {
+    fprintf(stderr, "%s: not a trace file\n", path);
+    close(fd);
+    return -1;
+  }
+  if ((map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+    perror(path);
+    close(fd);
+    return -1;
+  }
+  close(fd);
+  header = map;
+  n = header->records;
+  if (memcmp(header->magic, RUDP_TRACEMAGIC, sizeof(header->magic)) != 0 ||
+      header->version != RUDP_TRACEVERSION || n == 0 || (n & (n - 1)) != 0 ||
+      st.st_size < sizeof(struct rudp_trace_header) + (off_t) n * sizeof(struct rudp_trace_record)) {
+    fprintf(stderr, "%s: not a trace file of version %d\n", path, RUDP_TRACEVERSION);
+    munmap(map, st.st_size);
+    return -1;
+  }
+  ring = (struct rudp_trace_record *) (header + 1);
+  if ((copy = malloc(n * sizeof(struct rudp_trace_record))) == NULL) {
+    fprintf(stderr, "rudp_tracedump: malloc failed\n");
+    exit(1);
+  }
+
+  head = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+  memcpy(copy, ring, n * sizeof(struct rudp_trace_record));
+  after = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+  munmap(map, st.st_size);
+
+  /* The writer may be filling in record after, which takes the slot of after - n */
+  first = head > n ? head - n : 0;
+  if (after + 1 > n && first < after + 1 - n)
+    first = after + 1 - n;
+  printf("%s: %llu records, %llu in the ring\n", path, (unsigned long long) head,
+         (unsigned long long) (head > first ? head - first : 0));
+  first_usec = 0;
+  ndpeers = 0;
+  for (i = first; i < head; i++)
+    print_record(&copy[i & (n - 1)]);
+  free(copy);
+  return 0;
+}
+
+/* print_record: one line of the timeline, with the time since the line before */
+void print_record(struct rudp_trace_record *r) {
+  struct in_addr addr;
+  char name[RUDP_TRACENAME + 1];
+  struct tm tm;
+  time_t secs;
+
+  if (first_usec == 0)
+    first_usec = last_usec = r->usec;
+  if (relative) {
+    printf("%10.6f", (r->usec - first_usec) / 1e6);
+  }
+  else {
+    secs = r->usec / 1000000;
+    localtime_r(&secs, &tm);
+    printf("%02d:%02d:%02d.%06d", tm.tm_hour, tm.tm_min, tm.tm_sec, (int) (r->usec % 1000000));
+  }
+  printf(" %+8lld ", (long long) (r->usec - last_usec));
+  last_usec = r->usec;
+
+  addr.s_addr = r->u.pkt.addr;
+  memcpy(name, r->u.name, RUDP_TRACENAME);
+  name[RUDP_TRACENAME] = '\0';
+  switch (r->event) {
+  case RUDP_TRACE_SEND:
+    printf("fd %d SEND %s seq %u len %u to %s:%d", r->fd, type_name(r->type), r->u.pkt.seqno,
+           r->u.pkt.length, inet_ntoa(addr), ntohs(r->u.pkt.port));
+    if (r->arg != RUDP_TRACE_HELD && retransmitted(r))
+      printf(" again");
+    if (r->arg == RUDP_TRACE_DROPPED)
+      printf(" dropped");
+    else if (r->arg == RUDP_TRACE_HELD)
+      printf(" held");
+    printf("\n");
+    break;
+  case RUDP_TRACE_RECV:
+    printf("fd %d RECV %s seq %u len %u from %s:%d\n", r->fd, type_name(r->type), r->u.pkt.seqno,
+           r->u.pkt.length, inet_ntoa(addr), ntohs(r->u.pkt.port));
+    break;
+  case RUDP_TRACE_TIMEOUT:
+    printf("fd %d TIMEOUT %s seq %u peer %s:%d window %d\n", r->fd, type_name(r->type), r->u.pkt.seqno,
+           inet_ntoa(addr), ntohs(r->u.pkt.port), r->arg);
+    break;
+  case RUDP_TRACE_WAIT:
+    if (r->arg >= 0)
+      printf("WAIT up to %d ms\n", r->arg);
+    else
+      printf("WAIT\n");
+    break;
+  case RUDP_TRACE_FD:
+    printf("FD %d %s\n", r->fd, name);
+    break;
+  case RUDP_TRACE_TIMER:
+    printf("TIMER %s late %d ms\n", name, r->arg);
+    break;
+  default:
+    printf("unknown record %u\n", r->event);
+  }
+}
+
+/* type_name: name of a packet type */
+const char *type_name(u_int16_t type) {
+  switch (type) {
+  case RUDP_DATA:
+    return "DATA";
+  case RUDP_ACK:
+    return "ACK";
+  case RUDP_SYN:
+    return "SYN";
+  case RUDP_FIN:
+    return "FIN";
+  case RUDP_PROBE:
+    return "PROBE";
+  default:
+    return "BAD";
+  }
+}
+
+/* retransmitted: has DATA with this or a later seqno been sent to the peer before? */
+int retransmitted(struct rudp_trace_record *r) {
+  int i;
+
+  if (r->type != RUDP_DATA)
+    return 0;
+  for (i = 0; i < ndpeers; i++) {
+    if (dpeers[i].fd == r->fd && dpeers[i].addr == r->u.pkt.addr && dpeers[i].port == r->u.pkt.port) {
+      if (SEQ_LEQ(r->u.pkt.seqno, dpeers[i].seqno))
+        return 1;
+      dpeers[i].seqno = r->u.pkt.seqno;
+      return 0;
+    }
+  }
+  if (ndpeers < DUMP_MAXPEERS) {
+    dpeers[ndpeers].fd = r->fd;
+    dpeers[ndpeers].addr = r->u.pkt.addr;
+    dpeers[ndpeers].port = r->u.pkt.port;
+    dpeers[ndpeers].seqno = r->u.pkt.seqno;
+    ndpeers++;
+  }
+  return 0;
+}
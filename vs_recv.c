@@ -16,10 +16,14 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <pthread.h>
 #include "rudp_api.h" 
 #include "event.h" 
 #include "vsftp.h"
 
+#define VS_WRITEBUF (256 * 1024)  /* Bytes of file data collected per write() */
+#define VS_WRITEMAX (4 * VS_WRITEBUF)  /* Bytes handed to the writer before receivers pause */
+
 /*
  * Data structure for keeping track of partially received files 
  */
@@ -30,7 +34,35 @@ struct rxfile {
   int fd;    /* File descriptor */
   struct sockaddr_in remote;  /* Peer */
   char name[VS_FILENAMELENGTH+1]; /* Name of file */
+  char *buf;    /* File data not yet handed to the writer */
+  int buflen;    /* Number of bytes in buf */
+};
 
+/*
+ * A job for the writer thread: write len bytes of buf to fd, and if 
+ * last is set, close the file. Jobs are done in the order they come in
+ */
+
+struct wjob {
+  struct wjob *next;
+  int fd;
+  char *buf;
+  int len;
+  int last;    /* 0, or what the file ends with: VS_TYPE_END, or 1 if aborted */
+  char name[VS_FILENAMELENGTH+1];
+};
+
+/*
+ * A receiver thread, as the writer sees it. While the writer is behind, 
+ * the thread stops reading its socket, and the writer wakes it through the
+ * pipe once there is room again
+ */
+
+struct rxthread {
+  struct rxthread *next;
+  rudp_socket_t rsock;
+  int wakeup[2];  /* Pipe the writer writes a byte into */
+  int paused;    /* Waiting for the writer, under wjobs_lock */
 };
 
 /* 
@@ -41,25 +73,46 @@ int filesender(int fd, void *arg);
 int rudp_receiver(rudp_socket_t rsocket, struct sockaddr_in *remote, char *buf, int len);
 int eventhandler(rudp_socket_t rsocket, rudp_event_t event, struct sockaddr_in *remote);
 int usage();
+void *receiver(void *arg);
+void *writer(void *arg);
+static void rxwrite(struct rxfile *rx, int last);
+static int rxwakeup(int fd, void *arg);
 
 /* 
  * Global variables 
  */
 int debug = 0;    /* Print debug messages */
-struct rxfile *rxhead = NULL;  /* Pointer to linked list of rxfiles */
+int window = 0;   /* RUDP window size, 0 for the default */
+int offload = 0;  /* Use UDP GSO/GRO */
+int delack = 0;   /* DATA packets per ACK, 0 for the default */
+int threads = 1;  /* Number of receiver threads, each with a socket and event loop */
+int noreplay = 0;  /* Ignore replayed SYNs */
+int idle = 0;  /* Milliseconds after which a silent sender is dropped, 0 for never */
+int maxsessions = 0;  /* Max. number of RUDP sessions per socket, 0 for no limit */
+char *tracefile = NULL;  /* Trace RUDP into this file, one per thread with -t */
+int tracethreads = 0;  /* Number of receiver threads which have opened a trace */
+__thread struct rxfile *rxhead = NULL;  /* Pointer to linked list of rxfiles of this thread */
+struct wjob *wjobs = NULL;  /* Queue of jobs for the writer thread */
+struct wjob **wjobs_tail = &wjobs;
+pthread_mutex_t wjobs_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t wjobs_cond = PTHREAD_COND_INITIALIZER;
+int wjobs_bytes = 0;  /* Bytes of the jobs queued or being written */
+struct rxthread *rxthreads = NULL;  /* All receiver threads, under wjobs_lock */
+__thread struct rxthread *rxself = NULL;  /* This receiver thread */
 
 /* 
  * usage: how to use program
  */
 
 int usage() {
-  fprintf(stderr, "Usage: vs_recv [-d] port\n");
+  fprintf(stderr, "Usage: vs_recv [-d] [-v] [-w window] [-a packets-per-ack] [-g] [-r] [-i idle-ms] [-s max-sessions] [-t threads] [-T tracefile] port\n");
   exit(1);
 }
 
 int main(int argc, char* argv[]) {
-  rudp_socket_t rsock;
+  pthread_t thread;
   int port;
+  int i;
 
   int c;
 
@@ -68,10 +121,39 @@ int main(int argc, char* argv[]) {
    */
   opterr = 0;
 
-  while ((c = getopt(argc, argv, "d")) != -1) {
+  while ((c = getopt(argc, argv, "dvw:a:gri:s:t:T:")) != -1) {
   if (c == 'd') {
     debug = 1;
   }
+  else if (c == 'v') {
+    rudp_set_log_level(RUDP_LOG_DEBUG);
+  }
+  else if (c == 'w') {
+    window = atoi(optarg);
+  }
+  else if (c == 'a') {
+    delack = atoi(optarg);
+  }
+  else if (c == 'g') {
+    offload = 1;
+  }
+  else if (c == 'r') {
+    noreplay = 1;
+  }
+  else if (c == 'i') {
+    idle = atoi(optarg);
+  }
+  else if (c == 's') {
+    maxsessions = atoi(optarg);
+  }
+  else if (c == 't') {
+    threads = atoi(optarg);
+    if (threads < 1)
+      usage();
+  }
+  else if (c == 'T') {
+    tracefile = optarg;
+  }
   else 
     usage();
   }
@@ -89,11 +171,57 @@ int main(int argc, char* argv[]) {
   printf("RUDP receiver waiting on port %i.\n",port);
   }
 
+  /*
+   * Start the writer, so that no receiver waits for the disk, then the 
+   * other receiver threads, and be one ourselves
+   */
+
+  if (pthread_create(&thread, NULL, writer, NULL) != 0) {
+  fprintf(stderr,"vs_recv: pthread_create() failed\n");
+  exit(1);
+  }
+
+  for (i = 1; i < threads; i++) {
+  if (pthread_create(&thread, NULL, receiver, &port) != 0) {
+    fprintf(stderr,"vs_recv: pthread_create() failed\n");
+    exit(1);
+  }
+  }
+  receiver(&port);
+
+  return (0);
+}
+
+/*
+ * receiver: create a RUDP listener socket on the port and run an event
+ * loop for it. With several threads, each has a socket on the same port
+ */
+
+void *receiver(void *arg) {
+  rudp_socket_t rsock;
+  int port = *(int *) arg;
+  char path[FILENAME_MAX];
+
+  /*
+   * Trace this thread's event loop into a file of its own
+   */
+
+  if (tracefile != NULL) {
+  if (threads > 1) {
+    snprintf(path, sizeof(path), "%s.%d", tracefile, __sync_fetch_and_add(&tracethreads, 1));
+  }
+  else {
+    snprintf(path, sizeof(path), "%s", tracefile);
+  }
+  if (rudp_trace_open(path, 0) < 0)
+    exit(1);
+  }
+
   /*
    * Create RUDP listener socket
    */
 
-  if ((rsock = rudp_socket(port)) == NULL) {
+  if ((rsock = threads > 1 ? rudp_socket_shared(port) : rudp_socket(port)) == NULL) {
   fprintf(stderr,"vs_recv: rudp_socket() failed\n");
   exit(1);
   }
@@ -104,19 +232,181 @@ int main(int argc, char* argv[]) {
 
   rudp_recvfrom_handler(rsock, rudp_receiver);
 
+  if (window > 0 && rudp_setsockopt(rsock, RUDP_OPT_WINDOW, &window, sizeof(window)) < 0) {
+    fprintf(stderr, "vs_recv: rudp_setsockopt() failed\n");
+    exit(1);
+  }
+  if (delack > 0 && rudp_setsockopt(rsock, RUDP_OPT_DELACK, &delack, sizeof(delack)) < 0) {
+    fprintf(stderr, "vs_recv: rudp_setsockopt() failed\n");
+    exit(1);
+  }
+  if (offload && rudp_setsockopt(rsock, RUDP_OPT_OFFLOAD, &offload, sizeof(offload)) < 0) {
+    fprintf(stderr, "vs_recv: rudp_setsockopt() failed\n");
+    exit(1);
+  }
+  if (noreplay && rudp_setsockopt(rsock, RUDP_OPT_NOREPLAY, &noreplay, sizeof(noreplay)) < 0) {
+    fprintf(stderr, "vs_recv: rudp_setsockopt() failed\n");
+    exit(1);
+  }
+  if (idle > 0 && rudp_setsockopt(rsock, RUDP_OPT_IDLE, &idle, sizeof(idle)) < 0) {
+    fprintf(stderr, "vs_recv: rudp_setsockopt() failed\n");
+    exit(1);
+  }
+  if (maxsessions > 0 && 
+      rudp_setsockopt(rsock, RUDP_OPT_MAXSESSIONS, &maxsessions, sizeof(maxsessions)) < 0) {
+    fprintf(stderr, "vs_recv: rudp_setsockopt() failed\n");
+    exit(1);
+  }
+
   /*
    * Register event handler callback function
    */
 
   rudp_event_handler(rsock, eventhandler);
 
+  /*
+   * Let the writer wake us up when we have paused for it
+   */
+
+  if ((rxself = malloc(sizeof(struct rxthread))) == NULL) {
+  fprintf(stderr, "vs_recv: malloc failed\n");
+  exit(1);
+  }
+  if (pipe(rxself->wakeup) < 0) {
+  perror("vs_recv: pipe");
+  exit(1);
+  }
+  fcntl(rxself->wakeup[0], F_SETFL, O_NONBLOCK);
+  rxself->rsock = rsock;
+  rxself->paused = 0;
+  if (event_fd(rxself->wakeup[0], rxwakeup, rxself, "rxwakeup") < 0) {
+  fprintf(stderr, "vs_recv: event_fd() failed\n");
+  exit(1);
+  }
+  pthread_mutex_lock(&wjobs_lock);
+  rxself->next = rxthreads;
+  rxthreads = rxself;
+  pthread_mutex_unlock(&wjobs_lock);
+
   /*
    * Hand over control to event manager
    */
 
   eventloop(0);
 
-  return (0);
+  return NULL;
+}
+
+/*
+ * writer: thread which does the file I/O, so that the receivers only
+ * copy data into buffers. The data of a file is written VS_WRITEBUF
+ * bytes at a time, and synced to disk before the file is reported received
+ */
+
+void *writer(void *arg) {
+  struct wjob *job;
+  struct rxthread *t;
+  int done, n;
+
+  for (;;) {
+  pthread_mutex_lock(&wjobs_lock);
+  while (wjobs == NULL)
+    pthread_cond_wait(&wjobs_cond, &wjobs_lock);
+  job = wjobs;
+  wjobs = job->next;
+  if (wjobs == NULL)
+    wjobs_tail = &wjobs;
+  pthread_mutex_unlock(&wjobs_lock);
+
+  for (done = 0; done < job->len; done += n) {
+    if ((n = write(job->fd, job->buf + done, job->len - done)) < 0) {
+    perror("vs_recv: write");
+    break;
+    }
+  }
+  free(job->buf);
+  pthread_mutex_lock(&wjobs_lock);
+  wjobs_bytes -= job->len;
+  if (wjobs_bytes < VS_WRITEMAX) {
+    for (t = rxthreads; t != NULL; t = t->next) {
+    if (t->paused) {
+      t->paused = 0;
+      if (write(t->wakeup[1], "", 1) < 0)
+      perror("vs_recv: write");
+    }
+    }
+  }
+  pthread_mutex_unlock(&wjobs_lock);
+  if (job->last == VS_TYPE_END) {
+    if (fsync(job->fd) < 0)
+    perror("vs_recv: fsync");
+    close(job->fd);
+    printf("vs_recv: received end of file \"%s\"\n", job->name);
+  }
+  else if (job->last) {
+    close(job->fd);
+  }
+  free(job);
+  }
+  return NULL;
+}
+
+/*
+ * rxwrite: hand the buffered data of a file over to the writer thread.
+ * last is passed on to the job. Once the writer is VS_WRITEMAX bytes
+ * behind, the thread stops reading its socket until the writer wakes it,
+ * so that the senders slow down to the speed of the disk
+ */
+
+static void rxwrite(struct rxfile *rx, int last) {
+  struct wjob *job;
+  int pause = 0;
+
+  if (rx->buflen == 0 && !last)
+  return;
+  if ((job = malloc(sizeof(struct wjob))) == NULL) {
+  fprintf(stderr, "vs_recv: malloc failed\n");
+  exit(1);
+  }
+  job->next = NULL;
+  job->fd = rx->fd;
+  job->buf = rx->buf;
+  job->len = rx->buflen;
+  job->last = last;
+  strcpy(job->name, rx->name);
+  rx->buf = NULL;
+  rx->buflen = 0;
+
+  pthread_mutex_lock(&wjobs_lock);
+  wjobs_bytes += job->len;
+  *wjobs_tail = job;
+  wjobs_tail = &job->next;
+  if (wjobs_bytes >= VS_WRITEMAX && !rxself->paused)
+  pause = rxself->paused = 1;
+  pthread_cond_signal(&wjobs_cond);
+  pthread_mutex_unlock(&wjobs_lock);
+  if (pause)
+  rudp_recv_pause(rxself->rsock, 1);
+}
+
+/*
+ * rxwakeup: callback function for the writer's wakeup. Read the socket 
+ * again, unless the thread has paused once more since
+ */
+
+static int rxwakeup(int fd, void *arg) {
+  struct rxthread *t = arg;
+  char buf[64];
+  int paused;
+
+  while (read(fd, buf, sizeof(buf)) > 0)
+  ;
+  pthread_mutex_lock(&wjobs_lock);
+  paused = t->paused;
+  pthread_mutex_unlock(&wjobs_lock);
+  if (!paused)
+  rudp_recv_pause(t->rsock, 0);
+  return 0;
 }
 
 /*
@@ -137,6 +427,8 @@ static struct rxfile *rxfind(struct sockaddr_in *addr) {
   exit(1);
   }
   rx->fileopen = 0;
+  rx->buf = NULL;
+  rx->buflen = 0;
   rx->remote = *addr;
   rx->next = rxhead;
   rxhead = rx;
@@ -157,6 +449,7 @@ static int rxdel(struct rxfile *rx) {
   return -1;
   }
   *rxp = rx->next;
+  free(rx->buf);
   free(rx);
   return 0;
 }
@@ -177,7 +470,7 @@ int eventhandler(rudp_socket_t rsocket, rudp_event_t event, struct sockaddr_in *
     ntohs(remote->sin_port));
     if ((rx = rxfind(remote))) {
     if (rx->fileopen) {
-      close(rx->fd);
+      rxwrite(rx, 1);
     }
     rxdel(rx);
     }
@@ -192,7 +485,7 @@ int eventhandler(rudp_socket_t rsocket, rudp_event_t event, struct sockaddr_in *
     fprintf(stderr, "vs_recv: prematurely closed communication with %s:%d\n",
       inet_ntoa(remote->sin_addr),
       ntohs(remote->sin_port));
-    close(rx->fd);
+    rxwrite(rx, 1);
     }
     rxdel(rx);
   } /* else ignore */
@@ -213,6 +506,7 @@ int rudp_receiver(rudp_socket_t rsocket, struct sockaddr_in *remote, char *buf,
   struct rxfile *rx;
   int namelen;
   int i;
+  int n;
 
   struct vsftp *vs = (struct vsftp *) buf;
   if (len < VS_MINLEN) {
@@ -263,8 +557,20 @@ int rudp_receiver(rudp_socket_t rsocket, struct sockaddr_in *remote, char *buf,
   len -= sizeof(vs->vs_type);
   /* len now is length of payload (data or file name) */
   if (rx->fileopen) {
-    if ((write(rx->fd, vs->vs_info.vs_filename, len)) < 0) {
-    perror("vs_recv: write");
+    /* Collect the data; the writer thread puts it on disk */
+    char *data = vs->vs_info.vs_filename;
+    while (len > 0) {
+    if (rx->buf == NULL && (rx->buf = malloc(VS_WRITEBUF)) == NULL) {
+      fprintf(stderr, "vs_recv: malloc failed\n");
+      exit(1);
+    }
+    n = VS_WRITEBUF - rx->buflen < len ? VS_WRITEBUF - rx->buflen : len;
+    memcpy(rx->buf + rx->buflen, data, n);
+    rx->buflen += n;
+    data += n;
+    len -= n;
+    if (rx->buflen == VS_WRITEBUF)
+      rxwrite(rx, 0);
     }
   }
   else {
@@ -276,12 +582,14 @@ int rudp_receiver(rudp_socket_t rsocket, struct sockaddr_in *remote, char *buf,
     fprintf(stderr, "vs_recv: END (%d bytes) from %s:%d\n",
     len, inet_ntoa(remote->sin_addr), ntohs(remote->sin_port));
   }
-  printf("vs_recv: received end of file \"%s\"\n", rx->name);
   if (rx->fileopen) {
-    close(rx->fd);
+    /* The writer reports the file once it is on disk */
+    rxwrite(rx, VS_TYPE_END);
     rxdel(rx);
   }
-  /* else ignore */
+  else {
+    printf("vs_recv: received end of file \"%s\"\n", rx->name);
+  }
   break;
   default:
   fprintf(stderr, "vs_recv: bad vsftp type %d from %s:%d\n",
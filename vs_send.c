@@ -12,6 +12,9 @@
 #include <string.h>
 #include <sys/types.h>
 #include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -21,21 +24,46 @@
 
 #define MAXPEERS 32  /* Max number of remote peers */
 #define MAXPEERNAMELEN 256  /* Max length of peer name */
+#define MAPDATA (65536 - 4)  /* File data per message with -m; with vs_type, the default RUDP_OPT_MAXMSG */
+
+/* A file being sent */
+struct txfile {
+  int fd;
+  rudp_socket_t rsock;
+  int blocked;  /* Number of peers whose RUDP queues are full */
+  char *map;  /* The file mapped into memory with -m, NULL if it is read */
+  off_t size;  /* Size of the mapped file */
+  off_t offset;  /* Offset of the data to send next from the mapping */
+  int closed;  /* The RUDP socket is being closed, nothing more is sent */
+  struct txfile *next;
+};
 
 /* Prototypes */
 int usage();
-int filesender(int fd, void *arg);
+void filesender(struct txfile *tx);
+int mapsender(struct txfile *tx);
 void send_file(char *filename);
+static struct txfile *txfind(rudp_socket_t rsock);
+static void txdel(struct txfile *tx);
+static void txclose(struct txfile *tx);
 int eventhandler(rudp_socket_t rsocket, rudp_event_t event, struct sockaddr_in *remote);
+int senthandler(rudp_socket_t rsocket, struct sockaddr_in *remote, const struct iovec *iov, int iovcnt);
 
 /* Global variables */
 int debug = 0;  /* Debug flag */
+int window = 0;  /* RUDP window size, 0 for the default */
+int congestion = -1;  /* RUDP congestion control algorithm, -1 for the default */
+int offload = 0;  /* Use UDP GSO/GRO */
+int mapfiles = 0;  /* Send files from a memory mapping */
+int earlydata = 0;  /* DATA packets sent along with the SYN */
+char *tracefile = NULL;  /* Trace RUDP into this file */
 struct sockaddr_in peers[MAXPEERS];  /* IP address and port */
 int npeers = 0;  /* Number of elements in peers */
+struct txfile *txfiles = NULL;  /* Files being sent */
 
 /* usage: how to use program */
 int usage() {
-  fprintf(stderr, "Usage: vs_send [-d] host1:port1 [host2:port2] ... file1 [file2]... \n");
+  fprintf(stderr, "Usage: vs_send [-d] [-v] [-w window] [-c none|newreno|pacing] [-g] [-m] [-e packets] [-T tracefile] host1:port1 [host2:port2] ... file1 [file2]... \n");
   exit(1);
 }
 
@@ -50,10 +78,38 @@ int main(int argc, char* argv[]) {
   /* Parse and collect arguments */
   opterr = 0;
 
-  while ((c = getopt(argc, argv, "d")) != -1) {
+  while ((c = getopt(argc, argv, "dvw:c:gme:T:")) != -1) {
     if (c == 'd') {
       debug = 1;
     }
+    else if (c == 'v') {
+      rudp_set_log_level(RUDP_LOG_DEBUG);
+    }
+    else if (c == 'w') {
+      window = atoi(optarg);
+    }
+    else if (c == 'c') {
+      if (strcmp(optarg, "none") == 0)
+        congestion = RUDP_CC_NONE;
+      else if (strcmp(optarg, "newreno") == 0)
+        congestion = RUDP_CC_NEWRENO;
+      else if (strcmp(optarg, "pacing") == 0)
+        congestion = RUDP_CC_PACING;
+      else
+        usage();
+    }
+    else if (c == 'g') {
+      offload = 1;
+    }
+    else if (c == 'm') {
+      mapfiles = 1;
+    }
+    else if (c == 'e') {
+      earlydata = atoi(optarg);
+    }
+    else if (c == 'T') {
+      tracefile = optarg;
+    }
     else 
       usage();
   }
@@ -96,6 +152,9 @@ int main(int argc, char* argv[]) {
     usage();
   }
 
+  if (tracefile != NULL && rudp_trace_open(tracefile, 0) < 0)
+    exit(1);
+
   /* Launch senders for each file */
   while (i < argc) { 
     send_file(argv[i++]);
@@ -110,6 +169,7 @@ int main(int argc, char* argv[]) {
  */
 
 int eventhandler(rudp_socket_t rsocket, rudp_event_t event, struct sockaddr_in *remote) {
+  struct txfile *tx;
   
   switch (event) {
   case RUDP_EVENT_TIMEOUT:
@@ -123,20 +183,41 @@ int eventhandler(rudp_socket_t rsocket, rudp_event_t event, struct sockaddr_in *
     }
     exit(1);
     break;
+  case RUDP_EVENT_WRITABLE:
+    /* Carry on reading the file once all peers can take more */
+    tx = txfind(rsocket);
+    if (tx != NULL && !tx->closed && --tx->blocked == 0) {
+      filesender(tx);
+    }
+    break;
   case RUDP_EVENT_CLOSED:
     if (debug) {
       fprintf(stderr, "rudp_sender: socket closed\n");
     }
+    /* RUDP has handed back all the messages, the mapping can go */
+    tx = txfind(rsocket);
+    if (tx != NULL) {
+      txdel(tx);
+    }
     break;
   }
   return 0;
 }
 
+/*
+ * senthandler: callback function for the messages sent from a file mapping.
+ * The mapping stays until the RUDP socket is closed, so there is nothing
+ * to do but to keep RUDP from copying the messages
+ */
+
+int senthandler(rudp_socket_t rsocket, struct sockaddr_in *remote, const struct iovec *iov, int iovcnt) {
+  return 0;
+}
+
 /*
  * send_file: initiate sending of a file. 
  * Create a RUDP socket for sending. Send the file name to the VS receiver.
- * Register a handler for input event, which will take care of sending
- * file data
+ * Then start sending the file data, as far as RUDP takes it
  */
 
 void send_file(char *filename) {
@@ -146,18 +227,56 @@ void send_file(char *filename) {
   int namelen;
   int file = 0;
   int p;
+  int ret;
+  int blocked = 0;
   rudp_socket_t rsock;
+  struct txfile *tx;
+  struct stat st;
+  char *map = NULL;
 
   if ((file = open(filename, O_RDONLY)) < 0) {
     perror("vs_sender: open");
     exit(-1);
   }
+  /* Files which cannot be mapped, such as pipes, are read */
+  if (mapfiles && fstat(file, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+    if (map == MAP_FAILED) {
+      perror("vs_sender: mmap");
+      map = NULL;
+    }
+    else {
+      madvise(map, st.st_size, MADV_SEQUENTIAL);
+    }
+  }
   rsock = rudp_socket(0);
   if (rsock == NULL) {
     fprintf(stderr, "vs_send: rudp_socket() failed\n");
     exit(1);
   }
   rudp_event_handler(rsock, eventhandler);
+  if (map != NULL && rudp_sendv_handler(rsock, senthandler) < 0) {
+    fprintf(stderr, "vs_send: rudp_sendv_handler() failed\n");
+    exit(1);
+  }
+  if (window > 0 && rudp_setsockopt(rsock, RUDP_OPT_WINDOW, &window, sizeof(window)) < 0) {
+    fprintf(stderr, "vs_send: rudp_setsockopt() failed\n");
+    exit(1);
+  }
+  if (congestion >= 0 && 
+      rudp_setsockopt(rsock, RUDP_OPT_CONGESTION, &congestion, sizeof(congestion)) < 0) {
+    fprintf(stderr, "vs_send: rudp_setsockopt() failed\n");
+    exit(1);
+  }
+  if (offload && rudp_setsockopt(rsock, RUDP_OPT_OFFLOAD, &offload, sizeof(offload)) < 0) {
+    fprintf(stderr, "vs_send: rudp_setsockopt() failed\n");
+    exit(1);
+  }
+  if (earlydata > 0 && 
+      rudp_setsockopt(rsock, RUDP_OPT_EARLYDATA, &earlydata, sizeof(earlydata)) < 0) {
+    fprintf(stderr, "vs_send: rudp_setsockopt() failed\n");
+    exit(1);
+  }
 
   vs.vs_type = htonl(VS_TYPE_BEGIN);
 
@@ -177,41 +296,75 @@ void send_file(char *filename) {
         filename, vslen, 
         inet_ntoa(peers[p].sin_addr), ntohs(peers[p].sin_port));
     }
-    if (rudp_sendto(rsock, (char *) &vs, vslen, &peers[p]) < 0) {
+    if ((ret = rudp_sendto(rsock, (char *) &vs, vslen, &peers[p])) < 0) {
       fprintf(stderr,"rudp_sender: send failure\n");
       rudp_close(rsock);    
       return;
     }
+    blocked += ret;
+  }
+
+  if ((tx = malloc(sizeof(struct txfile))) == NULL) {
+    fprintf(stderr, "vs_send: malloc failed\n");
+    exit(1);
+  }
+  tx->fd = file;
+  tx->rsock = rsock;
+  tx->blocked = blocked;
+  tx->map = map;
+  tx->size = map != NULL ? st.st_size : 0;
+  tx->offset = 0;
+  tx->closed = 0;
+  tx->next = txfiles;
+  txfiles = tx;
+  if (tx->blocked == 0) {
+    filesender(tx);
   }
-  event_fd(file, filesender, rsock, "filesender");
 }
 
 /*
- * filesender: callback function for handling sending of the file.
- * Will be called when data is available on the file (which is always
- * true, until the file is closed...). 
- * Send file data. Detect end of file and tell VS peers that transfer is
- * complete
+ * filesender: send file data to the VS peers until the RUDP queue for one
+ * of them is full, in which case sending resumes on RUDP_EVENT_WRITABLE.
+ * Detect end of file and tell VS peers that transfer is complete
  */
 
-int filesender(int file, void *arg) {
-  rudp_socket_t rsock =   (rudp_socket_t) arg;
+void filesender(struct txfile *tx) {
+  rudp_socket_t rsock = tx->rsock;
   int bytes;
   struct vsftp vs;
   int vslen;
   int p;
+  int ret;
 
-  bytes = read(file, &vs.vs_info.vs_data,VS_MAXDATA);
+  while (tx->blocked == 0) {
+  if (tx->map != NULL) {
+  if (mapsender(tx) < 0) {
+    txclose(tx);
+    return;
+  }
+  if (tx->offset < tx->size)
+    continue;
+  bytes = 0;
+  }
+  else
+  bytes = read(tx->fd, &vs.vs_info.vs_data,VS_MAXDATA);
   if (bytes < 0) {
   perror("filesender: read");
-  event_fd_delete(filesender, rsock);
-  rudp_close(rsock);    
+  txclose(tx);
+  return;
   }
   else if (bytes == 0) {
   vs.vs_type = htonl(VS_TYPE_END);
   vslen = sizeof(vs.vs_type);
   for (p = 0; p < npeers; p++) {
     if (debug) {
+    struct rudp_stats st;
+    if (rudp_get_stats(rsock, &peers[p], &st) == 0) {
+      fprintf(stderr, "vs_send: %s:%d: %llu packets, %llu bytes sent, %llu retransmits, "
+        "%llu timeouts, srtt %d us, handshake %d us\n",
+        inet_ntoa(peers[p].sin_addr), htons(peers[p].sin_port), st.packets_sent, 
+        st.bytes_sent, st.retransmits, st.timeouts, st.srtt, st.handshake);
+    }
     fprintf(stderr, "vs_send: send END (%d bytes) to %s:%d\n", 
       vslen, inet_ntoa(peers[p].sin_addr), htons(peers[p].sin_port));
     }
@@ -220,26 +373,104 @@ int filesender(int file, void *arg) {
     break;
     }
   }
-  event_fd_delete(filesender, rsock);
-  rudp_close(rsock);    
+  txclose(tx);
+  return;
   }
   else {
   vs.vs_type = htonl(VS_TYPE_DATA);
   vslen = sizeof(vs.vs_type) + bytes;
-    for (p = 0; p < npeers; p++) {
-      if (debug) {
+    if (debug) {
+      for (p = 0; p < npeers; p++) {
         fprintf(stderr, "vs_send: send DATA (%d bytes) to %s:%d\n", 
         vslen, inet_ntoa(peers[p].sin_addr), htons(peers[p].sin_port));        
       }
-      if (rudp_sendto(rsock, (char *) &vs, vslen, &peers[p]) < 0) {
-        fprintf(stderr,"rudp_sender: send failure\n");
-        event_fd_delete(filesender, rsock);
-        rudp_close(rsock);    
-        break;
-      }
     }
+    /* One copy of the data for all peers */
+    if ((ret = rudp_sendto_many(rsock, (char *) &vs, vslen, peers, npeers)) < 0) {
+      fprintf(stderr,"rudp_sender: send failure\n");
+      txclose(tx);
+      return;
+    }
+    tx->blocked += ret;
+  }
   }
+}
+
+/*
+ * mapsender: send the next MAPDATA bytes of a mapped file to all VS peers.
+ * The message refers to the mapping, so it is shared by all peers instead
+ * of being copied for each of them
+ */
+
+int mapsender(struct txfile *tx) {
+  static u_int32_t vs_type;
+  struct iovec iov[2];
+  int bytes;
+  int p;
+  int ret;
+
+  vs_type = htonl(VS_TYPE_DATA);
+  bytes = tx->size - tx->offset < MAPDATA ? tx->size - tx->offset : MAPDATA;
+  iov[0].iov_base = &vs_type;
+  iov[0].iov_len = sizeof(vs_type);
+  iov[1].iov_base = tx->map + tx->offset;
+  iov[1].iov_len = bytes;
+  for (p = 0; p < npeers; p++) {
+    if (debug) {
+      fprintf(stderr, "vs_send: send DATA (%d bytes) to %s:%d\n", 
+        (int) sizeof(vs_type) + bytes, inet_ntoa(peers[p].sin_addr), htons(peers[p].sin_port));
+    }
+    if ((ret = rudp_sendv(tx->rsock, iov, 2, &peers[p])) < 0) {
+      fprintf(stderr,"rudp_sender: send failure\n");
+      return -1;
+    }
+    tx->blocked += ret;
+  }
+  tx->offset += bytes;
   return 0;
 }
 
+/*
+ * txfind: helper function to lookup the txfile descriptor of a RUDP socket
+ */
+
+static struct txfile *txfind(rudp_socket_t rsock) {
+  struct txfile *tx;
 
+  for (tx = txfiles; tx != NULL; tx = tx->next) {
+    if (tx->rsock == rsock)
+      return tx;
+  }
+  return NULL;
+}
+
+/*
+ * txclose: helper function to close the RUDP socket of a file. Messages
+ * still queued refer to a mapping, so it is freed on RUDP_EVENT_CLOSED, 
+ * once RUDP has handed them all back
+ */
+
+static void txclose(struct txfile *tx) {
+  rudp_socket_t rsock = tx->rsock;
+
+  tx->closed = 1;
+  if (tx->map == NULL)
+    txdel(tx);
+  rudp_close(rsock);
+}
+
+/*
+ * txdel: helper function to close the file, unlink and free a txfile descriptor
+ */
+
+static void txdel(struct txfile *tx) {
+  struct txfile **link = &txfiles;
+
+  while (*link != tx)
+    link = &(*link)->next;
+  *link = tx->next;
+  if (tx->map != NULL)
+    munmap(tx->map, tx->size);
+  close(tx->fd);
+  free(tx);
+}
@@ -1,6 +1,6 @@
 #define VS_MINLEN    4
 #define VS_FILENAMELENGTH 128
-#define VS_MAXDATA    128
+#define VS_MAXDATA    7996 /* With vs_type, a message of eight RUDP packets */
 
 #define VS_TYPE_BEGIN    1
 #define VS_TYPE_DATA    2